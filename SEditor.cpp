@@ -1,500 +1,976 @@
+#define NCURSES_WIDECHAR 1
 #include <ncurses.h>
-#include <fstream>
+#include "SEditorCore.h"
 #include <string>
 #include <vector>
-#include <set>
 #include <algorithm>
 #include <ctime>
 #include <cctype>
-#include <thread>
-#include <atomic>
-#include <mutex>
-#include <iostream>
-#include <fstream>
-#include <string>
-#include <ctime>
-#include <mutex>
-#include <iostream>
-#include <string>
+#include <memory>
+#include <cstdlib>
+#include <cmath>
+#include <clocale>
+#include <langinfo.h>
+#include <poll.h>
+
+using namespace std;
+
 #define ARROW_LEFT  1000
 #define ARROW_RIGHT 1001
 #define ARROW_UP    1002
 #define ARROW_DOWN  1003
-enum class LogLevel { DEBUG, INFO, WARNING, ERROR };
-void WriteLog(LogLevel level, const std::string& msg) {
-    switch(level) {
-        case LogLevel::DEBUG: std::cerr << "[DEBUG] "; break;
-        case LogLevel::INFO: std::cerr << "[INFO] "; break;
-        case LogLevel::WARNING: std::cerr << "[WARNING] "; break;
-        case LogLevel::ERROR: std::cerr << "[ERROR] "; break;
+// 括号粘贴的起止标记，由 define_key 映射成这两个键码
+#define KEY_PASTE_BEGIN (KEY_MAX + 1)
+#define KEY_PASTE_END   (KEY_MAX + 2)
+
+const auto FRAME_INTERVAL = chrono::milliseconds(16);   // 连续输入时两帧的最小间隔
+const int PASTE_TIMEOUT_MS = 500;                       // 粘贴中途断流超过这么久就当作结束
+const auto DISK_CHECK_INTERVAL = chrono::seconds(1);    // 检查文件是否被别的程序改过的间隔
+
+// 屏幕影子帧：每个单元格是字符、可选的一个组合字符和属性。新帧与上一帧比较后只输出变化的区段，
+// 视口滚动时先用终端滚动区域整体移动，再补画新露出的行。宽字符占两格，第二格记作 WIDE_TAIL
+class Renderer {
+public:
+    struct Cell {
+        uint32_t ch, comb;
+        chtype attr;
+        bool operator==(const Cell& o) const { return ch == o.ch && comb == o.comb && attr == o.attr; }
+        bool operator!=(const Cell& o) const { return !(*this == o); }
+    };
+    static constexpr uint32_t WIDE_TAIL = 0xFFFFFFFF;
+
+    void begin(int r, int c) {
+        if (r != rows || c != cols) {
+            rows = r;
+            cols = c;
+            shadow.assign(rows * cols, Cell{0, 0, 0});
+            pending_scroll = 0;
+        }
+        next.assign(rows * cols, Cell{' ', 0, A_NORMAL});
     }
-    std::cerr << msg << std::endl;
-}
+    int width() const { return cols; }
 
-std::mutex logMutex;
+    // 在 (y, x) 写入 UTF-8 文字 s[0, n)，写到第 limit 列（默认屏幕宽度）为止；返回写完后的列。
+    // 纯 ASCII 的文字逐字节写入，不解码
+    int put(int y, int x, const char* s, size_t n, chtype attr = A_NORMAL, int limit = -1) {
+        Cell* r = &next[y * cols];
+        int end = limit < 0 ? cols : std::min(limit, cols);
+        if (x >= end) return x;
+        // 盖住宽字符的一半时，另一半换成空格
+        if (x > 0 && r[x].ch == WIDE_TAIL) r[x - 1] = Cell{' ', 0, r[x - 1].attr};
+        if (is_ascii(s, n)) {
+            for (size_t i = 0; i < n && x < end; ++i, ++x) r[x] = Cell{cell(s[i]), 0, attr};
+        } else {
+            for (size_t i = 0; i < n && x < end;) {
+                uint32_t cp = utf8_next(s, n, i);
+                int w = char_width(cp);
+                if (!utf8 && cp >= 128) {
+                    // 终端不是 UTF-8 时非 ASCII 字符显示成 '?'，宽字符的后一半留空
+                    if (w == 0) continue;
+                    if (w == 2 && x + 1 >= end) break;
+                    r[x++] = Cell{'?', 0, attr};
+                    if (w == 2) r[x++] = Cell{' ', 0, attr};
+                    continue;
+                }
+                if (w == 0) {
+                    // 组合字符叠到前一个字符上；零宽的格式字符不输出
+                    int px = x > 0 && r[x - 1].ch == WIDE_TAIL ? x - 2 : x - 1;
+                    if (px >= 0 && r[px].comb == 0 && !(cp >= 0x2000 && cp <= 0x206F) && cp != 0xFEFF)
+                        r[px].comb = cp;
+                    continue;
+                }
+                if (w == 2 && x + 1 >= end) {
+                    r[x++] = Cell{' ', 0, attr};
+                    break;
+                }
+                r[x++] = Cell{cell(cp), 0, attr};
+                if (w == 2) r[x++] = Cell{WIDE_TAIL, 0, attr};
+            }
+        }
+        if (x < cols && r[x].ch == WIDE_TAIL) r[x] = Cell{' ', 0, r[x].attr};
+        return x;
+    }
+    // 把 [x, x+n) 的属性换成 attr，字符不变
+    void style(int y, int x, int n, chtype attr) {
+        Cell* r = &next[y * cols];
+        for (int e = std::min(cols, x + n); x < e; ++x) r[x].attr = attr;
+    }
+    // 文本区 [0, region) 现在从文件第 first 行开始显示
+    void set_origin(int region, int first) {
+        if (region == scroll_region) pending_scroll += first - origin;
+        scroll_region = region;
+        origin = first;
+    }
+    void clear_row(int y) { std::fill(next.begin() + y * cols, next.begin() + (y + 1) * cols, Cell{' ', 0, A_NORMAL}); }
+    void invalidate() { std::fill(shadow.begin(), shadow.end(), Cell{0, 0, 0}); }
+    void invalidate_row(int y) { std::fill(shadow.begin() + y * cols, shadow.begin() + (y + 1) * cols, Cell{0, 0, 0}); }
 
-using namespace std;
+    // 输出与上一帧不同的单元格，返回本帧写出的单元格数
+    size_t flush() {
+        int d = pending_scroll;
+        pending_scroll = 0;
+        if (d != 0 && std::abs(d) < scroll_region) {
+            setscrreg(0, scroll_region - 1);
+            scrollok(stdscr, TRUE);
+            scrl(d);
+            scrollok(stdscr, FALSE);
+            setscrreg(0, rows - 1);
+            auto row = [&](int y) { return shadow.begin() + y * cols; };
+            if (d > 0) {
+                std::copy(row(d), row(scroll_region), row(0));
+                std::fill(row(scroll_region - d), row(scroll_region), Cell{' ', 0, A_NORMAL});
+            } else {
+                std::copy_backward(row(0), row(scroll_region + d), row(scroll_region));
+                std::fill(row(0), row(-d), Cell{' ', 0, A_NORMAL});
+            }
+        }
+        size_t written = 0;
+        for (int y = 0; y < rows; ++y) {
+            const Cell* n = &next[y * cols];
+            Cell* s = &shadow[y * cols];
+            for (int x = 0; x < cols;) {
+                if (n[x] == s[x]) { ++x; continue; }
+                // 宽字符只改了后一半时从前一半开始画
+                int start = x > 0 && n[x].ch == WIDE_TAIL ? x - 1 : x;
+                while (x < cols && n[x] != s[x]) ++x;
+                emit(y, start, n + start, x - start);
+                std::copy(n + start, n + x, s + start);
+                written += x - start;
+            }
+        }
+        cells_written += written;
+        return written;
+    }
+    size_t cells_written = 0;
+    bool utf8 = true;            // 终端按 UTF-8 解释输出
 
-// 关键词集合
-const set<string> cpp_keywords = {
-    "int","for","if","else","while","return","switch","case","break","const","void","class",
-    "public","private","protected","struct","new","delete","virtual","override","static","using",
-    "namespace","include","this","template","typename","auto","long","short","unsigned","signed",
-    "operator","try","catch","throw"
-};
-const set<string> py_keywords = {
-    "def","if","else","elif","for","while","return","import","from","class","try","except",
-    "finally","with","as","lambda","pass","break","continue","yield","in","is","not","and","or",
-    "print","self","global","nonlocal","assert","del","raise"
-};
-const set<string> js_keywords = {
-    "function","var","let","const","if","else","for","while","return","switch","case","break",
-    "class","constructor","new","import","export","extends","from","try","catch","finally","throw"
-};
-const set<string> java_keywords = {
-    "int","public","private","protected","void","class","static","final","return","if","else","for",
-    "while","switch","case","break","new","import","package","extends","implements","try","catch",
-    "finally","this","super"
-};
-const set<string> json_keywords = {"true","false","null"};
+private:
+    int rows = 0, cols = 0;
+    int scroll_region = 0, origin = 0, pending_scroll = 0;
+    vector<Cell> next, shadow;
+    vector<chtype> line;
 
-const int CACHE_SIZE = 100;  // 缓存窗口大小，可调整
+    // 控制字符不能原样送给终端，制表符先按一格显示
+    static uint32_t cell(uint32_t c) {
+        if (c == '\t') return ' ';
+        if (c < 32 || (c >= 127 && c < 160)) return '?';
+        return c;
+    }
+    // 全是 ASCII 的区段照旧一次写出，有宽字符或组合字符时逐格写
+    void emit(int y, int x, const Cell* c, int n) {
+        bool ascii = true;
+        for (int i = 0; i < n && ascii; ++i) ascii = c[i].ch < 128 && c[i].comb == 0;
+        if (ascii) {
+            line.resize(n);
+            for (int i = 0; i < n; ++i) line[i] = c[i].ch | c[i].attr;
+            mvaddchnstr(y, x, line.data(), n);
+            return;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (c[i].ch == WIDE_TAIL) continue;
+            wchar_t wc[3] = {(wchar_t)c[i].ch, (wchar_t)c[i].comb, 0};
+            cchar_t cc;
+            setcchar(&cc, wc, c[i].attr & A_ATTRIBUTES & ~A_COLOR, PAIR_NUMBER(c[i].attr), nullptr);
+            mvadd_wch(y, x + i, &cc);
+        }
+    }
+};
 
 struct EditorState {
-    vector<string> cache_lines;   // 缓存当前窗口附近的若干行
-int file_rowoff = 0;         // 当前缓存内容在文件中的起始行号
-int total_lines = 0;         // 文件总行数
-vector<bool> dirty_flags;    // 缓存区每行是否被修改
+    MappedFile file;             // 原始文件的只读映射
+    BlockCache cache;            // 映射中哪些块已在内存
+    int last_rowoff = 0;         // 上一帧的视口，用来判断滚动方向
+    PieceTable buf;              // 整个文件的文本，所有读写都经过它
+    UndoLog undo;                // 撤销/重做历史
+    EditJournal journal;         // 崩溃恢复用的编辑日志
+    Highlighter hl;
+    ColumnCache columns;               // 行内字节偏移和显示列的对应
+    ColumnMap plain_columns;           // 文字未就绪的行临时按一字节一列排版
+    Renderer screen;
+    shared_ptr<IndexJob> index_job;   // 非空表示还在建立索引
+    FileWatcher watcher;
+    bool follow = false;               // 跟随文件末尾的追加
     string filename, statusmsg;
     std::mutex file_mutex;
-    std::vector<std::streampos> line_offsets;
-    std::atomic<bool> loading{false};
-    std::atomic<bool> stop_loading{false};
-    int loading_target_row = 0;
     int cx = 0, cy = 0;
     int rowoff = 0;
+    int coloff = 0;                    // 不换行时的水平滚动
+    bool wrap = false;                 // 自动换行
+    uint64_t wrapoff = 0;              // 自动换行时顶行从 rowoff 行的第几段开始
     bool dirty = false;
     bool newfile = false;
     // 搜索相关
     string search_word = "";
-    vector<pair<int, int>> search_results;
-    int search_idx = 0;
+    vector<uint64_t> search_results;   // 命中的文档偏移，升序
+    vector<uint32_t> search_lens;      // 正则模式下每个命中的长度
+    bool search_regex = false;
+    size_t search_idx = 0;
+    shared_ptr<SearchJob> search_job;
+    uint64_t search_version = 0;       // 结果对应的文档版本
+    uint64_t search_from = 0;          // 等待跳转的起点
+    bool search_jump = false;
     bool search_flash = false;
+    bool show_stats = false;           // 统计浮层
+    bool minimap = false;              // 最右一列显示命中分布和可见范围
+    shared_ptr<HitDensity> search_density;  // 当前搜索的命中分布，随结果一起失效
+    // JSON 结构与折叠
+    shared_ptr<JsonIndexJob> json_job;
+    shared_ptr<JsonIndex> json;
+    FoldSet folds;                     // 随编辑平移，和文档行号保持一致
+    // 代码文件的括号与缩进块索引，随编辑增量更新
+    BlockIndex blocks;
+    uint64_t bracket_version = ~0ull, bracket_pos = 0;    // 配对括号高亮对应的文档版本和光标位置
+    uint64_t bracket_hl[2] = {UINT64_MAX, UINT64_MAX};
+    // 磁盘上的文件被别的程序改了
+    DiskIdentity disk;                       // 打开或重新加载时文件的身份
+    shared_ptr<BlockHashJob> disk_hashes;    // 当时的块哈希；保存后文档不再对应映射的文件，为空
+    shared_ptr<ReloadJob> reload_job;
+    chrono::steady_clock::time_point next_disk_check;
+    bool disk_changed = false;               // 有没能合并进来的外部修改，保存前要确认
+    bool overwrite_armed = false;            // 已经提示过，再按一次 ^O 就覆盖
+    // 目录搜索
+    string grep_root = ".";
+    string grep_word;
+    shared_ptr<GrepJob> grep_job;
+    vector<GrepHit> grep_hits;         // 已取回的结果，搜索结束后按路径和行号排好
+    bool grep_sorted = false;
+    size_t grep_sel = 0, grep_top = 0; // 选中的和列表最上面的一条
+    size_t frame_cells = 0;            // 上一帧输出的单元格数
     clock_t last_search_time = 0;
 };
 
-bool is_code_file(const string& filename) {
-    size_t pos = filename.find_last_of('.');
-    if (pos == string::npos) return false;
-    string ext = filename.substr(pos + 1);
-    vector<string> code_ext = {"cpp", "py", "js", "json", "java"};
-    return find(code_ext.begin(), code_ext.end(), ext) != code_ext.end();
-}
-
 string get_ext(const string& filename) {
     size_t pos = filename.find_last_of('.');
     if (pos == string::npos) return "";
     return filename.substr(pos + 1);
 }
 
-// 缓存窗口大小（可自行调整）
-#define CACHE_SIZE 100
+bool is_code_file(const string& filename) {
+    return find_lang(get_ext(filename)) != nullptr;
+}
 
-void load_cache(EditorState &ed, int target_row) {
-    if (ed.line_offsets.empty() || ed.filename.empty()) return;
-    int start = std::max(0, target_row - CACHE_SIZE / 2);
-    int end = std::min(ed.total_lines, start + CACHE_SIZE);
+bool is_json(EditorState &ed) {
+    return get_ext(ed.filename) == "json";
+}
 
-    std::ifstream fin(ed.filename);
-    if (!fin) {
-        WriteLog(LogLevel::ERROR, "load_cache: failed to open file " + ed.filename);
-        return;
-    }
+bool is_python(EditorState &ed) {
+    return get_ext(ed.filename) == "py";
+}
 
-    ed.cache_lines.clear();
-    ed.dirty_flags.clear();
-
-    for (int i = start; i < end; ++i) {
-        fin.clear(); // 清除状态
-        fin.seekg(ed.line_offsets[i]);
-        std::string s;
-        if (!std::getline(fin, s)) break;
-        ed.cache_lines.push_back(s);
-        ed.dirty_flags.push_back(false);
-    }
-    ed.file_rowoff = start; // 当前缓存窗口的起始行号
-    WriteLog(LogLevel::DEBUG, "load_cache: from line " + std::to_string(start) + " to " + std::to_string(end));
-}
-
-void draw_code_row(const string& line, int y, const string& ext, EditorState &ed, int filerow) {
-    int x = 0;
-    const set<string>* keywords = nullptr;
-    if (ext == "cpp") keywords = &cpp_keywords;
-    else if (ext == "py") keywords = &py_keywords;
-    else if (ext == "js") keywords = &js_keywords;
-    else if (ext == "java") keywords = &java_keywords;
-    else if (ext == "json") keywords = &json_keywords;
-
-    int highlight_start = -1, highlight_len = 0;
-    if (ed.search_flash && !ed.search_word.empty()) {
-        if (!ed.search_results.empty() && ed.search_idx < (int)ed.search_results.size()) {
-            int sy = ed.search_results[ed.search_idx].first;
-            int sx = ed.search_results[ed.search_idx].second;
-            if (sy == filerow) {
-                highlight_start = sx;
-                highlight_len = ed.search_word.size();
-            }
-        }
+size_t search_match_len(EditorState &ed) {
+    if (ed.search_idx < ed.search_lens.size()) return ed.search_lens[ed.search_idx];
+    return ed.search_word.size();
+}
+
+// 当前搜索命中若落在 filerow 行，返回其列号，否则 -1
+int64_t search_hit_col(EditorState &ed, int filerow, uint64_t linelen) {
+    if (ed.search_idx >= ed.search_results.size()) return -1;
+    uint64_t hit = ed.search_results[ed.search_idx];
+    uint64_t ls = ed.buf.line_start(filerow);
+    if (hit < ls || hit > ls + linelen) return -1;
+    return hit - ls;
+}
+
+// 文档 [a, b) 中来自原始文件的部分是否都已在内存；first_orig 返回其中第一个原始文件偏移
+bool text_ready(EditorState &ed, uint64_t a, uint64_t b, int64_t* first_orig = nullptr) {
+    const char* base = ed.file.data;
+    bool ok = true;
+    if (first_orig) *first_orig = -1;
+    ed.buf.for_each_segment(a, b - a, [&](const char* p, size_t n) {
+        if (!base || p < base || p >= base + ed.file.size) return;
+        if (first_orig && *first_orig < 0) *first_orig = p - base;
+        if (!ed.cache.ready(p - base, p - base + n)) ok = false;
+    });
+    return ok;
+}
+
+// 文字区的宽度：显示命中分布栏时让出最右一列
+int text_cols(EditorState &ed, int cols) {
+    return ed.minimap && cols > 1 ? cols - 1 : cols;
+}
+
+// 命中分布栏 h 行各自的命中数：行按文档偏移均分，从搜索线程累加的桶里求和。返回最大值
+uint64_t minimap_counts(EditorState &ed, int h, vector<uint64_t> &n) {
+    n.assign(h, 0);
+    uint64_t peak = 0;
+    if (!ed.search_density) return 0;
+    for (int y = 0; y < h; ++y) {
+        size_t a = HitDensity::BUCKETS * y / h, b = std::max(a + 1, HitDensity::BUCKETS * (y + 1) / h);
+        n[y] = ed.search_density->sum(a, b);
+        peak = std::max(peak, n[y]);
     }
+    return peak;
+}
 
-    for (size_t i = 0; i < line.size();) {
-        // 搜索高亮
-        if (highlight_start == x) {
-            attron(COLOR_PAIR(5) | A_STANDOUT);
-            for (int k = 0; k < highlight_len && i < line.size(); ++k, ++i, ++x)
-                mvaddch(y, x, line[i]);
-            attroff(COLOR_PAIR(5) | A_STANDOUT);
-            continue;
-        }
-        // 注释高亮
-        if ((ext == "cpp" || ext == "java" || ext == "js") && line[i] == '/' && i+1 < line.size() && line[i+1] == '/') {
-            attron(COLOR_PAIR(3));
-            mvprintw(y, x, "%s", line.substr(i).c_str());
-            attroff(COLOR_PAIR(3));
-            break;
-        }
-        if (ext == "py" && line[i] == '#') {
-            attron(COLOR_PAIR(3));
-            mvprintw(y, x, "%s", line.substr(i).c_str());
-            attroff(COLOR_PAIR(3));
-            break;
-        }
-        // 字符串高亮
-        if (line[i] == '"' || line[i] == '\'') {
-            int quote = line[i];
-            attron(COLOR_PAIR(2));
-            mvaddch(y, x++, line[i++]);
-            while (i < line.size()) {
-                mvaddch(y, x++, line[i]);
-                if (line[i++] == quote) break;
-            }
-            attroff(COLOR_PAIR(2));
-            continue;
-        }
-        // 关键字高亮
-        if (keywords && (isalpha(line[i]) || line[i] == '_')) {
-            string word;
-            size_t start = i;
-            while (i < line.size() && (isalnum(line[i]) || line[i] == '_')) word += line[i++];
-            if (keywords->count(word)) {
-                attron(COLOR_PAIR(1));
-                mvprintw(y, x, "%s", word.c_str());
-                attroff(COLOR_PAIR(1));
-            } else {
-                mvprintw(y, x, "%s", word.c_str());
-            }
-            x += word.size();
-            continue;
-        }
-        // 数字高亮
-        if (isdigit(line[i])) {
-            size_t start = i;
-            while (i < line.size() && isdigit(line[i])) ++i;
-            attron(COLOR_PAIR(4));
-            mvprintw(y, x, "%s", line.substr(start, i-start).c_str());
-            attroff(COLOR_PAIR(4));
-            x += i - start;
-            continue;
-        }
-        // 其它
-        mvaddch(y, x++, line[i++]);
+// 最右一列：命中越密字符越重，当前可见的范围反显，像滚动条一样按文档偏移均分
+void draw_minimap(EditorState &ed, int rows, int cols) {
+    int h = rows - 3;
+    if (!ed.minimap || h <= 0 || cols <= 1) return;
+    static const char marks[] = " .:+*#";
+    vector<uint64_t> n;
+    uint64_t peak = minimap_counts(ed, h, n), total = ed.buf.length();
+    auto row_of = [&](uint64_t pos) { return total ? std::min<uint64_t>(pos * h / total, h - 1) : 0; };
+    uint64_t top = row_of(ed.buf.line_start(ed.rowoff));
+    uint64_t bottom = row_of(ed.buf.line_start(std::min<size_t>(ed.rowoff + h, ed.buf.line_count() - 1)));
+    int64_t cur = ed.search_idx < ed.search_results.size() ? row_of(ed.search_results[ed.search_idx]) : -1;
+    for (int y = 0; y < h; ++y) {
+        // 按对数分级，稀疏处的零星命中和密集区都看得出来
+        char c = marks[n[y] ? std::min(5, 1 + (int)(4 * log2(n[y] + 1) / log2(peak + 1))) : 0];
+        attr_t attr = n[y] ? COLOR_PAIR(5) : A_DIM;
+        if (y >= (int64_t)top && y <= (int64_t)bottom) attr |= A_REVERSE;
+        if (y == cur) attr |= A_BOLD;
+        ed.screen.put(y, cols - 1, &c, 1, attr);
     }
 }
 
-void async_load_cache(EditorState& ed, int target_row) {
-    // 防止多重加载
-    if (ed.loading) return;
-    ed.loading = true;
-    ed.stop_loading = false;
-    ed.loading_target_row = target_row;
+const ColumnMap &line_columns(EditorState &ed, int line) {
+    return ed.columns.get(ed.buf, line);
+}
 
-    WriteLog(LogLevel::DEBUG, "Begin async_load_cache at row " + std::to_string(target_row) + " for file: " + ed.filename);
+// 光标的显示列
+uint64_t cursor_col(EditorState &ed) {
+    return line_columns(ed, ed.cy).to_col(ed.cx);
+}
 
-    std::thread([&ed, target_row]() {
-        std::ifstream fin(ed.filename);
-        if (!fin) {
-            WriteLog(LogLevel::ERROR, "async_load_cache failed to open file: " + ed.filename);
-            ed.loading = false;
-            return;
+// 换到别的行后把光标放在同一显示列上，不落在字符中间
+void keep_column(EditorState &ed, uint64_t col) {
+    ed.cx = line_columns(ed, ed.cy).to_byte(col);
+}
+
+// 排版用的列映射：文字还没读进内存的行先按一字节一列，不为此等磁盘。
+// 返回的引用可能是共用的临时映射，下次调用前用完
+const ColumnMap &layout_columns(EditorState &ed, int line) {
+    uint64_t ls = ed.buf.line_start(line), len = ed.buf.line_length(line);
+    if (len > Highlighter::LONG_LINE || text_ready(ed, ls, ls + len)) return line_columns(ed, line);
+    ed.plain_columns.len = len;
+    return ed.plain_columns;
+}
+
+// 自动换行时一行占的屏幕行数；总留出光标停在行尾的位置
+uint64_t wrap_height(EditorState &ed, int line, int cols) {
+    return layout_columns(ed, line).wrap_rows(cols);
+}
+
+// 自动换行时光标在它那一行的第几个屏幕行，x 返回屏幕列
+uint64_t cursor_wrap_row(EditorState &ed, int cols, uint64_t &x) {
+    const ColumnMap &cm = layout_columns(ed, ed.cy);
+    uint64_t vx = cm.to_col(ed.cx), start;
+    uint64_t sub = cm.wrap_row(vx, cols, start);
+    x = vx - start;
+    return sub;
+}
+
+// 光标所在的屏幕行，最多数到 limit
+int cursor_screen_row(EditorState &ed, int cols, int limit) {
+    if (!ed.wrap) return ed.cy - ed.rowoff - ed.folds.hidden(ed.rowoff, ed.cy);
+    if (ed.cy < ed.rowoff) return 0;
+    uint64_t x, y = cursor_wrap_row(ed, cols, x);
+    for (int l = ed.rowoff; l < ed.cy && y < limit + ed.wrapoff; l = ed.folds.next(l)) y += wrap_height(ed, l, cols);
+    y -= ed.wrapoff;
+    return std::min<uint64_t>(y, limit);
+}
+
+// 在第 y 屏幕行画文件第 filerow 行从第 from 显示列起的一屏宽切片。
+// 普通行整行分析并走缓存；超长行只分析这一段，读、分析、绘制都与行长无关
+bool draw_line_slice(EditorState &ed, int y, int filerow, uint64_t from, uint8_t state, int cols) {
+    uint64_t ls = ed.buf.line_start(filerow), len = ed.buf.line_length(filerow);
+    bool longline = len > Highlighter::LONG_LINE;
+    // 超长行不建列映射，字节偏移就是列
+    uint64_t a = std::min(from, len), n = std::min<uint64_t>(cols, len - a);
+    if (!text_ready(ed, longline ? ls + a : ls, longline ? ls + a + n : ls + len)) {
+        ed.screen.put(y, 0, "~", 1, A_DIM);
+        return false;
+    }
+    const ColumnMap &cm = line_columns(ed, filerow);
+    a = cm.to_byte(from);
+    // 左边切在宽字符中间时跳过它
+    if (cm.to_col(a) < from) a = cm.next(a);
+    uint64_t e = std::max(a, cm.to_byte(from + cols));
+    auto colx = [&](uint64_t b) { return (int)(cm.to_col(b) - from); };
+    string slice = ed.buf.read(ls + a, e - a);
+    if (!longline || is_ascii(slice.data(), slice.size())) {
+        ed.screen.put(y, colx(a), slice.data(), slice.size(), A_NORMAL, cols);
+    } else {
+        // 超长行里的多字节字符占满自己的字节数那么多格，不够的补空白，列和字节保持一致
+        for (size_t i = 0, j; i < slice.size(); i = j) {
+            j = i;
+            utf8_next(slice.data(), slice.size(), j);
+            ed.screen.put(y, i, slice.data() + i, j - i, A_NORMAL, std::min<uint64_t>(j, cols));
         }
-        std::string s;
-        int cur = 0;
-        int start = std::max(target_row - CACHE_SIZE/2, 0);
-        std::vector<std::string> new_lines;
-        std::vector<bool> new_dirty;
-        while (std::getline(fin, s)) {
-            if (cur >= start && (int)new_lines.size() < CACHE_SIZE) {
-                new_lines.push_back(s);
-                new_dirty.push_back(false);
-            }
-            cur++;
-            if ((int)new_lines.size() >= CACHE_SIZE) break;
-            if (ed.stop_loading) {
-                WriteLog(LogLevel::WARNING, "async_load_cache interrupted for file: " + ed.filename);
-                break;
-            }
+    }
+    if (ed.hl.language()) {
+        vector<HlSpan> local;
+        const vector<HlSpan>* spans = &local;
+        if (longline) lex_line(*ed.hl.language(), slice.data(), slice.size(), a == 0 ? state : (uint8_t)HL_NORMAL, local);
+        else spans = &ed.hl.get(ed.buf, filerow, state).spans;
+        uint64_t base = longline ? a : 0;
+        for (const HlSpan& sp : *spans) {
+            uint64_t s = std::max<uint64_t>(base + sp.start, a), t = std::min<uint64_t>(base + sp.start + sp.len, e);
+            if (s < t) ed.screen.style(y, colx(s), colx(t) - colx(s), COLOR_PAIR(sp.kind));
         }
-        {
-            std::lock_guard<std::mutex> lk(ed.file_mutex);
-            ed.cache_lines = new_lines;
-            ed.dirty_flags = new_dirty;
-            ed.file_rowoff = start;
-        }
-        WriteLog(LogLevel::DEBUG, "async_load_cache finished for file: " + ed.filename + ", loaded lines: " + std::to_string(new_lines.size()));
-        ed.loading = false;
-    }).detach();
-}
-
-void ensure_cache(EditorState& ed, int target_row) {
-    if (target_row < ed.file_rowoff || target_row >= ed.file_rowoff + (int)ed.cache_lines.size()) {
-        // 需要重新加载缓存
-        ifstream fin(ed.filename);
-        string s;
-        int cur = 0;
-        int start = max(target_row - CACHE_SIZE/2, 0);
-        ed.cache_lines.clear();
-        ed.dirty_flags.clear();
-        while (getline(fin, s)) {
-            if (cur >= start && (int)ed.cache_lines.size() < CACHE_SIZE) {
-                ed.cache_lines.push_back(s);
-                ed.dirty_flags.push_back(false);
-            }
-            cur++;
-            if ((int)ed.cache_lines.size() >= CACHE_SIZE) break;
+    }
+    for (uint64_t b : ed.bracket_hl)
+        if (b >= ls + a && b < ls + e) ed.screen.style(y, colx(b - ls), 1, A_BOLD | A_UNDERLINE);
+    // 搜索高亮盖在语法颜色之上
+    if (ed.search_flash || !ed.hl.language()) {
+        int64_t hs = search_hit_col(ed, filerow, len);
+        if (hs >= 0) {
+            uint64_t s = std::max<uint64_t>(hs, a), t = std::min<uint64_t>(hs + search_match_len(ed), e);
+            if (s < t) ed.screen.style(y, colx(s), colx(t) - colx(s), COLOR_PAIR(5) | A_STANDOUT);
         }
-        ed.file_rowoff = start;
     }
+    return true;
 }
 
 void draw_rows(EditorState &ed, int rows, int cols) {
     std::lock_guard<std::mutex> lk(ed.file_mutex);
-    string ext = get_ext(ed.filename);
-    bool color = is_code_file(ed.filename);
-    for (int y = 0; y < rows-3; ++y) {
-        int filerow = y + ed.rowoff;
-        move(y, 0);
-        clrtoeol();
-        if (filerow < (int)ed.cache_lines.size()) {
-            if (color)
-                draw_code_row(ed.cache_lines[filerow], y, ext, ed, filerow);
-            else {
-                if (!ed.search_results.empty() && ed.search_idx < (int)ed.search_results.size()) {
-                    int sy = ed.search_results[ed.search_idx].first;
-                    int sx = ed.search_results[ed.search_idx].second;
-                    if (sy == filerow) {
-                        mvprintw(y, 0, "%.*s", sx, ed.cache_lines[filerow].c_str());
-                        attron(COLOR_PAIR(5) | A_STANDOUT);
-                        printw("%.*s", (int)ed.search_word.size(), ed.cache_lines[filerow].c_str() + sx);
-                        attroff(COLOR_PAIR(5) | A_STANDOUT);
-                        printw("%s", ed.cache_lines[filerow].c_str() + sx + ed.search_word.size());
-                        continue;
-                    }
-                }
-                mvprintw(y, 0, "%s", ed.cache_lines[filerow].c_str());
-            }
+    ed.hl.set_lang(find_lang(get_ext(ed.filename)));
+    bool color = ed.hl.language() != nullptr;
+    int total = ed.buf.line_count();
+    // 绘制只读已在内存中的块，缺的先画占位符，由后台线程加载后再刷新
+    int64_t orig;
+    uint64_t top = ed.buf.line_start(ed.rowoff);
+    text_ready(ed, top, ed.buf.line_start(ed.rowoff + rows), &orig);
+    if (orig >= 0) ed.cache.prefetch(orig, ed.rowoff - ed.last_rowoff);
+    ed.last_rowoff = ed.rowoff;
+    bool sync_ready = color && text_ready(ed, ed.buf.line_start(std::max(0, ed.rowoff - Highlighter::SYNC_LINES)), top);
+    uint8_t state = sync_ready ? ed.hl.state_before(ed.buf, ed.rowoff) : (uint8_t)HL_NORMAL;
+    ed.screen.begin(rows, cols);
+    draw_minimap(ed, rows, cols);
+    cols = text_cols(ed, cols);
+    // 自动换行或有折叠时屏幕行和文件行不一一对应，不做整屏滚动优化
+    if (ed.wrap || !ed.folds.empty()) ed.screen.set_origin(0, 0);
+    else ed.screen.set_origin(rows-3, ed.rowoff);
+    int filerow = ed.rowoff;
+    uint64_t sub = ed.wrap ? ed.wrapoff : 0;
+    for (int y = 0; y < rows-3 && filerow < total; ++y) {
+        uint64_t from = ed.wrap ? layout_columns(ed, filerow).wrap_start(sub, cols) : ed.coloff;
+        bool ready = draw_line_slice(ed, y, filerow, from, state, cols);
+        if (ed.wrap && sub + 1 < wrap_height(ed, filerow, cols)) {
+            sub++;
+            continue;
+        }
+        if (color && ready) state = ed.hl.get(ed.buf, filerow, state).out;
+        int next = ed.folds.next(filerow);
+        if (next != filerow + 1) {
+            // 折叠行末尾标出隐藏的行数；被隐藏的部分是完整的块，之后按普通状态继续着色
+            string mark = "  ... " + to_string(next - filerow - 1) + " lines";
+            int64_t x = (int64_t)layout_columns(ed, filerow).width() - from;
+            if (x >= 0 && x < cols) ed.screen.put(y, x, mark.data(), mark.size(), A_DIM | A_REVERSE);
+            state = HL_NORMAL;
         }
+        filerow = next;
+        sub = 0;
     }
+    if (color) ed.hl.trim(ed.rowoff, ed.rowoff + rows);
+    ed.columns.trim(std::min(ed.rowoff, ed.cy), std::max(ed.rowoff + rows, ed.cy));
 }
 
 void draw_status(EditorState &ed, int rows, int cols) {
-    attron(A_REVERSE);
     string stat = " " + ed.filename;
     if (ed.newfile) stat += " (new file)";
     if (ed.dirty) stat += " *";
-    mvprintw(rows-3, 0, "%-*s", cols, stat.c_str());
-    attroff(A_REVERSE);
+    if (ed.follow) stat += "  [follow]";
+    if (ed.reload_job) stat += "  [reloading]";
+    else if (ed.disk_changed) stat += "  [changed on disk]";
+    stat += "  " + to_string(ed.buf.line_count()) + " lines";
+    if (ed.index_job && ed.file.size)
+        stat += "  indexing " + to_string(ed.buf.original_size() * 100 / ed.file.size) + "%";
+    if (ed.search_job && ed.search_job->total)
+        stat += "  searching " + to_string(ed.search_job->scanned * 100 / ed.search_job->total) + "%";
+    if (ed.json_job && ed.buf.length())
+        stat += "  json " + to_string(ed.json_job->scanned * 50 / ed.buf.length()) + "%";
+    if (ed.blocks.language() && !ed.blocks.ready() && !ed.index_job && ed.blocks.lines())
+        stat += "  blocks " + to_string(100 - ed.blocks.pending() * 100 / ed.blocks.lines()) + "%";
+    if (!ed.folds.empty())
+        stat += "  " + to_string(ed.folds.size()) + " folds";
+    if (!ed.search_results.empty())
+        stat += "  match " + to_string(ed.search_idx + 1) + "/" + to_string(ed.search_results.size());
+    ed.screen.clear_row(rows-3);
+    ed.screen.put(rows-3, 0, stat.data(), stat.size());
+    ed.screen.style(rows-3, 0, cols, A_REVERSE);
 }
 
-void draw_msg(EditorState &ed, int rows, int cols) {
-    move(rows-2, 0);
-    clrtoeol();
-    mvprintw(rows-2, 0, "%-*s", cols, ed.statusmsg.c_str());
+void draw_msg(EditorState &ed, int rows) {
+    ed.screen.clear_row(rows-2);
+    ed.screen.put(rows-2, 0, ed.statusmsg.data(), ed.statusmsg.size());
 }
 
-void draw_shortcuts(int rows, int cols) {
-    attron(A_REVERSE);
-    mvprintw(rows-1, 0, "^O Save  ^X Exit  ^C Cancel  ^F Find  ^G Help");
-    attroff(A_REVERSE);
+// 按常用程度排列，放不下的从后面省掉，^G Help 总是留着
+void draw_shortcuts(EditorState &ed, int rows, int cols) {
+    static const vector<string> common = {"^O Save", "^X Exit", "^F Find", "^\\ Replace", "^D Grep", "^K Fold",
+                                          "^E Follow", "^L Goto", "^Z Undo", "^Y Redo", "^R Regex",
+                                          "^] Bracket", "^W Wrap", "^T Stats"};
+    static const string help = "^G Help";
+    string keys;
+    auto add = [&](const string& k) {
+        if ((int)(keys.size() + k.size() + help.size() + 1) <= cols) keys += k + " ";
+    };
+    for (size_t i = 0; i < common.size(); ++i) {
+        add(common[i]);
+        if (i == 2 && is_json(ed)) add("^P Path");
+    }
+    keys += help;
+    int end = ed.screen.put(rows-1, 0, keys.data(), keys.size());
+    ed.screen.style(rows-1, 0, end, A_REVERSE);
+}
+
+// 右上角的统计浮层，随帧一起走影子帧比较
+void draw_stats(EditorState &ed, int rows, int cols) {
+    Stats& st = stats();
+    char io[96];
+    snprintf(io, sizeof(io), "io   read %.1f MB  written %.1f MB", st.io_read_bytes / 1048576.0,
+             st.io_write_bytes / 1048576.0);
+    char misc[96];
+    snprintf(misc, sizeof(misc), "frame %zu cells  log dropped %llu", ed.frame_cells,
+             (unsigned long long)log_dropped());
+    string lines[] = {
+        "key  " + st.input_to_paint.summary(),
+        "draw " + st.draw.summary(),
+        "load " + st.cache_load.summary(),
+        io,
+        misc,
+    };
+    size_t w = 0;
+    for (auto& l : lines) w = std::max(w, l.size() + 2);
+    int x = std::max(0, cols - (int)w);
+    for (int i = 0; i < 5 && i < rows - 3; ++i) {
+        string l = " " + lines[i];
+        l.resize(w, ' ');
+        ed.screen.put(i, x, l.data(), l.size(), A_REVERSE);
+    }
 }
 
 void set_status(EditorState &ed, const string &msg) {
     ed.statusmsg = msg;
 }
 
+// 按顺序把已扫描完的块接到 buf 末尾；wait 为真时等待全部完成
+void publish_index(EditorState &ed, bool wait = false) {
+    auto job = ed.index_job;
+    if (!job) return;
+    std::lock_guard<std::mutex> lk(ed.file_mutex);
+    // 跟随模式下光标停在最后一行时，新内容到达后继续停在末尾
+    bool at_end = ed.follow && ed.cy + 1 >= (int)ed.buf.line_count();
+    bool done = publish_index(*job, ed.buf, wait);
+    if (at_end) {
+        ed.cy = ed.buf.line_count() - 1;
+        ed.cx = 0;
+    }
+    if (done) {
+        ed.index_job.reset();
+        if (!ed.follow)
+            SE_LOG(INFO, "open_file finished: " + ed.filename + ", total_lines=" + std::to_string(ed.buf.line_count()));
+    }
+}
+
+void cancel_index(EditorState &ed) {
+    if (!ed.index_job) return;
+    cancel_index(*ed.index_job);
+    ed.index_job.reset();
+}
+
+void cancel_search(EditorState& ed, bool wait);
+
+// wait 为真时等后台线程退出
+void cancel_json(EditorState &ed, bool wait) {
+    if (auto job = ed.json_job) {
+        job->cancel = true;
+        std::unique_lock<std::mutex> lk(job->mu);
+        if (wait) job->cv.wait(lk, [&] { return job->pending == 0; });
+    }
+    ed.json_job.reset();
+    ed.json.reset();
+}
+
+// 后台任务读着当前映射，换文件前要等它们退出
+void cancel_disk_jobs(EditorState &ed) {
+    if (ed.reload_job) cancel_reload(*ed.reload_job);
+    ed.reload_job.reset();
+    if (ed.disk_hashes) cancel_block_hash(*ed.disk_hashes);
+    ed.disk_hashes.reset();
+}
+
+// 记下刚映射的文件的身份，后台算块哈希，作为以后比较的基准
+void watch_disk(EditorState &ed) {
+    ed.disk.from_fd(ed.file.fd);
+    ed.disk_hashes = start_block_hash(ed.file.data, ed.file.size);
+    ed.disk_changed = ed.overwrite_armed = false;
+    ed.next_disk_check = chrono::steady_clock::now() + DISK_CHECK_INTERVAL;
+}
+
 void open_file(EditorState &ed, const std::string &fname) {
+    cancel_index(ed);
+    cancel_search(ed, true);
+    cancel_json(ed, true);
+    cancel_disk_jobs(ed);
+    std::lock_guard<std::mutex> lk(ed.file_mutex);
     ed.filename = fname;
-    ed.cache_lines.clear();
-    ed.dirty_flags.clear();
-    ed.line_offsets.clear();
-    ed.file_rowoff = 0;
-    ed.total_lines = 0;
-
-    std::ifstream fin(fname);
-    if (!fin) {
-        WriteLog(LogLevel::INFO, "Try open file (new): " + fname);
-        ed.cache_lines.push_back("");
-        ed.dirty_flags.push_back(false);
+    ed.cx = ed.cy = ed.rowoff = ed.coloff = 0;
+    ed.wrapoff = 0;
+    ed.dirty = false;
+    ed.undo.clear();
+
+    ed.cache.attach(nullptr, 0);
+    uint64_t first;
+    bool found = open_document(fname, ed.file, ed.buf, first);
+    ed.folds.clear();
+    // JSON 用自己的结构索引
+    string ext = get_ext(fname);
+    ed.blocks.reset(ext == "json" ? nullptr : find_lang(ext), ed.buf.line_count());
+    ed.bracket_version = ~0ull;
+    ed.disk = DiskIdentity();
+    ed.disk_changed = ed.overwrite_armed = false;
+    if (!found) {
+        SE_LOG(INFO, "Try open file (new): " + fname);
         ed.newfile = true;
-        ed.total_lines = 1;
         set_status(ed, fname + " (new file) ");
+        ed.journal.start(fname, true);
         return;
     }
+    ed.cache.attach(ed.file.data, ed.file.size);
+    ed.newfile = false;
+    watch_disk(ed);
+    set_status(ed, fname);
+    if (first < ed.file.size) {
+        ed.index_job = start_index_job(ed.file.data, first, ed.file.size,
+                                       IndexSidecar::open(fname, ed.file));
+    } else {
+        SE_LOG(INFO, "open_file finished: " + fname + ", total_lines=" + std::to_string(ed.buf.line_count()));
+    }
+    ed.journal.start(fname, true);
+}
 
-    // 预处理，记录每行在文件中的偏移量
-    std::string s;
-    while (fin) {
-        ed.line_offsets.push_back(fin.tellg());
-        if (!std::getline(fin, s)) break;
-        ed.total_lines++;
+void set_follow(EditorState &ed, bool on) {
+    ed.follow = on && !ed.newfile && ed.watcher.start(ed.filename, ed.file.fd);
+    if (!ed.follow) {
+        ed.watcher.stop();
+        set_status(ed, on ? "Cannot follow " + ed.filename : "Follow off");
+        return;
     }
+    ed.cy = ed.buf.line_count() - 1;
+    ed.cx = 0;
+    set_status(ed, "Following " + ed.filename + " (^E to stop)");
+}
 
-    fin.clear();
-    fin.seekg(0);
+// 跟随模式：文件变长时只映射并索引新增的部分，截断或轮转后重新打开
+void follow_file(EditorState &ed) {
+    if (!ed.follow) return;
+    uint64_t size;
+    FileWatcher::Change ch = ed.watcher.check(ed.file.size, size);
+    if (ch == FileWatcher::NONE) return;
+    if (ch == FileWatcher::GREW) {
+        // 上一段还在索引，等它发布完再接着追
+        if (ed.index_job) return;
+        if (ed.file.extend(size)) {
+            ed.cache.grow(size);
+            ed.index_job = start_index_job(ed.file.data, ed.buf.original_size(), size);
+            return;
+        }
+        SE_LOG(INFO, "follow: mapping reserve exhausted, reopening " + ed.filename);
+    }
+    if (ed.dirty) {
+        set_follow(ed, false);
+        set_status(ed, ed.filename + (ch == FileWatcher::GREW ? " grew" : ch == FileWatcher::TRUNCATED ? " was truncated" : " was rotated") +
+                       "; follow stopped, unsaved changes kept");
+        return;
+    }
+    SE_LOG(INFO, string("follow: ") + (ch == FileWatcher::TRUNCATED ? "truncated " : "reopening ") + ed.filename);
+    open_file(ed, ed.filename);
+    set_follow(ed, true);
+}
 
-    // 初始只加载前 CACHE_SIZE 行
-    int cnt = 0;
-    ed.cache_lines.clear();
-    ed.dirty_flags.clear();
-    while (cnt < CACHE_SIZE && std::getline(fin, s)) {
-        ed.cache_lines.push_back(s);
-        ed.dirty_flags.push_back(false);
-        cnt++;
+// 换上后台比较好的新文件。没有未保存的修改时文档就是新文件；
+// 有修改时把它们搬到新文件上，碰到了别人改过的地方就保持原样，记下冲突
+void publish_reload(EditorState &ed) {
+    auto job = ed.reload_job;
+    ed.reload_job.reset();
+    if (job->cancel) return;
+    if (!job->err.empty()) {
+        ed.disk_changed = true;
+        set_status(ed, "Cannot reload " + ed.filename + ": " + job->err);
+        return;
     }
-    ed.file_rowoff = 0;
-    ed.newfile = false;
-    ed.dirty = false;
-    ed.cx = ed.cy = ed.rowoff = 0;
-    set_status(ed, fname);
-    WriteLog(LogLevel::INFO, "open_file finished: " + fname + ", total_lines=" + std::to_string(ed.total_lines));
+    cancel_search(ed, true);
+    cancel_json(ed, true);
+    std::lock_guard<std::mutex> lk(ed.file_mutex);
+    size_t nchanges = job->changes.size();
+    if (!ed.buf.rebase_original(job->file.data, job->file.size, std::move(job->idx), job->changes)) {
+        ed.disk_changed = true;
+        SE_LOG(WARNING, "reload: " + ed.filename + " changed where there are unsaved edits");
+        set_status(ed, ed.filename + " changed on disk where you have unsaved edits; ^O asks before overwriting");
+        return;
+    }
+    // 先让预读线程离开旧映射，旧映射随 job 释放
+    ed.cache.attach(job->file.data, job->file.size);
+    ed.file.swap(job->file);
+    ed.disk = job->disk;
+    ed.disk_hashes = job->hashes;
+    // 撤销记录引用旧文件的偏移，不能再用
+    ed.undo.clear();
+    ed.cy = std::min(ed.cy, (int)ed.buf.line_count() - 1);
+    keep_column(ed, line_columns(ed, ed.cy).to_col(ed.cx));
+    // 编辑日志改以新文件为起点
+    ed.journal.discard();
+    ed.journal.start(ed.filename, true);
+    if (ed.dirty) compact_journal(ed.journal, ed.buf, true);
+    if (auto sc = IndexSidecar::open(ed.filename, ed.file)) sc->finish(ed.buf.original_index());
+    SE_LOG(INFO, "reload: " + ed.filename + ", " + to_string(nchanges) + " changed regions, " +
+                     to_string(job->rescanned) + " bytes rescanned");
+    set_status(ed, "Reloaded " + ed.filename + " from disk (" + to_string(nchanges) + " changed regions, " +
+                   to_string((job->rescanned + 1023) / 1024) + " KB rescanned" + (ed.dirty ? ", edits kept)" : ")"));
 }
 
-void save_file(EditorState &ed, const string &fname) {
-    // 1. 先加载全文件内容
-    vector<string> all_lines;
-    ifstream fin(fname);
-    string s;
-    while (getline(fin, s)) all_lines.push_back(s);
-    fin.close();
-
-    // 2. 用缓存区内容覆盖对应片段
-    int start = ed.file_rowoff;
-    for (int i = 0; i < (int)ed.cache_lines.size(); ++i) {
-        if (start + i < (int)all_lines.size()) {
-            if (ed.dirty_flags[i])  // 只覆盖被编辑过的行
-                all_lines[start + i] = ed.cache_lines[i];
-        } else {
-            // 缓存区超出原文件长度，则追加
-            all_lines.push_back(ed.cache_lines[i]);
+// 每隔 DISK_CHECK_INTERVAL stat 一次文件，身份变了就在后台比较块哈希、重新加载不同的部分。
+// wait 为真时（保存前）立即检查并等出结果
+void check_disk(EditorState &ed, bool wait = false) {
+    if (ed.reload_job && (wait || ed.reload_job->done)) {
+        std::unique_lock<std::mutex> lk(ed.reload_job->mu);
+        ed.reload_job->cv.wait(lk, [&] { return ed.reload_job->done.load(); });
+        lk.unlock();
+        publish_reload(ed);
+    }
+    // 跟随模式自己处理文件的变化
+    if (ed.follow || ed.newfile || ed.reload_job || ed.disk_changed) return;
+    auto now = chrono::steady_clock::now();
+    if (!wait && now < ed.next_disk_check) return;
+    ed.next_disk_check = now + DISK_CHECK_INTERVAL;
+    DiskIdentity cur;
+    if (!cur.from_path(ed.filename) || cur == ed.disk) return;
+    if (!ed.disk_hashes) {
+        // 保存之后文档不再对应映射的文件，只能整个重新打开
+        if (ed.dirty) {
+            ed.disk_changed = true;
+            set_status(ed, ed.filename + " changed on disk; ^O asks before overwriting");
+            return;
         }
+        int cy = ed.cy;
+        open_file(ed, ed.filename);
+        ed.cy = std::min(cy, (int)ed.buf.line_count() - 1);
+        set_status(ed, "Reopened " + ed.filename + ": changed on disk");
+        return;
+    }
+    // 行索引和基准哈希都算完了才能比较
+    if (ed.index_job || !ed.disk_hashes->done) {
+        if (!wait) return;
+        publish_index(ed, true);
+        std::unique_lock<std::mutex> lk(ed.disk_hashes->mu);
+        ed.disk_hashes->cv.wait(lk, [&] { return ed.disk_hashes->pending == 0; });
+        if (!ed.disk_hashes->done) return;
     }
+    ed.reload_job = start_reload(ed.filename, ed.file, ed.buf.original_index(), ed.disk_hashes);
+    if (wait) check_disk(ed, true);
+}
 
-    // 3. 写回文件
-    ofstream fout(fname);
-    for (const auto &line : all_lines) fout << line << "\n";
-    fout.close();
+bool save_file(EditorState &ed, const string &fname) {
+    publish_index(ed, true);
+    // 别的程序改过文件：先合并进来；合并不了时第一次只提示，再按一次 ^O 才覆盖
+    if (fname == ed.filename && !ed.newfile) {
+        check_disk(ed, true);
+        if (ed.disk_changed && !ed.overwrite_armed) {
+            ed.overwrite_armed = true;
+            set_status(ed, fname + " was changed by another program; ^O again to overwrite it");
+            return false;
+        }
+    }
+    auto t0 = chrono::steady_clock::now();
+    string err;
+    bool ok;
+    uint64_t bytes;
+    size_t lines;
+    {
+        std::lock_guard<std::mutex> lk(ed.file_mutex);
+        ok = save_document(ed.buf, ed.file.fd, fname, err);
+        bytes = ed.buf.length();
+        lines = ed.buf.line_count();
+    }
+    if (!ok) {
+        set_status(ed, "Error writing " + fname + ": " + err);
+        return false;
+    }
 
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    double mb = bytes / 1048576.0;
+    char info[128];
+    snprintf(info, sizeof(info), ", %.1f MB in %.0f ms (%.0f MB/s)", mb, ms, ms > 0 ? mb * 1000 / ms : 0.0);
     ed.filename = fname;
     ed.newfile = false;
     ed.dirty = false;
-    ed.dirty_flags.assign(ed.cache_lines.size(), false); // 保存后清除脏标记
-    set_status(ed, "Wrote " + to_string(all_lines.size()) + " lines");
+    // 磁盘上的文件就是当前文档，日志从头开始
+    ed.journal.discard();
+    ed.journal.start(fname, false);
+    // 以后再被改只能整体重新打开：文档的片段还指向旧映射
+    if (ed.disk_hashes) cancel_block_hash(*ed.disk_hashes);
+    ed.disk_hashes.reset();
+    ed.disk.from_path(fname);
+    ed.disk_changed = ed.overwrite_armed = false;
+    set_status(ed, "Wrote " + to_string(lines) + " lines" + info);
+    return true;
 }
 
 // key 可以用自定义的枚举或常量，如 ARROW_UP, ARROW_DOWN, ARROW_LEFT, ARROW_RIGHT
-void editor_move_cursor(EditorState &ed, int key, int screen_rows, int screen_cols) {
-    int filerow = ed.file_rowoff + ed.cy;
-    int filecol = ed.cx;
+void editor_move_cursor(EditorState &ed, int key) {
+    int total = ed.buf.line_count();
 
+    uint64_t col = cursor_col(ed);
     switch (key) {
         case KEY_LEFT:
-            if (filecol > 0) {
-                ed.cx--;
-            } else if (filerow > 0) {
-                filerow--;
-                ed.cx = ed.cache_lines[filerow - ed.file_rowoff].size();
-                ed.cy--;
+            if (ed.cx > 0) {
+                ed.cx = line_columns(ed, ed.cy).prev(ed.cx);
+            } else if (ed.cy > 0) {
+                ed.cy = ed.folds.prev(ed.cy);
+                ed.cx = ed.buf.line_length(ed.cy);
             }
             break;
         case KEY_RIGHT:
-            if (filerow - ed.file_rowoff < (int)ed.cache_lines.size() &&
-                ed.cx < (int)ed.cache_lines[filerow - ed.file_rowoff].size()) {
-                ed.cx++;
-            } else if (filerow + 1 < ed.total_lines) {
-                filerow++;
+            if (ed.cx < (int)ed.buf.line_length(ed.cy)) {
+                ed.cx = line_columns(ed, ed.cy).next(ed.cx);
+            } else if (ed.folds.next(ed.cy) < total) {
+                ed.cy = ed.folds.next(ed.cy);
                 ed.cx = 0;
-                ed.cy++;
             }
             break;
         case KEY_UP:
-            if (filerow > 0) {
-                filerow--;
-                ed.cy--;
-            }
+            ed.cy = ed.folds.prev(ed.cy);
+            keep_column(ed, col);
             break;
         case KEY_DOWN:
-            if (filerow + 1 < ed.total_lines) {
-                filerow++;
-                ed.cy++;
-            }
+            if (ed.folds.next(ed.cy) < total) ed.cy = ed.folds.next(ed.cy);
+            keep_column(ed, col);
             break;
     }
 
-    // 保证光标不会越过当前缓存区
-    if (ed.cy < 0) ed.cy = 0;
-    if (ed.cy >= (int)ed.cache_lines.size()) ed.cy = ed.cache_lines.size() - 1;
+    // 修正光标列到当前行可用范围
+    int rowlen = ed.buf.line_length(ed.cy);
+    if (ed.cx > rowlen) ed.cx = rowlen;
+    if (ed.cx < 0) ed.cx = 0;
+}
 
-    // 如果光标超出当前缓存区，则重载缓存
-    filerow = ed.file_rowoff + ed.cy;
-    if (filerow < ed.file_rowoff || filerow >= ed.file_rowoff + (int)ed.cache_lines.size()) {
-        load_cache(ed, filerow);
-        ed.cy = filerow - ed.file_rowoff;
+// 保证光标在屏幕内：不换行时调整 rowoff/coloff，自动换行时调整 rowoff/wrapoff
+void editor_scroll(EditorState &ed, int rows) {
+    int screen_rows = rows - 3, cols = text_cols(ed, std::max(1, getmaxx(stdscr)));
+    // 光标跳进折叠（搜索、跳行）时展开它
+    for (int v; (v = ed.folds.visible(ed.cy)) != ed.cy; ) ed.folds.remove(v);
+    ed.rowoff = ed.folds.visible(ed.rowoff);
+    uint64_t vx = cursor_col(ed);
+    if (!ed.wrap) {
+        ed.wrapoff = 0;
+        if (ed.cy < ed.rowoff) ed.rowoff = ed.cy;
+        if (ed.folds.empty() && ed.cy >= ed.rowoff + screen_rows) ed.rowoff = ed.cy - (screen_rows-1);
+        if (!ed.folds.empty() && cursor_screen_row(ed, cols, screen_rows) >= screen_rows) {
+            ed.rowoff = ed.cy;
+            for (int i = 1; i < screen_rows && ed.rowoff > 0; ++i) ed.rowoff = ed.folds.prev(ed.rowoff);
+        }
+        if (vx < (uint64_t)ed.coloff) ed.coloff = vx;
+        if (vx >= (uint64_t)ed.coloff + cols) ed.coloff = vx - (cols-1);
+        return;
+    }
+    ed.coloff = 0;
+    uint64_t x, sub = cursor_wrap_row(ed, cols, x);
+    if (ed.cy < ed.rowoff || (ed.cy == ed.rowoff && sub < ed.wrapoff)) {
+        ed.rowoff = ed.cy;
+        ed.wrapoff = sub;
+        return;
     }
+    if (cursor_screen_row(ed, cols, screen_rows) < screen_rows) return;
+    // 光标放到最后一行：从光标往上数 screen_rows-1 个屏幕行
+    int l = ed.cy;
+    uint64_t left = screen_rows - 1;
+    while (left > 0) {
+        if (sub >= left) { sub -= left; break; }
+        if (l == 0) { sub = 0; break; }
+        left -= sub + 1;
+        l = ed.folds.prev(l);
+        sub = wrap_height(ed, l, cols) - 1;
+    }
+    ed.rowoff = l;
+    ed.wrapoff = sub;
+}
 
-    // 修正光标列到当前行可用范围
-    int rowlen = 0;
-    if (ed.cy < (int)ed.cache_lines.size())
-        rowlen = ed.cache_lines[ed.cy].size();
+// 所有对文档的修改都经过这两个函数，顺带写撤销日志
+void buffer_insert(EditorState &ed, uint64_t pos, const char* s, size_t n) {
+    uint64_t cursor = ed.buf.line_start(ed.cy) + ed.cx;
+    ed.undo.record_insert(pos, ed.buf.insert(pos, s, n), cursor);
+    ed.dirty = true;
+}
 
-    if (ed.cx > rowlen) ed.cx = rowlen;
-    if (ed.cx < 0) ed.cx = 0;
+void buffer_erase(EditorState &ed, uint64_t pos, uint64_t n) {
+    uint64_t cursor = ed.buf.line_start(ed.cy) + ed.cx;
+    vector<PieceTable::Piece> removed;
+    ed.buf.erase(pos, n, &removed);
+    ed.undo.record_erase(pos, n, removed, cursor);
+    ed.dirty = true;
+}
+
+void set_cursor_offset(EditorState &ed, uint64_t pos) {
+    ed.cy = ed.buf.line_of(std::min(pos, ed.buf.length()));
+    ed.cx = pos - ed.buf.line_start(ed.cy);
 }
 
 void insert_char(EditorState &ed, int c) {
-    ed.cache_lines[ed.cy].insert(ed.cx, 1, c);
+    char ch = c;
+    buffer_insert(ed, ed.buf.line_start(ed.cy) + ed.cx, &ch, 1);
     ed.cx++;
-    ed.dirty = true;
 }
 
 void del_char(EditorState &ed) {
     if (ed.cx == 0 && ed.cy > 0) {
-        ed.cx = ed.cache_lines[ed.cy-1].size();
-        ed.cache_lines[ed.cy];
-        ed.cache_lines.erase(ed.cache_lines.begin() + ed.cy);
+        int len = ed.buf.line_length(ed.cy-1);
+        buffer_erase(ed, ed.buf.line_start(ed.cy) - 1, 1);
         ed.cy--;
-        ed.dirty = true;
+        ed.cx = len;
     } else if (ed.cx > 0) {
-        ed.cache_lines[ed.cy].erase(ed.cx-1, 1);
-        ed.cx--;
-        ed.dirty = true;
+        // 删掉光标前的整个字符簇
+        int prev = line_columns(ed, ed.cy).prev(ed.cx);
+        buffer_erase(ed, ed.buf.line_start(ed.cy) + prev, ed.cx - prev);
+        ed.cx = prev;
     }
 }
 
 void insert_newline(EditorState &ed) {
-    ed.cache_lines.insert(ed.cache_lines.begin() + ed.cy + 1, ed.cache_lines[ed.cy].substr(ed.cx));
-    ed.cache_lines[ed.cy] = ed.cache_lines[ed.cy].substr(0, ed.cx);
+    buffer_insert(ed, ed.buf.line_start(ed.cy) + ed.cx, "\n", 1);
     ed.cy++;
     ed.cx = 0;
+}
+
+// 一段文字作为一次缓冲区操作插入，光标移到末尾
+void insert_text(EditorState &ed, const string &s) {
+    if (s.empty()) return;
+    uint64_t pos = ed.buf.line_start(ed.cy) + ed.cx;
+    buffer_insert(ed, pos, s.data(), s.size());
+    set_cursor_offset(ed, pos + s.size());
+}
+
+// 括号粘贴：终端用 ESC[200~ ... ESC[201~ 包住粘贴的内容，读到结束标记为止
+string read_paste() {
+    string s;
+    timeout(PASTE_TIMEOUT_MS);
+    for (int c; (c = getch()) != ERR && c != KEY_PASTE_END; ) {
+        if (c == '\r') c = '\n';
+        if (c < 256) s += (char)c;
+    }
+    timeout(-1);
+    return s;
+}
+
+// 粘贴的内容单独作为一步撤销
+void insert_paste(EditorState &ed, const string &s) {
+    ed.undo.boundary();
+    insert_text(ed, s);
+    ed.undo.boundary();
+    if (s.size() > 1) set_status(ed, "Pasted " + to_string(s.size()) + " bytes");
+}
+
+void editor_undo(EditorState &ed, int rows, bool redo) {
+    uint64_t cursor;
+    bool ok = redo ? ed.undo.redo(ed.buf, cursor) : ed.undo.undo(ed.buf, cursor);
+    if (!ok) {
+        set_status(ed, redo ? "Nothing to redo" : "Nothing to undo");
+        return;
+    }
+    set_cursor_offset(ed, cursor);
     ed.dirty = true;
+    editor_scroll(ed, rows);
 }
 
 string prompt(EditorState &ed, const string &msg, string def = "") {
@@ -509,179 +985,1031 @@ string prompt(EditorState &ed, const string &msg, string def = "") {
     getnstr(buf, 255);
     noecho();
     curs_set(1);
+    ed.screen.invalidate_row(rows-2);
     string s = buf;
     if (s.empty()) return def;
     return s;
 }
 
-void do_search(EditorState& ed, const string& word) {
-    ed.search_word = word;
+// 上次异常退出留下的编辑日志：询问后重放到刚打开的文件上
+void recover_journal(EditorState &ed) {
+    string jp = EditJournal::path_for(ed.filename);
+    int state = EditJournal::probe(ed.filename);
+    if (state == 0) return;
+    if (state < 0) {
+        rename(jp.c_str(), (jp + ".old").c_str());
+        set_status(ed, "Edit journal does not match the file any more, moved to " + jp + ".old");
+        return;
+    }
+    string ans = prompt(ed, "Unsaved edits found in " + jp + ". Recover? (y/n):");
+    if (ans != "y" && ans != "Y") {
+        unlink(jp.c_str());
+        set_status(ed, "Discarded " + jp);
+        return;
+    }
+    publish_index(ed, true);
+    auto t0 = chrono::steady_clock::now();
+    string err;
+    long n;
+    {
+        std::lock_guard<std::mutex> lk(ed.file_mutex);
+        n = replay_journal(ed.filename, ed.buf, err);
+    }
+    if (n < 0) {
+        rename(jp.c_str(), (jp + ".old").c_str());
+        set_status(ed, "Recovery failed: " + err);
+        return;
+    }
+    if (n > 0) {
+        ed.dirty = true;
+        // 立即用快照替换旧日志，恢复出来的内容在新日志里也有
+        compact_journal(ed.journal, ed.buf, true);
+    }
+    long ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - t0).count();
+    set_status(ed, "Recovered " + to_string(n) + " edits in " + to_string(ms) + " ms" +
+                   (err.empty() ? "" : " (stopped early: " + err + ")"));
+}
+
+// wait 为真时等后台线程退出，之后才能释放它们读取的缓冲区
+void cancel_search(EditorState& ed, bool wait) {
+    if (auto job = ed.search_job) {
+        job->cancel = true;
+        std::unique_lock<std::mutex> lk(job->mu);
+        if (wait) job->cv.wait(lk, [&] { return job->pending == 0; });
+    }
+    ed.search_job.reset();
     ed.search_results.clear();
+    ed.search_lens.clear();
     ed.search_idx = 0;
+    ed.search_jump = false;
+    ed.search_density.reset();
+}
+
+// 在整个文档中搜索 word，结果逐块流入 search_results，并跳到光标之后的第一个命中
+void do_search(EditorState& ed, const string& word) {
+    cancel_search(ed, false);
+    ed.search_word = word;
     if (word.empty()) return;
-    for (int i = 0; i < (int)ed.cache_lines.size(); ++i) {
-        string& line = ed.cache_lines[i];
-        size_t pos = 0;
-        while ((pos = line.find(word, pos)) != string::npos) {
-            ed.search_results.push_back({i, (int)pos});
-            pos += word.length();
-        }
+    publish_index(ed, true);
+
+    string err;
+    auto job = start_search(ed.buf, word, ed.search_regex, err);
+    if (!job) {
+        set_status(ed, "Bad regex: " + err);
+        return;
     }
+    ed.search_version = job->version;
+    ed.search_job = job;
+    ed.search_density = job->density;
+    ed.search_from = ed.buf.line_start(ed.cy) + ed.cx;
+    ed.search_jump = true;
 }
 
 void goto_search(EditorState &ed, int rows) {
     ed.search_flash = true;
-    if (ed.last_search_time && ed.search_idx < (int)ed.search_results.size()) {
-        int sy = ed.search_results[ed.search_idx].first;
-        int sx = ed.search_results[ed.search_idx].second;
+    ed.last_search_time = clock();
+    if (ed.search_idx < ed.search_results.size()) {
+        uint64_t pos = ed.search_results[ed.search_idx];
+        int sy = ed.buf.line_of(pos);
+        int sx = pos - ed.buf.line_start(sy);
         // 这里加调试输出
         set_status(ed, "跳转到: 行=" + to_string(sy) + " 列=" + to_string(sx));
         ed.cy = sy;
         ed.cx = sx;
-        int screen_rows = rows - 3;
-        if (ed.cy < ed.rowoff) ed.rowoff = ed.cy;
-        if (ed.cy >= ed.rowoff + screen_rows) ed.rowoff = ed.cy - (screen_rows-1);
+        editor_scroll(ed, rows);
     }
 }
 
-void draw_help(int rows, int cols) {
+// 合并已完成的搜索块（保持升序、去掉重叠命中），并处理待定的跳转
+void publish_search(EditorState &ed, int rows) {
+    if (ed.search_version != ed.buf.version()) {
+        // 文档已被编辑，偏移全部失效，下次 ^F 重新搜索
+        if (ed.search_job || !ed.search_results.empty()) cancel_search(ed, false);
+        return;
+    }
+    auto job = ed.search_job;
+    if (!job) return;
+    bool finished = collect_search(*job, ed.search_results, ed.search_lens);
+    if (finished) ed.search_job.reset();
+    if (!ed.search_jump) return;
+    auto it = lower_bound(ed.search_results.begin(), ed.search_results.end(), ed.search_from);
+    if (it != ed.search_results.end()) {
+        ed.search_jump = false;
+        ed.search_idx = it - ed.search_results.begin();
+        goto_search(ed, rows);
+    } else if (finished) {
+        ed.search_jump = false;
+        if (ed.search_results.empty()) {
+            set_status(ed, "Not found");
+        } else {
+            ed.search_idx = 0;
+            goto_search(ed, rows);
+        }
+    }
+}
+
+// 下一个命中：结果已在内存中时 O(1)，还在搜索时等待后续结果
+void search_next(EditorState &ed, int rows) {
+    if (ed.search_idx + 1 < ed.search_results.size()) {
+        ed.search_idx++;
+        goto_search(ed, rows);
+    } else if (ed.search_job) {
+        ed.search_from = ed.search_results.empty() ? 0 : ed.search_results.back() + 1;
+        ed.search_jump = true;
+        set_status(ed, "Searching...");
+    } else if (!ed.search_results.empty()) {
+        ed.search_idx = 0;
+        goto_search(ed, rows);
+    } else {
+        do_search(ed, ed.search_word);
+    }
+}
+
+// "N" 跳到第 N 行，"N%" 跳到全文的 N%；行号和偏移都由行索引直接定位，与文件大小无关
+void goto_line(EditorState &ed, const string &arg, int rows) {
+    char* end;
+    double v = strtod(arg.c_str(), &end);
+    bool percent = *end == '%';
+    if (end == arg.c_str() || (*end && !(percent && end[1] == 0)) || v < 0) {
+        set_status(ed, "Bad line: " + arg);
+        return;
+    }
+    ed.undo.boundary();
+    uint64_t pending = ed.index_job ? ed.file.size - ed.buf.original_size() : 0;
+    if (percent) {
+        uint64_t total = ed.buf.length() + pending;
+        uint64_t pos = (uint64_t)(std::min(v, 100.0) / 100 * total);
+        // 目标还没索引到就先等后台索引完成
+        if (pos > ed.buf.length()) publish_index(ed, true);
+        ed.cy = ed.buf.line_of(std::min(pos, ed.buf.length()));
+    } else {
+        size_t line = v >= 1 ? (size_t)v - 1 : 0;
+        if (line >= ed.buf.line_count() && pending) publish_index(ed, true);
+        ed.cy = std::min(line, ed.buf.line_count() - 1);
+    }
+    ed.cx = 0;
+    ed.coloff = 0;
+    ed.wrapoff = 0;
+    // 目标行放到屏幕中间
+    ed.rowoff = std::max(0, ed.cy - (rows - 3) / 2);
+    editor_scroll(ed, rows);
+    set_status(ed, "Line " + to_string(ed.cy + 1) + "/" + to_string(ed.buf.line_count()));
+}
+
+// 跳到命中分布栏第 y 行对应的一段：段内已有取回的命中就停在第一个上，否则停在段首所在的行
+void minimap_jump(EditorState &ed, int y, int rows) {
+    int h = rows - 3;
+    uint64_t total = ed.buf.length(), a = total * y / h, b = total * (y + 1) / h;
+    ed.undo.boundary();
+    auto it = lower_bound(ed.search_results.begin(), ed.search_results.end(), a);
+    if (it != ed.search_results.end() && *it < b) {
+        ed.search_idx = it - ed.search_results.begin();
+        goto_search(ed, rows);
+        return;
+    }
+    ed.cy = ed.buf.line_of(std::min(a, total));
+    ed.cx = 0;
+    ed.coloff = 0;
+    ed.wrapoff = 0;
+    ed.rowoff = std::max(0, ed.cy - h / 2);
+    editor_scroll(ed, rows);
+    set_status(ed, "Line " + to_string(ed.cy + 1) + "/" + to_string(ed.buf.line_count()));
+}
+
+// 跳到光标之后的下一个命中密集区：命中数超过各段中位数两倍的连续几段算一个，到末尾后从头找
+void jump_next_cluster(EditorState &ed, int rows) {
+    int h = rows - 3;
+    vector<uint64_t> n;
+    if (h <= 0 || minimap_counts(ed, h, n) == 0) {
+        set_status(ed, ed.search_density ? "No matches yet" : "Search first (^F)");
+        return;
+    }
+    vector<uint64_t> sorted = n;
+    std::nth_element(sorted.begin(), sorted.begin() + h / 2, sorted.end());
+    uint64_t limit = 2 * sorted[h / 2];
+    auto hot = [&](int y) { return n[y] > limit; };
+    uint64_t total = ed.buf.length(), pos = ed.buf.line_start(ed.cy) + ed.cx;
+    int from = total ? std::min<uint64_t>(pos * h / total, h - 1) : 0, y = from + 1;
+    // 跳过光标所在的密集区
+    while (y < h && hot(y) && hot(y - 1)) ++y;
+    for (int k = 0; k < h; ++k, ++y) {
+        if (y == h) y = 0;
+        if (hot(y) && (y == 0 || !hot(y - 1))) {
+            minimap_jump(ed, y, rows);
+            return;
+        }
+    }
+    set_status(ed, "Matches are spread evenly");
+}
+
+void update_bracket_hl(EditorState &ed);
+
+void draw_frame(EditorState &ed, int rows, int cols) {
+    editor_scroll(ed, rows);
+    update_bracket_hl(ed);
+    draw_rows(ed, rows, cols);
+    if (ed.show_stats) draw_stats(ed, rows, cols);
+    draw_status(ed, rows, cols);
+    draw_msg(ed, rows);
+    draw_shortcuts(ed, rows, cols);
+    ed.frame_cells = ed.screen.flush();
+    cols = text_cols(ed, cols);
+    uint64_t x = cursor_col(ed) - ed.coloff;
+    if (ed.wrap) cursor_wrap_row(ed, cols, x);
+    move(cursor_screen_row(ed, cols, rows-3), x);
+    refresh();
+}
+
+// 替换用的匹配流：复用后台搜索任务，命中按文档顺序取出
+struct ReplaceStream {
+    shared_ptr<SearchJob> job;
+    vector<uint64_t> hits;
+    vector<uint32_t> lens;
+    bool finished = false;
+
+    uint64_t len(const string &word, size_t i) const { return lens.empty() ? word.size() : lens[i]; }
+};
+
+// 取走已完成的块；没有新结果时在状态栏显示进度并等一会儿。按了 ^C 返回 false
+bool pull_matches(EditorState &ed, ReplaceStream &rs, int rows, int cols) {
+    rs.finished = collect_search(*rs.job, rs.hits, rs.lens);
+    if (rs.finished) return true;
+    uint64_t pct = rs.job->total ? rs.job->scanned * 100 / rs.job->total : 100;
+    set_status(ed, "Replacing: " + to_string(pct) + "% scanned, " + to_string(rs.hits.size()) +
+                   " matches (^C to cancel)");
+    draw_status(ed, rows, cols);
+    draw_msg(ed, rows);
+    ed.screen.flush();
+    refresh();
+    timeout(50);
+    int c = getch();
+    timeout(-1);
+    if (c != 3) return true;
+    rs.job->cancel = true;
+    set_status(ed, "Replace cancelled");
+    return false;
+}
+
+// 把 hits 中的区间一次换成 rep：新的片段序列整体换上，撤销时一步恢复
+size_t apply_replace(EditorState &ed, const vector<uint64_t> &hits, const vector<uint32_t> &lens,
+                     uint64_t fixed, const string &rep) {
+    uint64_t cursor = ed.buf.line_start(ed.cy) + ed.cx, old_len = ed.buf.length();
+    vector<PieceTable::Piece> old, now;
+    size_t n = ed.buf.replace_ranges(hits, lens, fixed, rep.data(), rep.size(), old, now);
+    if (n == 0) return 0;
+    ed.undo.record_replace(old, old_len, now, ed.buf.length(), cursor);
+    ed.dirty = true;
+    set_cursor_offset(ed, cursor);
+    return n;
+}
+
+// 全部替换：各块在线程池里并行匹配，按顺序收齐后一次生成新的片段序列。
+// confirm 为真时逐个确认，消费同一个匹配流，已替换部分造成的偏移用 delta 修正
+void replace_all(EditorState &ed, const string &word, const string &rep, bool confirm, int rows, int cols) {
+    cancel_search(ed, false);
+    ed.search_word = word;
+    publish_index(ed, true);
+    string err;
+    ReplaceStream rs;
+    rs.job = start_search(ed.buf, word, ed.search_regex, err);
+    if (!rs.job) {
+        set_status(ed, "Bad regex: " + err);
+        return;
+    }
+    auto t0 = chrono::steady_clock::now();
+    size_t done = 0;
+    if (!confirm) {
+        while (!rs.finished)
+            if (!pull_matches(ed, rs, rows, cols)) return;
+        done = apply_replace(ed, rs.hits, rs.lens, word.size(), rep);
+        long ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - t0).count();
+        set_status(ed, "Replaced " + to_string(done) + " occurrences in " + to_string(ms) + " ms");
+        editor_scroll(ed, rows);
+        return;
+    }
+
+    ed.undo.boundary();
+    uint64_t from = ed.buf.line_start(ed.cy) + ed.cx;
+    int64_t delta = 0;
+    size_t i = 0;
+    bool quit = false;
+    while (!quit) {
+        if (i >= rs.hits.size()) {
+            if (rs.finished) break;
+            if (!pull_matches(ed, rs, rows, cols)) return;
+            continue;
+        }
+        if (rs.hits[i] < from) {
+            i++;
+            continue;
+        }
+        uint64_t pos = rs.hits[i] + delta, len = rs.len(word, i);
+        set_cursor_offset(ed, pos);
+        ed.search_results.assign(1, pos);
+        ed.search_lens.assign(1, len);
+        ed.search_idx = 0;
+        ed.search_version = ed.buf.version();
+        ed.search_flash = true;
+        set_status(ed, "Replace? (y)es (n)o (a)ll remaining (q)uit  [" + to_string(done) + " replaced]");
+        draw_frame(ed, rows, cols);
+        int c = getch();
+        if (c == 'y' || c == 'Y') {
+            // 单个命中也走整体替换，删和插算作一步撤销
+            apply_replace(ed, vector<uint64_t>{pos}, vector<uint32_t>{(uint32_t)len}, len, rep);
+            delta += (int64_t)rep.size() - (int64_t)len;
+            done++;
+            i++;
+        } else if (c == 'n' || c == 'N') {
+            i++;
+        } else if (c == 'a' || c == 'A') {
+            while (!rs.finished)
+                if (!pull_matches(ed, rs, rows, cols)) break;
+            if (!rs.finished) break;
+            vector<uint64_t> rest(rs.hits.begin() + i, rs.hits.end());
+            for (auto &h : rest) h += delta;
+            vector<uint32_t> rest_lens;
+            if (!rs.lens.empty()) rest_lens.assign(rs.lens.begin() + i, rs.lens.end());
+            done += apply_replace(ed, rest, rest_lens, word.size(), rep);
+            quit = true;
+        } else {
+            quit = true;
+        }
+    }
+    rs.job->cancel = true;
+    ed.search_results.clear();
+    ed.search_lens.clear();
+    ed.undo.boundary();
+    set_status(ed, "Replaced " + to_string(done) + " occurrences");
+    editor_scroll(ed, rows);
+}
+
+// 后台 JSON 索引完成后换上；JSON 文件整份索引好之后自动建一次，之后文档改了按需重建
+void publish_json(EditorState &ed) {
+    if (ed.json_job && ed.json_job->done) {
+        ed.json = ed.json_job->index;
+        ed.json_job.reset();
+    }
+    if (!ed.json && !ed.json_job && !ed.index_job && is_json(ed) && ed.buf.length())
+        ed.json_job = start_json_index(ed.buf);
+}
+
+// 保证 ed.json 对应当前文档，需要时重建并在状态栏显示进度；^C 取消返回 false
+bool json_ready(EditorState &ed, int rows, int cols) {
+    if (!is_json(ed)) {
+        set_status(ed, "Not a JSON file");
+        return false;
+    }
+    publish_index(ed, true);
+    if (ed.json && ed.json->version == ed.buf.version()) return true;
+    if (ed.json_job && ed.json_job->index->version != ed.buf.version()) cancel_json(ed, false);
+    if (!ed.json_job) ed.json_job = start_json_index(ed.buf);
+    while (!ed.json_job->done) {
+        uint64_t pct = ed.buf.length() ? ed.json_job->scanned * 50 / ed.buf.length() : 100;
+        set_status(ed, "Indexing JSON structure: " + to_string(pct) + "% (^C to cancel)");
+        draw_status(ed, rows, cols);
+        draw_msg(ed, rows);
+        ed.screen.flush();
+        refresh();
+        timeout(50);
+        int c = getch();
+        timeout(-1);
+        if (c == 3) {
+            cancel_json(ed, false);
+            set_status(ed, "Cancel");
+            return false;
+        }
+    }
+    publish_json(ed);
+    set_status(ed, "");
+    return true;
+}
+
+// 代码文件的块索引：编辑时由 buf.on_lines 标记改动的行，这里在两帧之间补分析，每次不超过 20ms
+void publish_blocks(EditorState &ed) {
+    if (ed.index_job || !ed.blocks.language() || ed.blocks.ready()) return;
+    ed.blocks.refresh(ed.buf, chrono::milliseconds(20));
+}
+
+// 保证块索引是最新的，没分析完就在状态栏显示进度接着做；^C 取消返回 false
+bool blocks_ready(EditorState &ed, int rows, int cols) {
+    if (ed.blocks.too_large()) {
+        set_status(ed, "Too many lines for block navigation");
+        return false;
+    }
+    if (!ed.blocks.language()) {
+        set_status(ed, "No block structure for this file type");
+        return false;
+    }
+    publish_index(ed, true);
+    while (!ed.blocks.refresh(ed.buf, chrono::milliseconds(50))) {
+        uint64_t pct = 100 - ed.blocks.pending() * 100 / std::max<size_t>(ed.blocks.lines(), 1);
+        set_status(ed, "Indexing blocks: " + to_string(pct) + "% (^C to cancel)");
+        draw_status(ed, rows, cols);
+        draw_msg(ed, rows);
+        ed.screen.flush();
+        refresh();
+        timeout(0);
+        int c = getch();
+        timeout(-1);
+        if (c == 3) {
+            set_status(ed, "Cancel");
+            return false;
+        }
+    }
+    set_status(ed, "");
+    return true;
+}
+
+bool structure_ready(EditorState &ed, int rows, int cols) {
+    return is_json(ed) ? json_ready(ed, rows, cols) : blocks_ready(ed, rows, cols);
+}
+
+// 光标在括号上或紧跟在括号后时，记下它和配对的括号供绘制加粗；
+// 只用现成的索引，不等重建，按文档版本和光标位置缓存
+void update_bracket_hl(EditorState &ed) {
+    uint64_t pos = ed.buf.line_start(ed.cy) + ed.cx;
+    if (ed.bracket_version == ed.buf.version() && ed.bracket_pos == pos) return;
+    ed.bracket_hl[0] = ed.bracket_hl[1] = UINT64_MAX;
+    auto probe = [&](const auto &ix) {
+        uint64_t other;
+        for (uint64_t p : {pos, pos - 1}) {
+            if (p == pos - 1 && ed.cx == 0) break;
+            if (!ix.match(ed.buf, p, other)) continue;
+            if (other != UINT64_MAX) {
+                ed.bracket_hl[0] = p;
+                ed.bracket_hl[1] = other;
+            }
+            break;
+        }
+    };
+    if (ed.json && ed.json->version == ed.buf.version()) probe(*ed.json);
+    else if (ed.blocks.ready()) probe(ed.blocks);
+    else return;
+    ed.bracket_version = ed.buf.version();
+    ed.bracket_pos = pos;
+}
+
+// ^] 跳到配对括号；不在括号上时跳到包住光标的括号对的开括号
+template <class Index>
+void goto_bracket(EditorState &ed, const Index &ix, int rows) {
+    uint64_t pos = ed.buf.line_start(ed.cy) + ed.cx, other, o, c;
+    // 光标紧跟在括号后面时也算
+    if (ix.match(ed.buf, pos, other) || (ed.cx > 0 && ix.match(ed.buf, pos - 1, other))) {
+        if (other == UINT64_MAX) {
+            set_status(ed, "Unmatched bracket");
+            return;
+        }
+        set_cursor_offset(ed, other);
+    } else if (ix.enclosing(ed.buf, pos, o, c)) {
+        set_cursor_offset(ed, o);
+    } else {
+        set_status(ed, is_json(ed) ? "Not inside an object or array" : "Not inside brackets");
+        return;
+    }
+    editor_scroll(ed, rows);
+}
+
+void goto_bracket(EditorState &ed, int rows, int cols) {
+    if (!structure_ready(ed, rows, cols)) return;
+    if (is_json(ed)) goto_bracket(ed, *ed.json, rows);
+    else goto_bracket(ed, ed.blocks, rows);
+}
+
+// 本行最后一个跨到后面行的括号对，没有就找包住光标、跨越多行的最内层括号对
+template <class Index>
+bool bracket_fold(EditorState &ed, const Index &ix, uint64_t &o, uint64_t &c) {
+    uint64_t ls = ed.buf.line_start(ed.cy), len = ed.buf.line_length(ed.cy);
+    if (len <= 1 << 16) {
+        string line = ed.buf.read(ls, len);
+        for (size_t i = line.size(); i-- > 0; ) {
+            if (line[i] != '{' && line[i] != '[' && line[i] != '(') continue;
+            o = ls + i;
+            if (ix.match(ed.buf, o, c) && c != UINT64_MAX && ed.buf.line_of(c) > (size_t)ed.cy) return true;
+        }
+    }
+    uint64_t pos = ls + ed.cx;
+    while (ix.enclosing(ed.buf, pos, o, c)) {
+        if (ed.buf.line_of(c) > ed.buf.line_of(o)) return true;
+        if (o == 0) break;
+        pos = o - 1;
+    }
+    return false;
+}
+
+// ^K 折叠或展开：光标行已折叠就展开，否则折叠括号对；
+// Python 优先折叠以本行为块头的缩进块，括号也没有时折叠包住本行的缩进块
+void toggle_fold(EditorState &ed, int rows, int cols) {
+    if (ed.folds.remove(ed.cy)) {
+        set_status(ed, "Unfolded");
+        return;
+    }
+    if (!structure_ready(ed, rows, cols)) return;
+    uint64_t o = 0, c = 0;
+    size_t lo = ed.cy, lc = 0;
+    if (is_python(ed) && ed.blocks.indent_block(lo, lc)) {
+        o = ed.buf.line_start(lo);
+    } else if (is_json(ed) ? bracket_fold(ed, *ed.json, o, c) : bracket_fold(ed, ed.blocks, o, c)) {
+        lo = ed.buf.line_of(o);
+        lc = ed.buf.line_of(c);
+    } else if (is_python(ed) && ed.blocks.indent_parent(ed.cy, lo) && ed.blocks.indent_block(lo, lc)) {
+        o = ed.buf.line_start(lo);
+    } else {
+        set_status(ed, "Nothing to fold");
+        return;
+    }
+    ed.folds.add(lo, lc);
+    set_cursor_offset(ed, o);
+    editor_scroll(ed, rows);
+    set_status(ed, "Folded " + to_string(lc - lo) + " lines (^K to unfold)");
+}
+
+// ^P 按路径跳转，如 $.items[3].name
+void goto_json_path(EditorState &ed, int rows, int cols) {
+    string path = prompt(ed, "JSON path:");
+    if (path.empty() || !json_ready(ed, rows, cols)) return;
+    auto t0 = chrono::steady_clock::now();
+    uint64_t pos;
+    string err;
+    if (!ed.json->find_path(ed.buf, path, pos, err)) {
+        set_status(ed, err);
+        return;
+    }
+    set_cursor_offset(ed, pos);
+    editor_scroll(ed, rows);
+    long ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - t0).count();
+    set_status(ed, path + " at line " + to_string(ed.cy + 1) + " (" + to_string(ms) + " ms)");
+}
+
+void draw_help(EditorState &ed) {
     clear();
     int y = 1;
     mvprintw(y++, 2, "SEditor Help");
     y++;
     mvprintw(y++, 2, "^O Save    ^X Exit    ^C Cancel    ^F Find");
     mvprintw(y++, 2, "^G Help    Arrows Move    Mouse Wheel Scroll");
-    mvprintw(y++, 2, "");
+    mvprintw(y++, 2, "^Z Undo    ^Y Redo    (history limit: SEDITOR_UNDO_MB, default 64)");
+    mvprintw(y++, 2, "^W Soft wrap on/off; long lines scroll horizontally when off");
+    mvprintw(y++, 2, "^T Latency/IO stats overlay (SEDITOR_STATS=1 prints them on exit)");
+    mvprintw(y++, 2, "^E Follow appends to the file like tail -f (or start with -f)");
+    mvprintw(y++, 2, "Edits are journaled to .<name>.swp; reopen the file after a crash to recover them");
+    mvprintw(y++, 2, "^L Go to line: N for line N, N%% for a position in the file");
+    mvprintw(y++, 2, "^] Matching bracket, ^K fold/unfold a block (Python folds by indentation)");
+    mvprintw(y++, 2, "JSON: ^P go to path like $.items[3].name");
+    y++;
     mvprintw(y++, 2, "Find: Press ^ next, ^C to cancel");
+    mvprintw(y++, 2, "^R toggles regex search: . [] [^] \\d \\w \\s * + ? {m,n} | () ^ $");
+    mvprintw(y++, 2, "^\\ Replace: a replaces every match at once, c asks y/n/a/q for each; ^C cancels");
+    mvprintw(y++, 2, "^B Match density bar (click to jump), ^N next dense cluster of search hits");
+    mvprintw(y++, 2, "^D Search all files under the directory (start with a directory to begin there)");
     mvprintw(y++, 2, "Exit: If modified, ^X then Enter to save and exit, ^X to force exit, ^C to cancel");
-    mvprintw(y++, 2, "");
+    y++;
     mvprintw(y++, 2, "Syntax highlighting: cpp/py/js/java/json");
-    mvprintw(y++, 2, "");
+    y++;
+    mvprintw(y++, 2, "Block cache: %lu hits, %lu misses, %lu prefetched, %lu evicted",
+             (unsigned long)ed.cache.hits, (unsigned long)ed.cache.misses,
+             (unsigned long)ed.cache.prefetched, (unsigned long)ed.cache.evicted);
+    y++;
     mvprintw(y++, 2, "Press any key to return to the editor...");
     refresh();
     getch();
 }
 
-void editor_loop(EditorState &ed) {
-    int rows, cols;
-    getmaxyx(stdscr, rows, cols);
-    mousemask(ALL_MOUSE_EVENTS | REPORT_MOUSE_POSITION, NULL);
-    MEVENT event;
-    while (1) {
-        if (ed.loading) {
-            clear();
-            mvprintw(1, 2, "Loading, please wait...");
-            refresh();
-            std::this_thread::sleep_for(std::chrono::milliseconds(50));
-            continue;
-        }
-        if (ed.search_flash && ((clock() - ed.last_search_time) > (CLOCKS_PER_SEC))) {
-            ed.search_flash = false;
-        }
+// 离开有修改的文档前询问：Enter 保存，^X 放弃修改，^C 取消。返回能否离开
+bool confirm_leave(EditorState &ed, int rows, int cols) {
+    set_status(ed, "File modified. Save? (Enter=Yes, ^X=No, ^C=Cancel)");
+    draw_status(ed, rows, cols);
+    draw_msg(ed, rows);
+    ed.screen.flush();
+    int ch = getch();
+    if (ch == '\n' || ch == '\r') { // Enter保存
+        string fname = prompt(ed, "File Name", ed.filename);
+        return save_file(ed, fname);
+    }
+    if (ch == 24) { // ^X放弃修改
+        ed.journal.discard();
+        return true;
+    }
+    set_status(ed, "Cancel");
+    return false;
+}
 
-        draw_rows(ed, rows, cols);
-        draw_status(ed, rows, cols);
-        draw_msg(ed, rows, cols);
-        draw_shortcuts(rows, cols);
-        move(ed.cy - ed.rowoff, ed.cx);
-        refresh();
+// 打开命中所在的文件，光标放到命中处；行还没索引到时等后台索引
+bool open_grep_hit(EditorState &ed, const GrepHit &hit, int rows, int cols) {
+    if (hit.path != ed.filename) {
+        if (ed.dirty && !confirm_leave(ed, rows, cols)) return false;
+        if (ed.follow) set_follow(ed, false);
+        ed.journal.discard();
+        open_file(ed, hit.path);
+        recover_journal(ed);
+    }
+    ed.undo.boundary();
+    if (hit.line >= ed.buf.line_count() && ed.index_job) publish_index(ed, true);
+    ed.cy = std::min<uint64_t>(hit.line, ed.buf.line_count() - 1);
+    ed.cx = std::min<uint64_t>(hit.col, ed.buf.line_length(ed.cy));
+    ed.coloff = 0;
+    ed.wrapoff = 0;
+    ed.rowoff = std::max(0, ed.cy - (rows - 3) / 2);
+    editor_scroll(ed, rows);
+    set_status(ed, hit.path + ":" + to_string(hit.line + 1));
+    return true;
+}
 
-        int c = getch();
-        if (c == KEY_MOUSE) {
-            if (getmouse(&event) == OK) {
-                if (event.bstate & BUTTON4_PRESSED) {
-                    if (ed.cy > 0) ed.cy--;
-                }
-                if (event.bstate & BUTTON5_PRESSED) {
-                    if (ed.cy < (int)ed.cache_lines.size() - 1) ed.cy++;
-                }
-                ed.cx = min(ed.cx, (int)ed.cache_lines[ed.cy].size());
-                if (ed.cy < ed.rowoff) ed.rowoff = ed.cy;
-                int screen_rows = rows-3;
-                if (ed.cy >= ed.rowoff + screen_rows) ed.rowoff = ed.cy - (screen_rows-1);
+// 询问搜索词，在 grep_root 下开始新的目录搜索
+bool start_grep_prompt(EditorState &ed) {
+    string word = prompt(ed, string(ed.search_regex ? "Grep regex" : "Grep") + " in " + ed.grep_root + ":",
+                         ed.grep_word);
+    if (word.empty()) return false;
+    string err;
+    auto job = start_grep(ed.grep_root, word, ed.search_regex, err);
+    if (!job) {
+        set_status(ed, err);
+        return false;
+    }
+    if (ed.grep_job) cancel_grep(*ed.grep_job);
+    ed.grep_job = job;
+    ed.grep_word = word;
+    ed.grep_hits.clear();
+    ed.grep_sorted = false;
+    ed.grep_sel = ed.grep_top = 0;
+    return true;
+}
+
+void draw_grep(EditorState &ed, int rows, int cols) {
+    int list = rows - 3;
+    ed.screen.begin(rows, cols);
+    for (int y = 0; y < list && ed.grep_top + y < ed.grep_hits.size(); ++y) {
+        const GrepHit &h = ed.grep_hits[ed.grep_top + y];
+        string loc = h.path + ":" + to_string(h.line + 1) + ": ";
+        size_t lead = h.text.find_first_not_of(" \t");
+        if (lead == string::npos) lead = h.text.size();
+        int x = ed.screen.put(y, 0, loc.data(), loc.size(), COLOR_PAIR(1));
+        ed.screen.put(y, x, h.text.data() + lead, h.text.size() - lead);
+        if (ed.grep_top + y == ed.grep_sel) ed.screen.style(y, 0, cols, A_REVERSE);
+    }
+    GrepJob &job = *ed.grep_job;
+    string stat = " Grep \"" + ed.grep_word + "\" in " + ed.grep_root + "  " + to_string(ed.grep_hits.size()) +
+                  " hits  " + to_string(job.files) + " files searched";
+    if (job.skipped) stat += ", " + to_string(job.skipped) + " binary skipped";
+    if (!job.done) stat += "  scanning...";
+    else if (job.truncated) stat += "  (stopped at " + to_string(GREP_MAX_HITS) + " hits)";
+    else if (ed.grep_hits.empty()) stat += "  no matches";
+    ed.screen.put(rows-3, 0, stat.data(), stat.size());
+    ed.screen.style(rows-3, 0, cols, A_REVERSE);
+    draw_msg(ed, rows);
+    static const string keys = "Enter Open  Up/Down PgUp/PgDn Select  ^D New search  ^C Back";
+    int end = ed.screen.put(rows-1, 0, keys.data(), keys.size());
+    ed.screen.style(rows-1, 0, end, A_REVERSE);
+    ed.screen.flush();
+    move(std::min<size_t>(ed.grep_sel - ed.grep_top, list - 1), 0);
+    refresh();
+}
+
+// 目录搜索的结果列表，搜索在后台继续，新结果随时追加。Enter 打开选中的命中，^D 换个词重新搜，
+// ^C 回到编辑器（搜索不停，下次进来接着看）。没有搜索时先询问。返回是否打开了文件
+bool grep_picker(EditorState &ed, int rows, int cols) {
+    if (!ed.grep_job && !start_grep_prompt(ed)) return false;
+    int list = rows - 3;
+    set_status(ed, "");
+    while (true) {
+        bool finished = collect_grep(*ed.grep_job, ed.grep_hits);
+        // 结果按完成顺序到达；结束后排一次序，选中的还是原来那条
+        if (finished && !ed.grep_sorted) {
+            ed.grep_sorted = true;
+            auto less = [](const GrepHit &a, const GrepHit &b) {
+                return a.path != b.path ? a.path < b.path : a.line < b.line;
+            };
+            GrepHit sel = ed.grep_sel < ed.grep_hits.size() ? ed.grep_hits[ed.grep_sel] : GrepHit();
+            std::sort(ed.grep_hits.begin(), ed.grep_hits.end(), less);
+            if (!ed.grep_hits.empty() && ed.grep_sel > 0) {
+                ed.grep_sel = std::lower_bound(ed.grep_hits.begin(), ed.grep_hits.end(), sel, less) - ed.grep_hits.begin();
+                ed.grep_top = ed.grep_sel > (size_t)list / 2 ? ed.grep_sel - list / 2 : 0;
             }
-            continue;
         }
-        else if (c == 7) { // ^G
-            draw_help(rows, cols);
-            continue;
-        }
-        else if (c == 6) { // ^F
-    string prompt_word = ed.search_word.empty() ? "Find" : "Find(" + ed.search_word + ")";
-    string word = prompt(ed, prompt_word + ":", ed.search_word);
+        if (ed.grep_sel < ed.grep_top) ed.grep_top = ed.grep_sel;
+        if (ed.grep_sel >= ed.grep_top + list) ed.grep_top = ed.grep_sel - list + 1;
+        draw_grep(ed, rows, cols);
 
-    // 如果输入内容和当前search_word一样，也跳到下一个
-    if ((word.empty() && !ed.search_word.empty()) || word == ed.search_word) {
-        if (!ed.search_results.empty()) {
-            ed.search_idx = (ed.search_idx + 1) % ed.search_results.size();
-            goto_search(ed, rows);
+        timeout(finished ? -1 : 50);
+        int c = getch();
+        timeout(-1);
+        size_t n = ed.grep_hits.size();
+        if (c == ERR) continue;
+        if (c == KEY_UP && ed.grep_sel > 0) ed.grep_sel--;
+        else if (c == KEY_DOWN && ed.grep_sel + 1 < n) ed.grep_sel++;
+        else if (c == KEY_PPAGE) ed.grep_sel -= std::min<size_t>(ed.grep_sel, list);
+        else if (c == KEY_NPAGE && n) ed.grep_sel = std::min<size_t>(ed.grep_sel + list, n - 1);
+        else if (c == KEY_HOME) ed.grep_sel = 0;
+        else if (c == KEY_END && n) ed.grep_sel = n - 1;
+        else if (c == 4) start_grep_prompt(ed);   // ^D
+        else if ((c == '\n' || c == '\r') && ed.grep_sel < n) {
+            GrepHit hit = ed.grep_hits[ed.grep_sel];
+            if (open_grep_hit(ed, hit, rows, cols)) return true;
         }
-    } else if (!word.empty()) {
-        do_search(ed, word);
-        if (!ed.search_results.empty()) {
-            ed.search_idx = 0;
-            goto_search(ed, rows);
-        } else {
-            set_status(ed, "Not found");
+        else if (c == 3 || c == 27) {
+            set_status(ed, "");
+            return false;
         }
     }
-    continue;
 }
-        else if (c == 24) { // ^X
-    if (ed.dirty) {
-        set_status(ed, "File modified. Save? (Enter=Yes, ^X=No, ^C=Cancel)");
+
+// 处理一个按键；返回 false 表示退出编辑器
+bool handle_key(EditorState &ed, int c, int rows, int cols) {
+    MEVENT event;
+    if (c == KEY_MOUSE) {
+        if (getmouse(&event) == OK) {
+            uint64_t col = cursor_col(ed);
+            if (event.bstate & BUTTON4_PRESSED) {
+                ed.cy = ed.folds.prev(ed.cy);
+            }
+            if (event.bstate & BUTTON5_PRESSED) {
+                if (ed.folds.next(ed.cy) < (int)ed.buf.line_count()) ed.cy = ed.folds.next(ed.cy);
+            }
+            // 点命中分布栏跳到那一段
+            if ((event.bstate & (BUTTON1_PRESSED | BUTTON1_CLICKED)) && ed.minimap && event.x == cols - 1 &&
+                event.y < rows - 3)
+                minimap_jump(ed, event.y, rows);
+            keep_column(ed, col);
+            editor_scroll(ed, rows);
+            ed.undo.boundary();
+        }
+        return true;
+    }
+    else if (c == 7) { // ^G
+        draw_help(ed);
+        ed.screen.invalidate();
+        return true;
+    }
+    else if (c == 6) { // ^F
+        string prompt_word = ed.search_regex ? "Regex" : "Find";
+        if (!ed.search_word.empty()) prompt_word += "(" + ed.search_word + ")";
+        string word = prompt(ed, prompt_word + ":", ed.search_word);
+
+        // 如果输入内容和当前search_word一样，也跳到下一个
+        if ((word.empty() && !ed.search_word.empty()) || word == ed.search_word) {
+            search_next(ed, rows);
+        } else if (!word.empty()) {
+            do_search(ed, word);
+            publish_search(ed, rows);
+        }
+        return true;
+    }
+    else if (c == 12) { // ^L 跳到行号或百分比位置
+        string arg = prompt(ed, "Go to line (N or N%):");
+        if (!arg.empty()) goto_line(ed, arg, rows);
+        return true;
+    }
+    else if (c == 28) { // ^\ 替换
+        string prompt_word = ed.search_regex ? "Replace regex" : "Replace";
+        if (!ed.search_word.empty()) prompt_word += "(" + ed.search_word + ")";
+        string word = prompt(ed, prompt_word + ":", ed.search_word);
+        if (word.empty()) return true;
+        string rep = prompt(ed, "With:");
+        set_status(ed, "Replace all (a), confirm each (c), ^C to cancel");
         draw_status(ed, rows, cols);
-        draw_msg(ed, rows, cols);
+        draw_msg(ed, rows);
+        ed.screen.flush();
         int ch = getch();
-        if (ch == '\n' || ch == '\r') { // Enter保存
-            string fname = prompt(ed, "File Name", ed.filename);
-            save_file(ed, fname);
-            break;
-        } else if (ch == 24) { // ^X强制退出
-            break;
-        } else if (ch == 3) { // ^C取消
+        if (ch == 'a' || ch == 'A' || ch == 'c' || ch == 'C')
+            replace_all(ed, word, rep, ch == 'c' || ch == 'C', rows, cols);
+        else
             set_status(ed, "Cancel");
-            continue;
-        } else {
-            set_status(ed, "Cancel");
-            continue;
+        return true;
+    }
+    else if (c == 29) { // ^] 配对括号
+        goto_bracket(ed, rows, cols);
+        return true;
+    }
+    else if (c == 11) { // ^K 折叠/展开
+        toggle_fold(ed, rows, cols);
+        return true;
+    }
+    else if (c == 16) { // ^P JSON 路径
+        goto_json_path(ed, rows, cols);
+        return true;
+    }
+    else if (c == 5) { // ^E 跟随文件末尾
+        set_follow(ed, !ed.follow);
+        return true;
+    }
+    else if (c == 2) { // ^B 命中分布栏
+        ed.minimap = !ed.minimap;
+        ed.screen.invalidate();
+        return true;
+    }
+    else if (c == 14) { // ^N 下一个命中密集区
+        jump_next_cluster(ed, rows);
+        return true;
+    }
+    else if (c == 4) { // ^D 在目录下搜索
+        grep_picker(ed, rows, cols);
+        return true;
+    }
+    else if (c == 20) { // ^T 统计浮层
+        ed.show_stats = !ed.show_stats;
+        return true;
+    }
+    else if (c == 23) { // ^W 切换自动换行
+        ed.wrap = !ed.wrap;
+        set_status(ed, ed.wrap ? "Soft wrap on" : "Soft wrap off");
+        return true;
+    }
+    else if (c == 18) { // ^R 切换正则搜索
+        ed.search_regex = !ed.search_regex;
+        cancel_search(ed, false);
+        ed.search_word.clear();
+        set_status(ed, ed.search_regex ? "Regex search on" : "Regex search off");
+        return true;
+    }
+    else if (c == 24) { // ^X
+        if (!ed.dirty) return false; // 没有修改直接退出
+        return !confirm_leave(ed, rows, cols);
+    }
+    else if (c == 15) { // ^O
+        if (!ed.filename.empty()) {
+            save_file(ed, ed.filename);
+            ed.undo.boundary();
         }
-    } else {
-        break; // 没有修改直接退出
     }
-}
-        else if (c == 15) { // ^O
-    if (!ed.filename.empty()) {
-        save_file(ed, ed.filename);
+    else if (c == 26) { // ^Z
+        editor_undo(ed, rows, false);
+    }
+    else if (c == 25) { // ^Y
+        editor_undo(ed, rows, true);
     }
+    else if (c == KEY_UP || c == KEY_DOWN || c == KEY_LEFT || c == KEY_RIGHT) {
+        ed.undo.boundary();
+        editor_move_cursor(ed, c);
+        editor_scroll(ed, rows);
+    }
+    else if (c == KEY_BACKSPACE || c == 127 || c == 8) {
+        del_char(ed);
+        editor_scroll(ed, rows);
+    }
+    else if (c == '\n') {
+        insert_newline(ed);
+        editor_scroll(ed, rows);
+    }
+    else if (c == 3) { // ^C
+        set_status(ed, "Cancel");
+    }
+    else if (c < 256 && (isprint(c) || c >= 128)) {   // UTF-8 按字节到达，依次插入
+        insert_char(ed, c);
+    }
+    return true;
 }
-        else if (c == KEY_UP || c == KEY_DOWN || c == KEY_LEFT || c == KEY_RIGHT) {
-            editor_move_cursor(ed, c, rows, cols);
-        }
-        else if (c == KEY_BACKSPACE || c == 127 || c == 8) {
-            del_char(ed);
+
+void editor_loop(EditorState &ed) {
+    int rows, cols;
+    getmaxyx(stdscr, rows, cols);
+    mousemask(ALL_MOUSE_EVENTS | REPORT_MOUSE_POSITION, NULL);
+    chrono::steady_clock::time_point key_time;
+    bool key_pending = false;
+    auto last_paint = chrono::steady_clock::now();
+    while (1) {
+        compact_journal(ed.journal, ed.buf);
+        follow_file(ed);
+        check_disk(ed);
+        publish_index(ed);
+        publish_search(ed, rows);
+        publish_json(ed);
+        publish_blocks(ed);
+        if (ed.search_flash && ((clock() - ed.last_search_time) > (CLOCKS_PER_SEC))) {
+            ed.search_flash = false;
         }
-        else if (c == '\n') {
-            insert_newline(ed);
+
+        auto t0 = chrono::steady_clock::now();
+        draw_frame(ed, rows, cols);
+        last_paint = chrono::steady_clock::now();
+        stats().draw.record_since(t0);
+        if (key_pending) {
+            stats().input_to_paint.record_since(key_time);
+            key_pending = false;
         }
-        else if (c == 3) { // ^C
-            set_status(ed, "Cancel");
+
+        // 索引未完成时定时醒来刷新行数和进度
+        int wait_ms = ed.index_job || ed.search_job || ed.json_job || ed.reload_job || ed.cache.pending() ? 50 : -1;
+        // 没有别的事也定时醒来检查磁盘上的文件
+        if (wait_ms < 0 && !ed.follow && !ed.newfile) wait_ms = chrono::duration_cast<chrono::milliseconds>(DISK_CHECK_INTERVAL).count();
+        if (ed.blocks.language() && !ed.blocks.ready() && !ed.index_job) wait_ms = 0;
+        // 跟随时同时等键盘和 inotify，文件有变化就先去处理
+        if (ed.follow) {
+            struct pollfd fds[2] = {{0, POLLIN, 0}, {ed.watcher.fd(), POLLIN, 0}};
+            if (poll(fds, 2, wait_ms) <= 0 || !(fds[0].revents & POLLIN)) continue;
         }
-        else if (isprint(c)) {
-            insert_char(ed, c);
+        timeout(wait_ms);
+        int c = getch();
+        timeout(-1);
+        if (c == ERR) continue;
+        key_time = chrono::steady_clock::now();
+        key_pending = true;
+
+        // 把已经到达的输入一起处理完再画下一帧；距上一帧不足一个帧间隔时顺便等一等后续输入，
+        // 连续的可打印字符合成一次插入，粘贴和按键连发都只触发有限次重绘
+        auto batch_start = key_time, paint_due = last_paint + FRAME_INTERVAL;
+        string text;
+        bool quit = false;
+        while (1) {
+            if (c == KEY_PASTE_BEGIN) {
+                insert_text(ed, text);
+                text.clear();
+                insert_paste(ed, read_paste());
+            } else if (c == '\n' || (c < 256 && (isprint(c) || c >= 128))) {
+                text += (char)c;
+            } else {
+                insert_text(ed, text);
+                text.clear();
+                if (!handle_key(ed, c, rows, cols)) {
+                    quit = true;
+                    break;
+                }
+            }
+            auto now = chrono::steady_clock::now();
+            if (now - batch_start >= FRAME_INTERVAL) break;   // 输入不停也要按时出帧
+            timeout(now < paint_due ? chrono::duration_cast<chrono::milliseconds>(paint_due - now).count() + 1 : 0);
+            c = getch();
+            timeout(-1);
+            if (c == ERR) break;
         }
+        insert_text(ed, text);
+        if (quit) break;
     }
 }
 
+// SEditor --batch SCRIPT [-j N] [--mem MB] FILE...：不开界面，对每个文件执行同一个脚本，逐个报告耗时
+int batch_main(int argc, char* argv[]) {
+    unsigned threads = worker_pool().size();
+    size_t mem_mb = 1024;
+    vector<string> files;
+    for (int i = 3; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "-j" && i + 1 < argc) threads = std::max(1, atoi(argv[++i]));
+        else if (a == "--mem" && i + 1 < argc) mem_mb = std::max(1l, atol(argv[++i]));
+        else files.push_back(a);
+    }
+    MappedFile script;
+    vector<BatchCommand> cmds;
+    string err;
+    if (!script.open(argv[2])) {
+        fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
+        return 2;
+    }
+    if (!parse_batch_script(string(script.data, script.size), cmds, err)) {
+        fprintf(stderr, "%s: %s\n", argv[2], err.c_str());
+        return 2;
+    }
+    auto t0 = chrono::steady_clock::now();
+    size_t changed = 0, failed = 0;
+    uint64_t bytes = 0;
+    run_batch(cmds, files, threads, mem_mb << 20, [&](const BatchResult& r) {
+        bytes += r.bytes;
+        changed += r.changed && r.ok;
+        if (!r.ok) {
+            failed++;
+            printf("FAIL  %s: %s\n", r.file.c_str(), r.err.c_str());
+        } else {
+            printf("%s  %s  %.1f MB  %zu edits  load %.1f ms  edit %.1f ms  save %.1f ms  mem %.1f MB\n",
+                   r.changed ? "SAVED" : "SAME ", r.file.c_str(), r.bytes / 1048576.0, r.edits, r.load_ms,
+                   r.edit_ms, r.save_ms, r.peak_mem / 1048576.0);
+        }
+        fflush(stdout);
+    });
+    double ms = chrono::duration<double, std::milli>(chrono::steady_clock::now() - t0).count();
+    printf("%zu files, %zu changed, %zu failed, %.1f MB in %.1f ms on %u threads\n", files.size(), changed, failed,
+           bytes / 1048576.0, ms, std::min<unsigned>(threads, files.size()));
+    stop_log();
+    return failed ? 1 : 0;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        printf("Usage: %s filename\n", argv[0]);
+    if (argc > 1 && string(argv[1]) == "--batch") {
+        if (argc < 4) {
+            printf("Usage: %s --batch script [-j threads] [--mem MB] file...\n", argv[0]);
+            return 2;
+        }
+        return batch_main(argc, argv);
+    }
+    bool follow = argc > 2 && (string(argv[1]) == "-f" || string(argv[1]) == "+F");
+    if (argc < 2 + follow) {
+        printf("Usage: %s [-f] filename\n       %s directory\n       %s --batch script [-j threads] [--mem MB] file...\n", argv[0], argv[0], argv[0]);
         return 1;
     }
     EditorState ed;
+    // 为跟随模式预留地址空间，文件变长后可以原地映射
+    ed.file.reserve = 64ull << 30;
+    if (const char* mb = getenv("SEDITOR_UNDO_MB"))
+        ed.undo.set_limit((size_t)atol(mb) << 20);
+    // 按终端的编码输出宽字符
+    setlocale(LC_ALL, "");
+    ed.screen.utf8 = strcmp(nl_langinfo(CODESET), "UTF-8") == 0;
     initscr();
     raw();
     keypad(stdscr, TRUE);
+    // 开启括号粘贴
+    define_key("\033[200~", KEY_PASTE_BEGIN);
+    define_key("\033[201~", KEY_PASTE_END);
+    printf("\033[?2004h");
+    fflush(stdout);
+    idlok(stdscr, TRUE);
     noecho();
     curs_set(1);
 
@@ -695,9 +2023,42 @@ int main(int argc, char* argv[]) {
         init_pair(5, COLOR_YELLOW, -1); // 搜索高亮
     }
 
-    open_file(ed, argv[1]);
-    editor_loop(ed);
+    ed.buf.journal = &ed.journal;
+    // 行号变化同步给块索引和折叠
+    ed.buf.on_lines = [&ed](size_t first, size_t removed, size_t added) {
+        ed.blocks.lines_changed(first, removed, added);
+        ed.folds.lines_changed(first, removed, added);
+    };
+    string target = argv[1 + follow];
+    struct stat st;
+    bool opened = true;
+    if (!follow && stat(target.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        // 打开目录：先在目录下搜索，从结果里选一个文件打开
+        ed.grep_root = target;
+        opened = grep_picker(ed, LINES, COLS);
+    } else {
+        open_file(ed, target);
+        recover_journal(ed);
+    }
+    if (follow) set_follow(ed, true);
+    if (opened) editor_loop(ed);
+    // 没保存成功就退出时保留日志，下次打开可以恢复
+    if (ed.dirty) ed.journal.sync();
+    else ed.journal.discard();
+    cancel_index(ed);
+    cancel_search(ed, true);
+    cancel_json(ed, true);
+    cancel_disk_jobs(ed);
+    if (ed.grep_job) cancel_grep(*ed.grep_job);
+    SE_LOG(INFO, "block cache: hits=" + to_string(ed.cache.hits) + " misses=" + to_string(ed.cache.misses) +
+             " prefetched=" + to_string(ed.cache.prefetched) + " evicted=" + to_string(ed.cache.evicted));
 
+    printf("\033[?2004l");
+    fflush(stdout);
     endwin();
+    string report = stats_report();
+    SE_LOG(INFO, "stats:\n" + report);
+    if (getenv("SEDITOR_STATS")) fprintf(stderr, "%s\n", report.c_str());
+    stop_log();
     return 0;
 }
\ No newline at end of file
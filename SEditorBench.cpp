@@ -0,0 +1,331 @@
+// 核心库基准：生成合成文件，测首屏时间、索引/搜索/保存吞吐、每帧高亮开销和峰值内存。
+// 每个用例在子进程中运行，结果按 JSON Lines 写到 stdout，便于记录和比较回归
+#include "SEditorCore.h"
+#include <cstdlib>
+#include <random>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+struct BenchOptions {
+    string dir = "/tmp/seditor-bench";
+    vector<uint64_t> sizes = {1ull << 20, 64ull << 20, 256ull << 20};
+    vector<string> kinds = {"cpp", "py", "json"};
+    vector<string> shapes = {"short", "long"};
+    int rows = 50, cols = 200, frames = 200;
+    bool keep = true;
+};
+
+const uint64_t LONG_LINE_BYTES = 32 << 20;   // long 形状下每行的长度
+const size_t PATTERN_SIZE = 1 << 20;
+
+static double now_ms() {
+    return chrono::duration<double, milli>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double gbps(uint64_t bytes, double ms) {
+    return ms > 0 ? bytes / ms / 1e6 : 0.0;
+}
+
+// "64M" "1G" "4096" 之类
+static uint64_t parse_size(const string& s) {
+    char* end;
+    double v = strtod(s.c_str(), &end);
+    switch (*end) {
+        case 'k': case 'K': v *= 1 << 10; break;
+        case 'm': case 'M': v *= 1 << 20; break;
+        case 'g': case 'G': v *= 1 << 30; break;
+    }
+    return (uint64_t)v;
+}
+
+static vector<string> split_list(const string& s) {
+    vector<string> out;
+    size_t a = 0;
+    while (a <= s.size()) {
+        size_t b = s.find(',', a);
+        if (b == string::npos) b = s.size();
+        if (b > a) out.push_back(s.substr(a, b - a));
+        a = b + 1;
+    }
+    return out;
+}
+
+// 一段约 1 MB 的样本文本，生成文件时重复写出
+static string make_pattern(const string& kind, const string& shape) {
+    mt19937 rng(42);
+    string out;
+    char line[256];
+    for (int i = 0; out.size() < PATTERN_SIZE; ++i) {
+        unsigned v = rng() % 100000;
+        if (kind == "cpp") {
+            if (i % 40 == 0) out += "/* block comment\n   spanning lines */\n";
+            if (i % 10 == 0) snprintf(line, sizeof(line), "static int func_%u(const std::string& s) {\n", v);
+            else snprintf(line, sizeof(line), "    int value_%u = compute(%u, \"str%u\"); // note %d\n", v, v % 97, v, i);
+        } else if (kind == "py") {
+            if (i % 40 == 0) out += "    \"\"\"docstring\n    more text\n    \"\"\"\n";
+            if (i % 10 == 0) snprintf(line, sizeof(line), "def func_%u(x, y=None):\n", v);
+            else snprintf(line, sizeof(line), "    value_%u = x * %u + len('s%u')  # note %d\n", v, v % 97, v, i);
+        } else {
+            snprintf(line, sizeof(line), "{\"id\": %u, \"name\": \"item%u\", \"tags\": [\"a\", \"b\"], \"ok\": true, \"v\": %u.5},\n",
+                     v, i, v % 97);
+        }
+        out += line;
+    }
+    // 超长行：去掉换行，写文件时每 LONG_LINE_BYTES 补一个
+    if (shape == "long") std::replace(out.begin(), out.end(), '\n', ' ');
+    return out;
+}
+
+static bool write_fully(int fd, const char* p, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+// 已存在且大小相符时直接复用
+static bool ensure_file(const string& path, uint64_t size, const string& kind, const string& shape) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && (uint64_t)st.st_size == size) return true;
+    fprintf(stderr, "generating %s\n", path.c_str());
+    string pat = make_pattern(kind, shape);
+    string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = true;
+    uint64_t done = 0, next_nl = LONG_LINE_BYTES;
+    while (ok && done < size) {
+        size_t n = std::min<uint64_t>(pat.size(), size - done);
+        if (shape == "long") n = std::min<uint64_t>(n, next_nl - done);
+        ok = write_fully(fd, pat.data(), n);
+        done += n;
+        if (ok && shape == "long" && done == next_nl && done < size) {
+            ok = write_fully(fd, "\n", 1);
+            done++;
+            next_nl = done + LONG_LINE_BYTES;
+        }
+    }
+    ok = ::close(fd) == 0 && ok;
+    return ok && rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+// 模拟界面画一屏：普通行走高亮缓存，超长行只读、只分析可见的一段
+static void render_frame(const PieceTable& buf, Highlighter& hl, int top, int rows, int cols) {
+    uint8_t st = hl.language() ? hl.state_before(buf, top) : (uint8_t)HL_NORMAL;
+    vector<HlSpan> spans;
+    int total = buf.line_count();
+    for (int r = top; r < top + rows && r < total; ++r) {
+        uint64_t len = buf.line_length(r);
+        string slice = buf.read(buf.line_start(r), std::min<uint64_t>(len, cols));
+        if (!hl.language()) continue;
+        if (len > Highlighter::LONG_LINE) {
+            spans.clear();
+            lex_line(*hl.language(), slice.data(), slice.size(), st, spans);
+        } else {
+            st = hl.get(buf, r, st).out;
+        }
+    }
+}
+
+// 等搜索任务完成，返回命中数
+static size_t wait_search(SearchJob& job) {
+    std::unique_lock<std::mutex> lk(job.mu);
+    job.cv.wait(lk, [&] { return job.pending == 0; });
+    size_t n = 0;
+    for (auto& h : job.hits) n += h.size();
+    return n;
+}
+
+struct BenchResult {
+    vector<pair<string, string>> fields;
+
+    void add(const string& k, double v) {
+        char s[64];
+        snprintf(s, sizeof(s), "%.3f", v);
+        fields.emplace_back(k, s);
+    }
+    void add(const string& k, uint64_t v) { fields.emplace_back(k, to_string(v)); }
+    void add(const string& k, const string& v) { fields.emplace_back(k, "\"" + v + "\""); }
+    string json() const {
+        string out = "{";
+        for (size_t i = 0; i < fields.size(); ++i)
+            out += (i ? ", \"" : "\"") + fields[i].first + "\": " + fields[i].second;
+        return out + "}";
+    }
+};
+
+static void run_case(const BenchOptions& opt, const string& path, const string& kind, const string& shape) {
+    BenchResult res;
+    res.add("file", path);
+    res.add("kind", kind);
+    res.add("shape", shape);
+
+    // 尽量让文件不在页缓存里，首屏和索引测的是冷启动
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(fd);
+    }
+
+    MappedFile file;
+    PieceTable buf;
+    Highlighter hl;
+    hl.set_lang(find_lang(kind));
+    double t0 = now_ms();
+    uint64_t first;
+    if (!open_document(path, file, buf, first, false)) {
+        fprintf(stderr, "cannot open %s\n", path.c_str());
+        exit(1);
+    }
+    render_frame(buf, hl, 0, opt.rows, opt.cols);
+    double t1 = now_ms();
+    res.add("bytes", (uint64_t)file.size);
+    res.add("first_screen_ms", t1 - t0);
+
+    // 和编辑器一样边索引边写旁路缓存，写缓存的开销算在索引里
+    double t2 = now_ms();
+    auto sidecar = IndexSidecar::open(path, file);
+    if (first < file.size) {
+        auto job = start_index_job(file.data, first, file.size, sidecar);
+        publish_index(*job, buf, true);
+    }
+    double t3 = now_ms();
+    res.add("lines", (uint64_t)buf.line_count());
+    // 从打开到全部索引完成（含首屏），小文件在首屏阶段就已索引完
+    res.add("index_gbps", gbps(file.size, (t1 - t0) + (t3 - t2)));
+    res.add("index_bytes_per_line", (double)buf.original_index().memory_bytes() / buf.line_count());
+
+    // 缓存写好后重新打开：只核对文件头和首尾指纹，不再扫描
+    if (sidecar && sidecar->wait()) {
+        MappedFile again;
+        PieceTable rebuf;
+        uint64_t indexed;
+        double a = now_ms();
+        open_document(path, again, rebuf, indexed);
+        res.add("reopen_ms", now_ms() - a);
+        if (indexed != file.size || rebuf.line_count() != buf.line_count())
+            fprintf(stderr, "%s: sidecar index mismatch\n", path.c_str());
+    }
+
+    // 页缓存已热，再整体索引一遍，测纯扫描速度
+    {
+        PieceTable warm;
+        warm.reset(file.data, 0, LineIndex());
+        double a = now_ms();
+        auto job = start_index_job(file.data, 0, file.size);
+        publish_index(*job, warm, true);
+        res.add("index_warm_gbps", gbps(file.size, now_ms() - a));
+    }
+
+    string err;
+    double t4 = now_ms();
+    auto lit = start_search(buf, "zqxjk", false, err);
+    size_t hits = wait_search(*lit);
+    double t5 = now_ms();
+    res.add("search_gbps", gbps(buf.length(), t5 - t4));
+    res.add("search_hits", (uint64_t)hits);
+
+    // 没有字面前缀的正则，走反向 DFA 标记起点的路径
+    auto re = start_search(buf, "[xz]q[0-9]+", true, err);
+    hits = re ? wait_search(*re) : 0;
+    res.add("regex_gbps", gbps(buf.length(), now_ms() - t5));
+
+    // 每帧高亮：跳到文件各处（要从同步点推状态）、逐行滚动、编辑后重画
+    int total = buf.line_count();
+    int frames = opt.frames;
+    double a = now_ms();
+    for (int f = 0; f < frames; ++f) render_frame(buf, hl, (uint64_t)total * f / frames, opt.rows, opt.cols);
+    res.add("hl_jump_frame_us", (now_ms() - a) * 1000 / frames);
+    a = now_ms();
+    for (int f = 0; f < frames; ++f) render_frame(buf, hl, std::min(f, std::max(0, total - 1)), opt.rows, opt.cols);
+    res.add("hl_scroll_frame_us", (now_ms() - a) * 1000 / frames);
+    int top = total / 2;
+    a = now_ms();
+    for (int f = 0; f < frames; ++f) {
+        buf.insert(buf.line_start(std::min(top + 5, total - 1)), "x", 1);
+        render_frame(buf, hl, top, opt.rows, opt.cols);
+    }
+    res.add("hl_edit_frame_us", (now_ms() - a) * 1000 / frames);
+    res.add("hl_relexed", (uint64_t)hl.relexed);
+
+    // 保存：先存上面只改了一处的文档（绝大部分走内核复制），再每 1 MB 改一处后保存
+    string out = opt.dir + "/save.out";
+    a = now_ms();
+    bool ok = save_document(buf, file.fd, out, err);
+    res.add("save_mbps", ok ? buf.length() / (now_ms() - a) / 1e3 : 0.0);
+    for (uint64_t p = 0; p < buf.length(); p += 1 << 20) buf.insert(p, "y", 1);
+    a = now_ms();
+    ok = ok && save_document(buf, file.fd, out, err);
+    res.add("save_edited_mbps", ok ? buf.length() / (now_ms() - a) / 1e3 : 0.0);
+    res.add("pieces", (uint64_t)buf.piece_count());
+    unlink(out.c_str());
+    if (!ok) fprintf(stderr, "save failed: %s\n", err.c_str());
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    res.add("peak_rss_kb", (uint64_t)ru.ru_maxrss);
+    printf("%s\n", res.json().c_str());
+    fflush(stdout);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [--dir DIR] [--sizes 1M,64M,1G,10G] [--kinds cpp,py,json] [--shapes short,long]\n"
+            "          [--rows N] [--cols N] [--frames N] [--no-keep]\n"
+            "Prints one JSON object per file on stdout.\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions opt;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        bool has = i + 1 < argc;
+        if (a == "--dir" && has) opt.dir = argv[++i];
+        else if (a == "--sizes" && has) {
+            opt.sizes.clear();
+            for (auto& s : split_list(argv[++i])) opt.sizes.push_back(parse_size(s));
+        }
+        else if (a == "--kinds" && has) opt.kinds = split_list(argv[++i]);
+        else if (a == "--shapes" && has) opt.shapes = split_list(argv[++i]);
+        else if (a == "--rows" && has) opt.rows = atoi(argv[++i]);
+        else if (a == "--cols" && has) opt.cols = atoi(argv[++i]);
+        else if (a == "--frames" && has) opt.frames = std::max(1, atoi(argv[++i]));
+        else if (a == "--no-keep") opt.keep = false;
+        else {
+            usage(argv[0]);
+            return a == "--help" || a == "-h" ? 0 : 1;
+        }
+    }
+    mkdir(opt.dir.c_str(), 0755);
+    // 旁路缓存放在测试目录里，不碰用户的 ~/.cache
+    setenv("XDG_CACHE_HOME", (opt.dir + "/cache").c_str(), 1);
+
+    int failed = 0;
+    for (uint64_t size : opt.sizes)
+        for (auto& kind : opt.kinds)
+            for (auto& shape : opt.shapes) {
+                string path = opt.dir + "/" + kind + "-" + shape + "-" + to_string(size) + "." + kind;
+                if (!ensure_file(path, size, kind, shape)) {
+                    fprintf(stderr, "cannot create %s: %s\n", path.c_str(), strerror(errno));
+                    return 1;
+                }
+                // 子进程里跑，峰值内存互不影响
+                fflush(stdout);
+                pid_t pid = fork();
+                if (pid == 0) {
+                    run_case(opt, path, kind, shape);
+                    _exit(0);
+                }
+                int status = 0;
+                waitpid(pid, &status, 0);
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+                if (!opt.keep) unlink(path.c_str());
+            }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,3444 @@
+#include "SEditorCore.h"
+#include <bitset>
+#include <sys/sendfile.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <cstddef>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SEDITOR_X86 1
+#endif
+
+using namespace std;
+
+// 多生产者单消费者的有界环形队列（Vyukov）：每个槽位带序号，生产者用 CAS 抢位置，
+// 写满的日志就地截断，不分配内存
+class Logger {
+public:
+    static constexpr size_t SLOTS = 4096;
+    static constexpr size_t MSG_SIZE = 240;
+
+    Logger() {
+        for (size_t i = 0; i < SLOTS; ++i) slots[i].seq.store(i, std::memory_order_relaxed);
+        drainer = std::thread([this] { run(); });
+    }
+
+    void push(LogLevel level, const std::string& msg) {
+        uint64_t pos = head.load(std::memory_order_relaxed);
+        Slot* s;
+        while (true) {
+            s = &slots[pos % SLOTS];
+            uint64_t seq = s->seq.load(std::memory_order_acquire);
+            int64_t dif = (int64_t)seq - (int64_t)pos;
+            if (dif == 0 && head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            if (dif < 0) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            if (dif > 0) pos = head.load(std::memory_order_relaxed);
+        }
+        s->level = level;
+        s->time = chrono::system_clock::now();
+        s->len = std::min(msg.size(), MSG_SIZE);
+        memcpy(s->msg, msg.data(), s->len);
+        s->seq.store(pos + 1, std::memory_order_release);
+    }
+
+    void stop() {
+        if (stopping.exchange(true)) return;
+        drainer.join();
+    }
+    std::atomic<uint64_t> dropped{0};
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> seq;
+        LogLevel level;
+        chrono::system_clock::time_point time;
+        size_t len;
+        char msg[MSG_SIZE];
+    };
+    Slot slots[SLOTS];
+    std::atomic<uint64_t> head{0};
+    uint64_t tail = 0;              // 只有后台线程访问
+    std::atomic<bool> stopping{false};
+    FILE* out = nullptr;
+    std::thread drainer;
+
+    void run() {
+        while (!stopping.load()) {
+            drain();
+            std::this_thread::sleep_for(chrono::milliseconds(20));
+        }
+        drain();
+        if (out) fclose(out);
+    }
+    void drain() {
+        static const char* names[] = {"DEBUG", "INFO", "WARNING", "ERROR"};
+        bool any = false;
+        while (true) {
+            Slot& s = slots[tail % SLOTS];
+            if (s.seq.load(std::memory_order_acquire) != tail + 1) break;
+            if (!out) open_output();
+            if (out) {
+                time_t t = chrono::system_clock::to_time_t(s.time);
+                struct tm tm;
+                localtime_r(&t, &tm);
+                char stamp[32];
+                strftime(stamp, sizeof(stamp), "%F %T", &tm);
+                fprintf(out, "%s [%s] %.*s%s\n", stamp, names[(int)s.level], (int)s.len, s.msg,
+                        s.len == MSG_SIZE ? "..." : "");
+            }
+            s.seq.store(tail + SLOTS, std::memory_order_release);
+            ++tail;
+            any = true;
+        }
+        if (any && out) fflush(out);
+    }
+    void open_output() {
+        const char* env = getenv("SEDITOR_LOG");
+        string path = env && *env ? env : "/tmp/seditor-" + to_string(getuid()) + ".log";
+        out = fopen(path.c_str(), "a");
+    }
+};
+
+// 故意不析构：其他线程在静态对象析构期间仍可能写日志
+static Logger& logger() {
+    static Logger* l = new Logger;
+    return *l;
+}
+
+void WriteLog(LogLevel level, const std::string& msg) {
+    logger().push(level, msg);
+}
+
+void stop_log() {
+    logger().stop();
+}
+
+uint64_t log_dropped() {
+    return logger().dropped.load();
+}
+
+Stats& stats() {
+    static Stats s;
+    return s;
+}
+
+std::string stats_report() {
+    Stats& s = stats();
+    char io[128];
+    snprintf(io, sizeof(io), "io: read %.1f MB, written %.1f MB; log dropped %llu",
+             s.io_read_bytes / 1048576.0, s.io_write_bytes / 1048576.0, (unsigned long long)log_dropped());
+    return "input-to-paint: " + s.input_to_paint.summary() + "\n" +
+           "draw: " + s.draw.summary() + "\n" +
+           "cache load: " + s.cache_load.summary() + "\n" + io;
+}
+
+// 关键词集合：编译期为每种语言找一个无冲突的哈希种子（完美哈希），
+// 查找时只算一次哈希、比较一次，不分配内存
+constexpr uint32_t keyword_hash(uint32_t seed, const char* s, size_t n) {
+    uint32_t h = seed;
+    for (size_t i = 0; i < n; ++i) h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+class KeywordSet {
+public:
+    template <size_t N>
+    constexpr KeywordSet(const std::string_view (&words)[N]) : seed(0), slots{} {
+        static_assert(N < SIZE / 2, "keyword table too small");
+        for (uint32_t s = 1;; ++s) {
+            bool ok = true;
+            for (auto& slot : slots) slot = {};
+            for (size_t i = 0; i < N && ok; ++i) {
+                auto& slot = slots[keyword_hash(s, words[i].data(), words[i].size()) & (SIZE - 1)];
+                if (!slot.empty()) ok = false;
+                else slot = words[i];
+            }
+            if (ok) { seed = s; break; }
+        }
+    }
+    bool contains(const char* s, size_t n) const {
+        const std::string_view& w = slots[keyword_hash(seed, s, n) & (SIZE - 1)];
+        return w.size() == n && memcmp(w.data(), s, n) == 0;
+    }
+
+private:
+    static constexpr size_t SIZE = 256;
+    uint32_t seed;
+    std::string_view slots[SIZE];
+};
+
+constexpr std::string_view cpp_words[] = {
+    "int","for","if","else","while","return","switch","case","break","const","void","class",
+    "public","private","protected","struct","new","delete","virtual","override","static","using",
+    "namespace","include","this","template","typename","auto","long","short","unsigned","signed",
+    "operator","try","catch","throw"
+};
+constexpr std::string_view py_words[] = {
+    "def","if","else","elif","for","while","return","import","from","class","try","except",
+    "finally","with","as","lambda","pass","break","continue","yield","in","is","not","and","or",
+    "print","self","global","nonlocal","assert","del","raise"
+};
+constexpr std::string_view js_words[] = {
+    "function","var","let","const","if","else","for","while","return","switch","case","break",
+    "class","constructor","new","import","export","extends","from","try","catch","finally","throw"
+};
+constexpr std::string_view java_words[] = {
+    "int","public","private","protected","void","class","static","final","return","if","else","for",
+    "while","switch","case","break","new","import","package","extends","implements","try","catch",
+    "finally","this","super"
+};
+constexpr std::string_view json_words[] = {"true","false","null"};
+
+constexpr KeywordSet cpp_keywords(cpp_words);
+constexpr KeywordSet py_keywords(py_words);
+constexpr KeywordSet js_keywords(js_words);
+constexpr KeywordSet java_keywords(java_words);
+constexpr KeywordSet json_keywords(json_words);
+
+constexpr LangSpec languages[] = {
+    {"cpp",  &cpp_keywords,  "//", true,  false, false, true},
+    {"py",   &py_keywords,   "#",  false, true,  false, true},
+    {"js",   &js_keywords,   "//", true,  false, true,  true},
+    {"java", &java_keywords, "//", true,  false, false, true},
+    {"json", &json_keywords, nullptr, false, false, false, false},
+};
+
+const LangSpec* find_lang(const string& ext) {
+    for (const auto& l : languages)
+        if (ext == l.ext) return &l;
+    return nullptr;
+}
+
+// 在 s[i, n) 中找多行结构的结束位置（含结束符），找不到返回 n；字符串里跳过转义
+static size_t find_close(HlState st, const char* s, size_t n, size_t i, bool& closed) {
+    closed = false;
+    for (; i < n; ++i) {
+        char c = s[i];
+        if (st == HL_BLOCK_COMMENT) {
+            if (c == '*' && i + 1 < n && s[i + 1] == '/') { closed = true; return i + 2; }
+            continue;
+        }
+        if (c == '\\') { ++i; continue; }
+        if (st == HL_TEMPLATE && c == '`') { closed = true; return i + 1; }
+        char q = st == HL_TRIPLE_DQ ? '"' : '\'';
+        if (st != HL_TEMPLATE && c == q && i + 2 < n && s[i + 1] == q && s[i + 2] == q) {
+            closed = true;
+            return i + 3;
+        }
+    }
+    return n;
+}
+
+// 对一行做词法分析，输出着色区间，返回行尾状态
+uint8_t lex_line(const LangSpec& L, const char* s, size_t n, uint8_t state, vector<HlSpan>& out) {
+    auto emit = [&](size_t a, size_t b, HlKind k) {
+        if (b > a) out.push_back(HlSpan{(uint32_t)a, (uint32_t)(b - a), k});
+    };
+    auto is_ident = [](char c) { return isalnum((unsigned char)c) || c == '_'; };
+    size_t i = 0;
+    bool closed;
+    if (state != HL_NORMAL) {
+        i = find_close((HlState)state, s, n, 0, closed);
+        emit(0, i, state == HL_BLOCK_COMMENT ? HL_COMMENT : HL_STRING);
+        if (!closed) return state;
+    }
+    size_t lc_len = L.line_comment ? strlen(L.line_comment) : 0;
+    while (i < n) {
+        char c = s[i];
+        if (lc_len && i + lc_len <= n && memcmp(s + i, L.line_comment, lc_len) == 0) {
+            emit(i, n, HL_COMMENT);
+            return HL_NORMAL;
+        }
+        HlState multi = HL_NORMAL;
+        size_t open = 0;
+        if (L.block_comment && c == '/' && i + 1 < n && s[i + 1] == '*') { multi = HL_BLOCK_COMMENT; open = 2; }
+        else if (L.triple_quotes && (c == '"' || c == '\'') && i + 2 < n && s[i + 1] == c && s[i + 2] == c) {
+            multi = c == '"' ? HL_TRIPLE_DQ : HL_TRIPLE_SQ;
+            open = 3;
+        }
+        else if (L.template_strings && c == '`') { multi = HL_TEMPLATE; open = 1; }
+        if (multi != HL_NORMAL) {
+            size_t end = find_close(multi, s, n, i + open, closed);
+            emit(i, end, multi == HL_BLOCK_COMMENT ? HL_COMMENT : HL_STRING);
+            if (!closed) return multi;
+            i = end;
+            continue;
+        }
+        if (c == '"' || (c == '\'' && L.single_quotes)) {
+            size_t j = i + 1;
+            while (j < n && s[j] != c) j += s[j] == '\\' ? 2 : 1;
+            j = std::min(j + 1, n);
+            emit(i, j, HL_STRING);
+            i = j;
+            continue;
+        }
+        if (isalpha((unsigned char)c) || c == '_') {
+            size_t j = i;
+            while (j < n && is_ident(s[j])) ++j;
+            if (L.keywords->contains(s + i, j - i)) emit(i, j, HL_KEYWORD);
+            i = j;
+            continue;
+        }
+        if (isdigit((unsigned char)c)) {
+            size_t j = i;
+            while (j < n && (is_ident(s[j]) || s[j] == '.')) ++j;
+            emit(i, j, HL_NUMBER);
+            i = j;
+            continue;
+        }
+        ++i;
+    }
+    return HL_NORMAL;
+}
+
+// 换行扫描：把 [p, p+n) 内每个 '\n' 的位置（加上 base）追加到 out
+static void scan_newlines_scalar(const char* p, size_t n, uint64_t base, vector<uint64_t>& out) {
+    const char* end = p + n;
+    for (const char* q = p; q < end && (q = (const char*)memchr(q, '\n', end - q)); ++q)
+        out.push_back(base + (q - p));
+}
+
+#ifdef SEDITOR_X86
+static void scan_newlines_sse2(const char* p, size_t n, uint64_t base, vector<uint64_t>& out) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        uint32_t m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        while (m) {
+            out.push_back(base + i + __builtin_ctz(m));
+            m &= m - 1;
+        }
+    }
+    scan_newlines_scalar(p + i, n - i, base + i, out);
+}
+
+__attribute__((target("avx2")))
+static void scan_newlines_avx2(const char* p, size_t n, uint64_t base, vector<uint64_t>& out) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(p + i + 32));
+        uint64_t m = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, nl)) |
+                     ((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, nl)) << 32);
+        while (m) {
+            out.push_back(base + i + __builtin_ctzll(m));
+            m &= m - 1;
+        }
+    }
+    scan_newlines_sse2(p + i, n - i, base + i, out);
+}
+#endif
+
+// 启动时按 CPU 能力选一次实现
+static void (*const scan_newlines_impl)(const char*, size_t, uint64_t, vector<uint64_t>&) = [] {
+#ifdef SEDITOR_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return scan_newlines_avx2;
+    return scan_newlines_sse2;
+#else
+    return scan_newlines_scalar;
+#endif
+}();
+
+// 子串匹配：报告所有满足 i < limit 且 s[i, i+m) == needle 的 i（加上 base）
+static void find_all_scalar(const char* s, size_t n, const char* needle, size_t m, size_t limit,
+                            uint64_t base, vector<uint64_t>& out) {
+    if (m == 0 || n < m) return;
+    size_t stop = std::min(limit, n - m + 1);
+    for (size_t k = 0; k < stop;) {
+        const char* p = (const char*)memchr(s + k, needle[0], stop - k);
+        if (!p) break;
+        k = p - s;
+        if (memcmp(s + k, needle, m) == 0) out.push_back(base + k);
+        ++k;
+    }
+}
+
+#ifdef SEDITOR_X86
+// 首尾字节同时比较的预筛选，只对候选位置做 memcmp
+static void find_all_sse2(const char* s, size_t n, const char* needle, size_t m, size_t limit,
+                          uint64_t base, vector<uint64_t>& out) {
+    if (m == 0 || n < m) return;
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 16 <= n && i < limit; i += 16) {
+        __m128i bf = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i bl = _mm_loadu_si128((const __m128i*)(s + i + m - 1));
+        uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(bf, first), _mm_cmpeq_epi8(bl, last)));
+        while (mask) {
+            size_t k = i + __builtin_ctz(mask);
+            if (k < limit && (m <= 2 || memcmp(s + k + 1, needle + 1, m - 2) == 0)) out.push_back(base + k);
+            mask &= mask - 1;
+        }
+    }
+    if (i < limit) find_all_scalar(s + i, n - i, needle, m, limit - i, base + i, out);
+}
+
+__attribute__((target("avx2")))
+static void find_all_avx2(const char* s, size_t n, const char* needle, size_t m, size_t limit,
+                          uint64_t base, vector<uint64_t>& out) {
+    if (m == 0 || n < m) return;
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 32 <= n && i < limit; i += 32) {
+        __m256i bf = _mm256_loadu_si256((const __m256i*)(s + i));
+        __m256i bl = _mm256_loadu_si256((const __m256i*)(s + i + m - 1));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(bf, first), _mm256_cmpeq_epi8(bl, last)));
+        while (mask) {
+            size_t k = i + __builtin_ctz(mask);
+            if (k < limit && (m <= 2 || memcmp(s + k + 1, needle + 1, m - 2) == 0)) out.push_back(base + k);
+            mask &= mask - 1;
+        }
+    }
+    if (i < limit) find_all_sse2(s + i, n - i, needle, m, limit - i, base + i, out);
+}
+#endif
+
+static void (*const find_all_impl)(const char*, size_t, const char*, size_t, size_t, uint64_t, vector<uint64_t>&) = [] {
+#ifdef SEDITOR_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return find_all_avx2;
+    return find_all_sse2;
+#else
+    return find_all_scalar;
+#endif
+}();
+
+void scan_newlines(const char* p, size_t n, uint64_t base, vector<uint64_t>& out) {
+    scan_newlines_impl(p, n, base, out);
+}
+
+void find_all(const char* s, size_t n, const char* needle, size_t m, size_t limit,
+              uint64_t base, vector<uint64_t>& out) {
+    find_all_impl(s, n, needle, m, limit, base, out);
+}
+
+static bool is_ascii_scalar(const char* p, size_t n) {
+    uint64_t acc = 0;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        acc |= w;
+    }
+    for (; i < n; ++i) acc |= (unsigned char)p[i];
+    return !(acc & 0x8080808080808080ull);
+}
+
+#ifdef SEDITOR_X86
+// 先把整段按位或起来，最后才看一次最高位，循环里没有分支
+static bool is_ascii_sse2(const char* p, size_t n) {
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i*)(p + i)));
+    return _mm_movemask_epi8(acc) == 0 && is_ascii_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static bool is_ascii_avx2(const char* p, size_t n) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i*)(p + i)));
+    return _mm256_movemask_epi8(acc) == 0 && is_ascii_sse2(p + i, n - i);
+}
+#endif
+
+static bool (*const is_ascii_impl)(const char*, size_t) = [] {
+#ifdef SEDITOR_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return is_ascii_avx2;
+    return is_ascii_sse2;
+#else
+    return is_ascii_scalar;
+#endif
+}();
+
+bool is_ascii(const char* p, size_t n) {
+    return is_ascii_impl(p, n);
+}
+
+uint32_t utf8_next(const char* s, size_t n, size_t& i) {
+    unsigned char c = s[i];
+    if (c < 0x80) {
+        ++i;
+        return c;
+    }
+    int k;
+    uint32_t cp;
+    if (c >= 0xC2 && c <= 0xDF) k = 1, cp = c & 0x1F;
+    else if (c >= 0xE0 && c <= 0xEF) k = 2, cp = c & 0x0F;
+    else if (c >= 0xF0 && c <= 0xF4) k = 3, cp = c & 0x07;
+    else k = 0, cp = 0;
+    bool ok = k > 0 && i + k < n;
+    for (int m = 1; ok && m <= k; ++m) {
+        unsigned char b = s[i + m];
+        ok = (b & 0xC0) == 0x80;
+        cp = cp << 6 | (b & 0x3F);
+    }
+    // 过长编码、代理项和超出范围的码点都不合法
+    if (ok && ((k == 2 && (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF))) || (k == 3 && (cp < 0x10000 || cp > 0x10FFFF))))
+        ok = false;
+    if (!ok) {
+        ++i;
+        return 0xFFFD;
+    }
+    i += k + 1;
+    return cp;
+}
+
+namespace {
+
+struct CodeRange {
+    uint32_t lo, hi;
+};
+
+// 组合字符、变体选择符和零宽字符（常用区段）
+const CodeRange zero_width[] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF}, {0x05C1, 0x05C2},
+    {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A}, {0x064B, 0x065F}, {0x0670, 0x0670},
+    {0x06D6, 0x06DC}, {0x06DF, 0x06E4}, {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0711, 0x0711},
+    {0x0730, 0x074A}, {0x07A6, 0x07B0}, {0x0900, 0x0902}, {0x093A, 0x093A}, {0x093C, 0x093C},
+    {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957}, {0x0962, 0x0963}, {0x0E31, 0x0E31},
+    {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x1160, 0x11FF}, {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF},
+    {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064}, {0x20D0, 0x20FF}, {0x302A, 0x302D},
+    {0x3099, 0x309A}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF}, {0xE0100, 0xE01EF},
+};
+
+// 东亚宽字符（W）和全角字符（F）
+const CodeRange wide[] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC}, {0x23F0, 0x23F0},
+    {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267F, 0x267F},
+    {0x2693, 0x2693}, {0x26A1, 0x26A1}, {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE}, {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B}, {0x2728, 0x2728},
+    {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+    {0x27B0, 0x27B0}, {0x27BF, 0x27BF}, {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55},
+    {0x2E80, 0x303E}, {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+    {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19}, {0xFE30, 0xFE6F},
+    {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4}, {0x17000, 0x18AFF}, {0x1B000, 0x1B2FF},
+    {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F202},
+    {0x1F210, 0x1F23B}, {0x1F240, 0x1F248}, {0x1F250, 0x1F251}, {0x1F260, 0x1F265}, {0x1F300, 0x1F64F},
+    {0x1F680, 0x1F6FF}, {0x1F900, 0x1F9FF}, {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+};
+
+template <size_t N>
+bool in_ranges(const CodeRange (&r)[N], uint32_t cp) {
+    auto it = std::upper_bound(r, r + N, cp, [](uint32_t c, const CodeRange& x) { return c < x.lo; });
+    return it != r && cp <= (it - 1)->hi;
+}
+
+} // namespace
+
+int char_width(uint32_t cp) {
+    if (cp < 0x300) return 1;
+    if (in_ranges(zero_width, cp)) return 0;
+    return in_ranges(wide, cp) ? 2 : 1;
+}
+
+void ColumnMap::build(const char* s, size_t n) {
+    len = n;
+    col.clear();
+    if (is_ascii(s, n)) return;
+    col.resize(n + 1);
+    uint32_t c = 0, last = 0;     // 下一个字符的列；上一个簇的起始列
+    for (size_t i = 0; i < n;) {
+        size_t j = i;
+        int w = char_width(utf8_next(s, n, j));
+        uint32_t at = w == 0 ? last : c;
+        if (w > 0) last = c;
+        c += w;
+        std::fill(col.begin() + i, col.begin() + j, at);
+        i = j;
+    }
+    col[n] = c;
+}
+
+const ColumnMap& ColumnCache::get(const PieceTable& buf, int row) {
+    Entry& e = lines[row];
+    if (e.version == buf.version()) return e.map;
+    e.version = buf.version();
+    uint64_t len = buf.line_length(row);
+    if (len > Highlighter::LONG_LINE) {
+        e.map.len = len;
+        e.map.col.clear();
+        return e.map;
+    }
+    // 纯 ASCII 的行直接在片段上检查，不复制
+    bool ascii = true;
+    buf.for_each_segment(buf.line_start(row), len, [&](const char* p, size_t k) { ascii = ascii && is_ascii(p, k); });
+    if (ascii) {
+        e.map.len = len;
+        e.map.col.clear();
+        e.hash = 0;
+        return e.map;
+    }
+    buf.read_line(row, text);
+    uint64_t h = std::hash<std::string_view>()(text);
+    if (e.map.col.empty() || e.hash != h) e.map.build(text.data(), text.size());
+    e.hash = h;
+    return e.map;
+}
+
+void ColumnCache::trim(int top, int bottom) {
+    if (lines.size() < 1024) return;
+    for (auto it = lines.begin(); it != lines.end();) {
+        if (it->first < top || it->first > bottom) it = lines.erase(it);
+        else ++it;
+    }
+}
+
+static int first_bit(const bitset<256>& b) {
+    for (int c = 0; c < 256; ++c)
+        if (b[c]) return c;
+    return -1;
+}
+
+struct RegexNode {
+    enum Kind { EMPTY, CLASS, CONCAT, ALT, STAR, PLUS, QUEST, BOL, EOL } kind;
+    bitset<256> cls;
+    vector<RegexNode> kids;
+};
+
+class RegexParser {
+public:
+    explicit RegexParser(const string& pat) : s(pat) {}
+
+    bool parse(RegexNode& out, string& err) {
+        out = alt();
+        if (error.empty() && pos < s.size()) error = "unmatched )";
+        err = error;
+        return error.empty();
+    }
+
+private:
+    // 计数重复会复制子表达式，嵌套起来状态数成倍增长，超过就拒绝
+    static constexpr size_t MAX_NFA_STATES = 10000;
+
+    const string& s;
+    size_t pos = 0;
+    size_t grown = 0;       // 计数重复展开多出的 NFA 状态
+    string error;
+
+    static RegexNode node(RegexNode::Kind k) { return RegexNode{k, {}, {}}; }
+    static RegexNode wrap(RegexNode::Kind k, RegexNode child) {
+        RegexNode n = node(k);
+        n.kids.push_back(std::move(child));
+        return n;
+    }
+    static bitset<256> byte_class(bool (*pred)(int)) {
+        bitset<256> b;
+        for (int c = 0; c < 256; ++c)
+            if (pred(c)) b.set(c);
+        return b;
+    }
+    static bool is_digit(int c) { return isdigit(c); }
+    static bool is_word(int c) { return isalnum(c) || c == '_'; }
+    static bool is_space(int c) { return c != '\n' && isspace(c); }
+    // n 编译成 NFA 后的状态数
+    static size_t nfa_states(const RegexNode& n) {
+        size_t k = 0;
+        for (const auto& c : n.kids) k += nfa_states(c);
+        switch (n.kind) {
+            case RegexNode::EMPTY: case RegexNode::CONCAT: return k;
+            case RegexNode::ALT: return k + n.kids.size() - 1;
+            case RegexNode::STAR: case RegexNode::PLUS: case RegexNode::QUEST: return k + 1;
+            default: return 1;
+        }
+    }
+
+    RegexNode alt() {
+        RegexNode n = node(RegexNode::ALT);
+        n.kids.push_back(concat());
+        while (pos < s.size() && s[pos] == '|') {
+            ++pos;
+            n.kids.push_back(concat());
+        }
+        if (n.kids.size() == 1) return std::move(n.kids[0]);
+        return n;
+    }
+    RegexNode concat() {
+        RegexNode n = node(RegexNode::CONCAT);
+        while (error.empty() && pos < s.size() && s[pos] != '|' && s[pos] != ')')
+            n.kids.push_back(repeat());
+        return n;
+    }
+    RegexNode repeat() {
+        RegexNode a = atom();
+        while (error.empty() && pos < s.size()) {
+            char c = s[pos];
+            if (c == '*') { ++pos; a = wrap(RegexNode::STAR, std::move(a)); }
+            else if (c == '+') { ++pos; a = wrap(RegexNode::PLUS, std::move(a)); }
+            else if (c == '?') { ++pos; a = wrap(RegexNode::QUEST, std::move(a)); }
+            else if (c == '{' && counted(a)) {}
+            else break;
+            // 非贪婪后缀不影响是否匹配，按最长匹配处理
+            if (pos < s.size() && s[pos] == '?') ++pos;
+        }
+        return a;
+    }
+    // {m} {m,} {m,n}：展开成 m 个副本加若干可选副本
+    bool counted(RegexNode& a) {
+        size_t p = pos + 1;
+        auto number = [&](int& v) {
+            size_t b = p;
+            v = 0;
+            while (p < s.size() && isdigit((unsigned char)s[p]) && v <= 1000) v = v * 10 + (s[p++] - '0');
+            return p > b;
+        };
+        int lo, hi;
+        if (!number(lo)) return false;
+        hi = lo;
+        if (p < s.size() && s[p] == ',') {
+            ++p;
+            if (!number(hi)) hi = -1;
+        }
+        if (p >= s.size() || s[p] != '}') return false;
+        pos = p + 1;
+        if (lo > 1000 || hi > 1000 || (hi >= 0 && hi < lo)) {
+            error = "bad repeat count";
+            return true;
+        }
+        size_t one = nfa_states(a);
+        size_t total = lo * one + (hi < 0 ? one + 1 : (hi - lo) * (one + 1));
+        if (total > one) grown += total - one;
+        if (grown + s.size() > MAX_NFA_STATES) {
+            error = "pattern too large";
+            return true;
+        }
+        RegexNode n = node(RegexNode::CONCAT);
+        for (int i = 0; i < lo; ++i) n.kids.push_back(a);
+        if (hi < 0) {
+            n.kids.push_back(wrap(RegexNode::STAR, a));
+        } else {
+            RegexNode tail = node(RegexNode::EMPTY);
+            for (int i = lo; i < hi; ++i) {
+                RegexNode c = node(RegexNode::CONCAT);
+                c.kids.push_back(a);
+                c.kids.push_back(std::move(tail));
+                tail = wrap(RegexNode::QUEST, std::move(c));
+            }
+            n.kids.push_back(std::move(tail));
+        }
+        a = std::move(n);
+        return true;
+    }
+    // 反斜杠转义，返回对应字符集
+    bitset<256> escape() {
+        bitset<256> b;
+        if (pos >= s.size()) { error = "trailing \\"; return b; }
+        unsigned char c = s[pos++];
+        switch (c) {
+            case 'd': return byte_class(is_digit);
+            case 'D': return ~byte_class(is_digit);
+            case 'w': return byte_class(is_word);
+            case 'W': return ~byte_class(is_word);
+            case 's': return byte_class(is_space);
+            case 'S': return ~byte_class(is_space);
+            case 't': b.set('\t'); return b;
+            case 'r': b.set('\r'); return b;
+            case 'x': {
+                int v = 0, k = 0;
+                for (; k < 2 && pos < s.size() && isxdigit((unsigned char)s[pos]); ++k, ++pos)
+                    v = v * 16 + (isdigit((unsigned char)s[pos]) ? s[pos] - '0' : (tolower(s[pos]) - 'a' + 10));
+                if (k == 0) error = "bad \\x escape";
+                b.set(v);
+                return b;
+            }
+            default: b.set(c); return b;
+        }
+    }
+    bitset<256> bracket() {
+        bitset<256> b;
+        bool neg = pos < s.size() && s[pos] == '^';
+        if (neg) ++pos;
+        bool first = true;
+        while (pos < s.size() && (s[pos] != ']' || first)) {
+            first = false;
+            bitset<256> item;
+            int lo;
+            if (s[pos] == '\\') {
+                ++pos;
+                item = escape();
+                lo = item.count() == 1 ? first_bit(item) : -1;
+            } else {
+                lo = (unsigned char)s[pos++];
+                item.set(lo);
+            }
+            if (lo >= 0 && pos + 1 < s.size() && s[pos] == '-' && s[pos + 1] != ']') {
+                ++pos;
+                int hi = (unsigned char)s[pos++];
+                if (hi == '\\') {
+                    bitset<256> e = escape();
+                    hi = e.count() == 1 ? first_bit(e) : -1;
+                }
+                if (hi < lo) { error = "bad range in []"; return b; }
+                for (int c = lo; c <= hi; ++c) item.set(c);
+            }
+            b |= item;
+        }
+        if (pos >= s.size()) { error = "missing ]"; return b; }
+        ++pos;
+        return neg ? ~b : b;
+    }
+    RegexNode atom() {
+        char c = s[pos++];
+        RegexNode n = node(RegexNode::CLASS);
+        switch (c) {
+            case '(': {
+                if (s.compare(pos, 2, "?:") == 0) pos += 2;
+                RegexNode inner = alt();
+                if (pos >= s.size() || s[pos] != ')') error = "missing )";
+                else ++pos;
+                return inner;
+            }
+            case '*': case '+': case '?':
+                error = string("nothing to repeat before ") + c;
+                return n;
+            case '^': return node(RegexNode::BOL);
+            case '$': return node(RegexNode::EOL);
+            case '.': n.cls.set(); break;
+            case '[': n.cls = bracket(); break;
+            case '\\': n.cls = escape(); break;
+            default: n.cls.set((unsigned char)c); break;
+        }
+        n.cls.reset('\n');
+        return n;
+    }
+};
+
+struct Nfa {
+    enum Op { CHAR, SPLIT, BOL, EOL, MATCH };
+    struct State {
+        Op op;
+        int cls;        // CHAR 的字符集下标
+        int out, out1;
+    };
+    vector<State> st;
+    vector<bitset<256>> classes;
+    int start = -1;
+
+    void build(const RegexNode& re) {
+        st.clear();
+        classes.clear();
+        int match = add(State{MATCH, -1, -1, -1});
+        start = compile(re, match);
+    }
+
+private:
+    int add(State s) {
+        st.push_back(s);
+        return st.size() - 1;
+    }
+    // 从后往前编译：next 为匹配完 n 之后的状态
+    int compile(const RegexNode& n, int next) {
+        switch (n.kind) {
+            case RegexNode::EMPTY: return next;
+            case RegexNode::CLASS:
+                classes.push_back(n.cls);
+                return add(State{CHAR, (int)classes.size() - 1, next, -1});
+            case RegexNode::CONCAT:
+                for (size_t i = n.kids.size(); i-- > 0;) next = compile(n.kids[i], next);
+                return next;
+            case RegexNode::ALT: {
+                int s = compile(n.kids.back(), next);
+                for (size_t i = n.kids.size() - 1; i-- > 0;)
+                    s = add(State{SPLIT, -1, compile(n.kids[i], next), s});
+                return s;
+            }
+            case RegexNode::STAR: {
+                int s = add(State{SPLIT, -1, -1, next});
+                int body = compile(n.kids[0], s);
+                st[s].out = body;
+                return s;
+            }
+            case RegexNode::PLUS: {
+                int s = add(State{SPLIT, -1, -1, next});
+                int body = compile(n.kids[0], s);
+                st[s].out = body;
+                return body;
+            }
+            case RegexNode::QUEST:
+                return add(State{SPLIT, -1, compile(n.kids[0], next), next});
+            case RegexNode::BOL: return add(State{BOL, -1, next, -1});
+            case RegexNode::EOL: return add(State{EOL, -1, next, -1});
+        }
+        return next;
+    }
+};
+
+// 反转语法树，用于从右往左扫描；行首行尾断言随之互换
+static RegexNode reverse_regex(const RegexNode& n) {
+    RegexNode r{n.kind, n.cls, {}};
+    if (n.kind == RegexNode::BOL) r.kind = RegexNode::EOL;
+    else if (n.kind == RegexNode::EOL) r.kind = RegexNode::BOL;
+    for (const auto& k : n.kids) r.kids.push_back(reverse_regex(k));
+    if (n.kind == RegexNode::CONCAT) std::reverse(r.kids.begin(), r.kids.end());
+    return r;
+}
+
+// 所有匹配都必须以之开头的字面前缀，交给 SIMD 子串预筛选
+static bool literal_prefix(const RegexNode& n, string& out) {
+    switch (n.kind) {
+        case RegexNode::EMPTY: case RegexNode::BOL: return true;
+        case RegexNode::CLASS:
+            if (n.cls.count() != 1) return false;
+            out += (char)first_bit(n.cls);
+            return true;
+        case RegexNode::CONCAT:
+            for (const auto& k : n.kids)
+                if (!literal_prefix(k, out)) return false;
+            return true;
+        case RegexNode::PLUS:
+            literal_prefix(n.kids[0], out);
+            return false;
+        default: return false;
+    }
+}
+
+bool Regex::compile(const string& pat, string& err) {
+    RegexNode re;
+    if (!RegexParser(pat).parse(re, err)) return false;
+    fwd = make_shared<Nfa>();
+    fwd->build(re);
+    rev = make_shared<Nfa>();
+    rev->build(reverse_regex(re));
+    prefix.clear();
+    literal_prefix(re, prefix);
+    return true;
+}
+
+// 惰性 DFA：状态是 NFA 状态集合，转移在第一次用到时计算并缓存；
+// 缓存超过上限时整体清空重建，内存有界
+class LazyDFA {
+public:
+    // unanchored 为真时每一步都重新注入起始状态（相当于前面加 .*）
+    LazyDFA(const Nfa& nfa, bool unanchored) : nfa(nfa), unanchored(unanchored) { flush(); }
+
+    int start(bool bol) {
+        int& s = starts[bol];
+        if (s < 0) {
+            vector<int> set;
+            closure(nfa.start, bol, false, set);
+            s = intern(set);
+        }
+        return s;
+    }
+    int next(int s, unsigned char c) {
+        int t = states[s].next[c];
+        if (t >= 0) return t;
+        if (states.size() >= MAX_DFA_STATES) {
+            vector<int> keep = states[s].set;
+            flush();
+            s = intern(keep);
+        }
+        vector<int> set;
+        for (int i : states[s].set) {
+            const Nfa::State& x = nfa.st[i];
+            if (x.op == Nfa::CHAR && nfa.classes[x.cls][c]) closure(x.out, false, false, set);
+        }
+        if (unanchored) closure(nfa.start, false, false, set);
+        t = intern(set);
+        states[s].next[c] = t;
+        return t;
+    }
+    bool dead(int s) const { return states[s].set.empty(); }
+    bool match(int s) const { return states[s].match; }
+    // 在行尾时是否匹配（还要满足 $ 断言）
+    bool match_eol(int s) {
+        DState& d = states[s];
+        if (d.eol_match < 0) {
+            vector<int> set;
+            for (int i : d.set)
+                if (nfa.st[i].op == Nfa::EOL) closure(i, false, true, set);
+            d.eol_match = d.match || std::any_of(set.begin(), set.end(),
+                                                 [&](int i) { return nfa.st[i].op == Nfa::MATCH; });
+        }
+        return d.eol_match;
+    }
+
+private:
+    static constexpr size_t MAX_DFA_STATES = 4096;
+
+    struct DState {
+        vector<int> set;
+        bool match;
+        int eol_match;
+        int next[256];
+    };
+    const Nfa& nfa;
+    bool unanchored;
+    vector<DState> states;
+    map<vector<int>, int> ids;
+    int starts[2];
+    vector<char> mark;
+
+    void flush() {
+        states.clear();
+        ids.clear();
+        starts[0] = starts[1] = -1;
+    }
+    // 沿 ε 边收集状态；未满足的断言状态留在集合中，以便之后在行尾再展开
+    void closure(int s, bool bol, bool eol, vector<int>& out) {
+        mark.assign(nfa.st.size(), 0);
+        for (int i : out) mark[i] = 1;
+        vector<int> stack{s};
+        while (!stack.empty()) {
+            int i = stack.back();
+            stack.pop_back();
+            if (i < 0 || mark[i]) continue;
+            mark[i] = 1;
+            const Nfa::State& x = nfa.st[i];
+            switch (x.op) {
+                case Nfa::SPLIT: stack.push_back(x.out1); stack.push_back(x.out); break;
+                case Nfa::BOL: if (bol) stack.push_back(x.out); break;
+                case Nfa::EOL: if (eol) stack.push_back(x.out); else out.push_back(i); break;
+                default: out.push_back(i); break;
+            }
+        }
+    }
+    int intern(vector<int>& set) {
+        std::sort(set.begin(), set.end());
+        set.erase(std::unique(set.begin(), set.end()), set.end());
+        auto it = ids.find(set);
+        if (it != ids.end()) return it->second;
+        DState d;
+        d.set = set;
+        d.match = std::any_of(set.begin(), set.end(), [&](int i) { return nfa.st[i].op == Nfa::MATCH; });
+        d.eol_match = -1;
+        std::fill(std::begin(d.next), std::end(d.next), -1);
+        states.push_back(std::move(d));
+        ids.emplace(set, states.size() - 1);
+        return states.size() - 1;
+    }
+};
+
+// 从 s 开始的最长匹配终点，无匹配返回 -1；text[0, n) 以行首开始
+static int64_t regex_match_at(LazyDFA& dfa, const char* text, size_t n, size_t s) {
+    int st = dfa.start(s == 0 || text[s - 1] == '\n');
+    int64_t last = -1;
+    for (size_t p = s;; ++p) {
+        if (p == n || text[p] == '\n') {
+            if (dfa.match_eol(st)) last = p;
+            break;
+        }
+        if (dfa.match(st)) last = p;
+        st = dfa.next(st, text[p]);
+        if (dfa.dead(st)) break;
+    }
+    return last;
+}
+
+// 在 text[0, n)（由整行组成）中找出所有不重叠的非空最左最长匹配
+void regex_find_all(const Regex& re, const char* text, size_t n, uint64_t base,
+                    vector<uint64_t>& hits, vector<uint32_t>& lens) {
+    LazyDFA fwd(*re.fwd, false);
+    vector<uint64_t> cand;
+    if (!re.prefix.empty()) {
+        find_all(text, n, re.prefix.data(), re.prefix.size(), n, 0, cand);
+    } else {
+        // 反向扫描一遍，标出所有可能的匹配起点
+        LazyDFA rev(*re.rev, true);
+        int st = rev.start(true);
+        for (size_t i = n; i > 0;) {
+            unsigned char c = text[--i];
+            if (c == '\n') {
+                st = rev.start(true);
+                continue;
+            }
+            st = rev.next(st, c);
+            bool at_bol = i == 0 || text[i - 1] == '\n';
+            if (at_bol ? rev.match_eol(st) : rev.match(st)) cand.push_back(i);
+        }
+        std::reverse(cand.begin(), cand.end());
+    }
+    uint64_t last_end = 0;
+    for (uint64_t s : cand) {
+        if (s < last_end) continue;
+        int64_t e = regex_match_at(fwd, text, n, s);
+        if (e > (int64_t)s) {
+            hits.push_back(base + s);
+            lens.push_back(e - s);
+            last_end = e;
+        }
+    }
+}
+
+ThreadPool& worker_pool() {
+    static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+static bool write_all(int fd, const char* p, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+// 旁路缓存文件头；之后从 SIDECAR_DATA 处起依次是块表、位数组和尾部，与 LineIndex 的内存布局相同，便于直接映射
+struct IndexSidecar::Header {
+    char magic[8];
+    uint64_t dev, ino, size, mtime;
+    uint64_t path_hash, head_hash, tail_hash;
+    uint64_t nblocks, nwords, ntail;
+    uint64_t check;     // 以上字段的哈希，防止写了一半的文件头
+};
+
+static const char SIDECAR_MAGIC[8] = {'S', 'E', 'I', 'D', 'X', '0', '2', 0};
+const uint64_t SIDECAR_DATA = 4096;
+const uint64_t FINGERPRINT_SIZE = 64 << 10;
+
+static uint64_t fnv64(const void* p, size_t n, uint64_t h = 14695981039346656037ull) {
+    const unsigned char* s = (const unsigned char*)p;
+    for (size_t i = 0; i < n; ++i) h = (h ^ s[i]) * 1099511628211ull;
+    return h;
+}
+
+static uint64_t mtime_ns(const struct stat& st) {
+    return (uint64_t)st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec;
+}
+
+// 缓存文件路径；没有可用的缓存目录时返回空
+static string sidecar_path(const string& fname, uint64_t& path_hash) {
+    char* real = realpath(fname.c_str(), nullptr);
+    string abs = real ? real : fname;
+    free(real);
+    path_hash = fnv64(abs.data(), abs.size());
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    string dir;
+    if (xdg && *xdg) dir = xdg;
+    else if (home && *home) dir = string(home) + "/.cache";
+    else return "";
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.idx", (unsigned long long)path_hash);
+    return dir + "/seditor/" + name;
+}
+
+// 文件 [0, size) 首尾各一段的指纹
+static void fingerprints(const char* data, uint64_t size, uint64_t& head, uint64_t& tail) {
+    uint64_t n = std::min(size, FINGERPRINT_SIZE);
+    head = fnv64(data, n);
+    tail = fnv64(data + size - n, n);
+}
+
+static uint64_t sidecar_bytes(uint64_t nblocks, uint64_t nwords, uint64_t ntail) {
+    return SIDECAR_DATA + nblocks * sizeof(LineIndex::Block) + (nwords + ntail) * sizeof(uint64_t);
+}
+
+// 读出文件头并和当前文件核对，只读首尾两小段，与文件大小无关
+bool IndexSidecar::valid(int fd, const MappedFile& file, uint64_t path_hash, Header& h) {
+    struct stat fst, st;
+    if (pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) || memcmp(h.magic, SIDECAR_MAGIC, 8) != 0 ||
+        h.check != fnv64(&h, offsetof(Header, check)))
+        return false;
+    if (fstat(file.fd, &fst) != 0 || fstat(fd, &st) != 0) return false;
+    if (h.path_hash != path_hash || h.dev != (uint64_t)fst.st_dev || h.ino != (uint64_t)fst.st_ino) return false;
+    // 大小不变时 mtime 也必须不变；变长了则靠指纹确认旧的部分没动过
+    if (h.size == 0 || h.size > file.size || (h.size == file.size && h.mtime != mtime_ns(fst))) return false;
+    if (h.ntail >= LineIndex::BLOCK || (uint64_t)st.st_size < sidecar_bytes(h.nblocks, h.nwords, h.ntail))
+        return false;
+    uint64_t head, tail;
+    fingerprints(file.data, h.size, head, tail);
+    return head == h.head_hash && tail == h.tail_hash;
+}
+
+bool IndexSidecar::load(const string& fname, const MappedFile& file, LineIndex& idx, uint64_t& indexed) {
+    if (file.size < MIN_FILE_SIZE || file.fd < 0) return false;
+    uint64_t ph;
+    string path = sidecar_path(fname, ph);
+    if (path.empty()) return false;
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    Header h{};
+    bool ok = valid(fd, file, ph, h);
+    size_t len = sidecar_bytes(h.nblocks, h.nwords, h.ntail);
+    void* m = nullptr;
+    if (ok) {
+        m = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+        ok = m != MAP_FAILED;
+    }
+    ::close(fd);
+    if (!ok) return false;
+    const char* p = (const char*)m + SIDECAR_DATA;
+    idx.clear();
+    idx.mapping = shared_ptr<const void>(m, [len](const void* q) { munmap((void*)q, len); });
+    idx.mblocks = (const LineIndex::Block*)p;
+    idx.nmblocks = h.nblocks;
+    p += h.nblocks * sizeof(LineIndex::Block);
+    idx.mbits = (const uint64_t*)p;
+    idx.nmwords = h.nwords;
+    p += h.nwords * sizeof(uint64_t);
+    idx.tail.assign((const uint64_t*)p, (const uint64_t*)p + h.ntail);
+    indexed = h.size;
+    SE_LOG(INFO, "line index loaded from " + path + ": " + to_string(idx.count()) + " lines, " +
+                 to_string(file.size - h.size) + " bytes to extend");
+    return true;
+}
+
+shared_ptr<IndexSidecar> IndexSidecar::open(const string& fname, const MappedFile& file) {
+    if (file.size < MIN_FILE_SIZE || file.fd < 0) return nullptr;
+    auto sc = make_shared<IndexSidecar>();
+    sc->path = sidecar_path(fname, sc->path_hash);
+    if (sc->path.empty()) return nullptr;
+    struct stat fst;
+    if (fstat(file.fd, &fst) != 0) return nullptr;
+    sc->dev = fst.st_dev;
+    sc->ino = fst.st_ino;
+    sc->mtime = mtime_ns(fst);
+    sc->size = file.size;
+    fingerprints(file.data, file.size, sc->head_hash, sc->tail_hash);
+    return sc;
+}
+
+// 写到临时文件再改名，别的进程映射着的旧缓存不受影响；文件头最后写
+void IndexSidecar::finish(const LineIndex& idx) {
+    auto self = shared_from_this();
+    auto copy = make_shared<LineIndex>(idx);
+    worker_pool().submit([self, copy] {
+        const LineIndex& x = *copy;
+        string dir = self->path.substr(0, self->path.rfind('/'));
+        mkdir(dir.substr(0, dir.rfind('/')).c_str(), 0755);
+        mkdir(dir.c_str(), 0755);
+        string tmp = self->path + ".XXXXXX";
+        int fd = mkstemp(&tmp[0]);
+        bool ok = fd >= 0;
+        // 映射部分原样写出，自有部分的位偏移接在其后
+        vector<LineIndex::Block> own(x.blocks);
+        for (auto& b : own) b.packed += (x.nmwords * 64) << 7;
+        Header h{};
+        ok = ok && lseek(fd, SIDECAR_DATA, SEEK_SET) == (off_t)SIDECAR_DATA &&
+             write_all(fd, (const char*)x.mblocks, x.nmblocks * sizeof(LineIndex::Block)) &&
+             write_all(fd, (const char*)own.data(), own.size() * sizeof(LineIndex::Block)) &&
+             write_all(fd, (const char*)x.mbits, x.nmwords * sizeof(uint64_t)) &&
+             write_all(fd, (const char*)x.bits.data(), x.bits.size() * sizeof(uint64_t)) &&
+             write_all(fd, (const char*)x.tail.data(), x.tail.size() * sizeof(uint64_t));
+        memcpy(h.magic, SIDECAR_MAGIC, 8);
+        h.dev = self->dev;
+        h.ino = self->ino;
+        h.size = self->size;
+        h.mtime = self->mtime;
+        h.path_hash = self->path_hash;
+        h.head_hash = self->head_hash;
+        h.tail_hash = self->tail_hash;
+        h.nblocks = x.nmblocks + x.blocks.size();
+        h.nwords = x.nmwords + x.bits.size();
+        h.ntail = x.tail.size();
+        h.check = fnv64(&h, offsetof(Header, check));
+        ok = ok && pwrite(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) && rename(tmp.c_str(), self->path.c_str()) == 0;
+        int err = errno;
+        if (fd >= 0) ::close(fd);
+        if (ok) {
+            SE_LOG(INFO, "line index cached to " + self->path + ": " + to_string(x.count()) + " lines, " +
+                         to_string(sidecar_bytes(h.nblocks, h.nwords, h.ntail)) + " bytes");
+        } else {
+            if (fd >= 0) unlink(tmp.c_str());
+            SE_LOG(WARNING, "cannot write line index cache " + self->path + ": " + strerror(err));
+        }
+        std::lock_guard<std::mutex> lk(self->mu);
+        self->committed = ok;
+        self->done = true;
+        self->cv.notify_all();
+    });
+}
+
+bool IndexSidecar::wait() {
+    std::unique_lock<std::mutex> lk(mu);
+    cv.wait(lk, [this] { return done; });
+    return committed;
+}
+
+bool FileWatcher::start(const string& p, int fd) {
+    stop();
+    struct stat st;
+    if (fstat(fd, &st) != 0) return false;
+    ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ifd < 0) return false;
+    path = p;
+    file_fd = fd;
+    dev = st.st_dev;
+    ino = st.st_ino;
+    moved = false;
+    size_t slash = p.rfind('/');
+    string dir = slash == string::npos ? "." : slash == 0 ? "/" : p.substr(0, slash);
+    name = slash == string::npos ? p : p.substr(slash + 1);
+    file_wd = inotify_add_watch(ifd, p.c_str(), IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    dir_wd = inotify_add_watch(ifd, dir.c_str(), IN_CREATE | IN_MOVED_TO);
+    if (file_wd < 0) {
+        SE_LOG(WARNING, "inotify_add_watch failed: " + p + ": " + strerror(errno));
+        stop();
+        return false;
+    }
+    return true;
+}
+
+void FileWatcher::stop() {
+    if (ifd >= 0) ::close(ifd);
+    ifd = file_wd = dir_wd = file_fd = -1;
+}
+
+FileWatcher::Change FileWatcher::check(uint64_t size, uint64_t& new_size) {
+    new_size = size;
+    if (ifd < 0) return NONE;
+    alignas(struct inotify_event) char buf[4096];
+    ssize_t n;
+    while ((n = read(ifd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + n; ) {
+            auto* ev = (struct inotify_event*)p;
+            if (ev->wd == file_wd && (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF))) moved = true;
+            if (ev->wd == dir_wd && ev->len && name == ev->name) moved = true;
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    struct stat st;
+    if (fstat(file_fd, &st) != 0) return NONE;
+    new_size = st.st_size;
+    if (new_size < size) return TRUNCATED;
+    if (new_size > size) return GREW;
+    // 旧文件的追加都读完了，再切到同名的新文件
+    if (moved && stat(path.c_str(), &st) == 0 && ((uint64_t)st.st_dev != dev || (uint64_t)st.st_ino != ino))
+        return ROTATED;
+    return NONE;
+}
+
+shared_ptr<IndexJob> start_index_job(const char* data, uint64_t from, uint64_t size,
+                                     shared_ptr<IndexSidecar> sidecar) {
+    auto job = make_shared<IndexJob>();
+    job->sidecar = std::move(sidecar);
+    for (uint64_t b = from; b < size; b += INDEX_CHUNK) job->bounds.push_back(b);
+    job->bounds.push_back(size);
+    size_t n = job->bounds.size() - 1;
+    job->results.resize(n);
+    job->done.assign(n, 0);
+    job->pending = n;
+    for (size_t i = 0; i < n; ++i) {
+        worker_pool().submit([job, data, i] {
+            // 分小段扫描后立即压缩，临时数组不随块大小增长
+            LineIndex idx;
+            vector<uint64_t> nl;
+            uint64_t a = job->bounds[i], b = job->bounds[i + 1];
+            for (uint64_t p = a; p < b && !job->cancel; p += FIRST_INDEX_CHUNK) {
+                nl.clear();
+                scan_newlines(data + p, std::min(FIRST_INDEX_CHUNK, b - p), p, nl);
+                idx.append(nl);
+            }
+            std::lock_guard<std::mutex> lk(job->mu);
+            job->results[i] = std::move(idx);
+            job->done[i] = 1;
+            if (--job->pending == 0) job->cv.notify_all();
+        });
+    }
+    return job;
+}
+
+bool publish_index(IndexJob& job, PieceTable& buf, bool wait) {
+    std::unique_lock<std::mutex> lk(job.mu);
+    if (wait) job.cv.wait(lk, [&] { return job.pending == 0; });
+    size_t n = job.done.size();
+    while (job.next < n && job.done[job.next]) {
+        size_t i = job.next++;
+        buf.append_original(job.results[i], job.bounds[i + 1]);
+        job.results[i].clear();
+    }
+    if (job.next == n && !job.cancel) {
+        buf.shrink_original_index();
+        if (job.sidecar) job.sidecar->finish(buf.original_index());
+        job.sidecar.reset();
+    }
+    return job.next == n;
+}
+
+void cancel_index(IndexJob& job) {
+    job.cancel = true;
+    std::unique_lock<std::mutex> lk(job.mu);
+    job.cv.wait(lk, [&] { return job.pending == 0; });
+}
+
+bool DiskIdentity::from_path(const string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return false;
+    *this = DiskIdentity{(uint64_t)st.st_dev, (uint64_t)st.st_ino, (uint64_t)st.st_size, mtime_ns(st)};
+    return true;
+}
+
+bool DiskIdentity::from_fd(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return false;
+    *this = DiskIdentity{(uint64_t)st.st_dev, (uint64_t)st.st_ino, (uint64_t)st.st_size, mtime_ns(st)};
+    return true;
+}
+
+namespace {
+
+// XXH64：每轮 32 字节四路乘加，比 fnv64 逐字节快一个数量级，块哈希的耗时接近读内存
+const uint64_t XXH_P1 = 11400714785074694791ull, XXH_P2 = 14029467366897019727ull,
+               XXH_P3 = 1609587929392839161ull, XXH_P4 = 9650029242287828579ull,
+               XXH_P5 = 2870177450012600261ull;
+
+inline uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+inline uint64_t load64(const char* p) { uint64_t v; memcpy(&v, p, 8); return v; }
+inline uint64_t load32(const char* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+inline uint64_t xxh_round(uint64_t acc, uint64_t in) { return rotl64(acc + in * XXH_P2, 31) * XXH_P1; }
+inline uint64_t xxh_merge(uint64_t h, uint64_t v) { return (h ^ xxh_round(0, v)) * XXH_P1 + XXH_P4; }
+
+uint64_t xxh64(const char* p, size_t n) {
+    const char* end = p + n;
+    uint64_t h;
+    if (n >= 32) {
+        uint64_t v1 = XXH_P1 + XXH_P2, v2 = XXH_P2, v3 = 0, v4 = -XXH_P1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = xxh_round(v1, load64(p));
+            v2 = xxh_round(v2, load64(p + 8));
+            v3 = xxh_round(v3, load64(p + 16));
+            v4 = xxh_round(v4, load64(p + 24));
+        }
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge(xxh_merge(xxh_merge(xxh_merge(h, v1), v2), v3), v4);
+    } else {
+        h = XXH_P5;
+    }
+    h += n;
+    for (; p + 8 <= end; p += 8) h = rotl64(h ^ xxh_round(0, load64(p)), 27) * XXH_P1 + XXH_P4;
+    if (p + 4 <= end) {
+        h = rotl64(h ^ load32(p) * XXH_P1, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; ++p) h = rotl64(h ^ (unsigned char)*p * XXH_P5, 11) * XXH_P1;
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    return h ^ (h >> 32);
+}
+
+const uint64_t HASH_TASK_BLOCKS = 256;      // 每个任务 16 MB
+
+// 新旧文件的块哈希比出不同之处。old_data 非空表示旧映射仍是旧内容，用它逐字节收窄
+vector<FileChange> diff_blocks(const vector<uint64_t>& base, uint64_t old_size, const vector<uint64_t>& cur,
+                               const char* old_data, const char* data, uint64_t size) {
+    vector<FileChange> out;
+    if (old_size == size) {
+        for (size_t i = 0; i < cur.size(); ) {
+            if (base[i] == cur[i]) {
+                ++i;
+                continue;
+            }
+            size_t j = i;
+            while (j < cur.size() && base[j] != cur[j]) ++j;
+            uint64_t a = i * CHANGE_BLOCK, b = std::min(j * CHANGE_BLOCK, size);
+            if (old_data) {
+                while (a < b && old_data[a] == data[a]) ++a;
+                while (b > a && old_data[b - 1] == data[b - 1]) --b;
+            }
+            if (a < b) out.push_back(FileChange{a, b, a, b});
+            i = j;
+        }
+        return out;
+    }
+    // 长度变了：前面相同的整块，加上尾部相同的部分之外算作一处不同
+    uint64_t limit = std::min(old_size, size), pre = 0;
+    for (size_t i = 0; (i + 1) * CHANGE_BLOCK <= limit && base[i] == cur[i]; ++i) pre = (i + 1) * CHANGE_BLOCK;
+    // 旧文件最后不满一块：新文件的同一段哈希相同就说明只是在后面追加了
+    if (old_size < size && old_size - pre < CHANGE_BLOCK && base.size() * CHANGE_BLOCK > pre &&
+        xxh64(data + pre, old_size - pre) == base[pre / CHANGE_BLOCK])
+        pre = old_size;
+    uint64_t suf = 0;
+    if (old_data) {
+        while (pre < limit && old_data[pre] == data[pre]) ++pre;
+        while (suf < limit - pre) {
+            uint64_t n = std::min(CHANGE_BLOCK, limit - pre - suf);
+            if (memcmp(old_data + old_size - suf - n, data + size - suf - n, n) != 0) {
+                while (suf < limit - pre && old_data[old_size - suf - 1] == data[size - suf - 1]) ++suf;
+                break;
+            }
+            suf += n;
+        }
+    }
+    out.push_back(FileChange{pre, old_size - suf, pre, size - suf});
+    return out;
+}
+
+} // namespace
+
+shared_ptr<BlockHashJob> start_block_hash(const char* data, uint64_t size,
+                                          std::function<void(const BlockHashJob&)> then) {
+    auto job = make_shared<BlockHashJob>();
+    job->then = std::move(then);
+    size_t nblocks = (size + CHANGE_BLOCK - 1) / CHANGE_BLOCK;
+    job->hashes.resize(nblocks);
+    size_t ntasks = (nblocks + HASH_TASK_BLOCKS - 1) / HASH_TASK_BLOCKS;
+    if (ntasks == 0) {
+        job->done = true;
+        std::function<void(const BlockHashJob&)> then;
+        then.swap(job->then);
+        if (then) then(*job);
+        return job;
+    }
+    job->pending = ntasks;
+    for (size_t t = 0; t < ntasks; ++t) {
+        worker_pool().submit([job, data, size, nblocks, t] {
+            for (size_t i = t * HASH_TASK_BLOCKS; i < std::min(nblocks, (t + 1) * HASH_TASK_BLOCKS) && !job->cancel; ++i) {
+                uint64_t a = i * CHANGE_BLOCK;
+                job->hashes[i] = xxh64(data + a, std::min(CHANGE_BLOCK, size - a));
+            }
+            std::function<void(const BlockHashJob&)> then;
+            {
+                std::lock_guard<std::mutex> lk(job->mu);
+                if (--job->pending > 0) return;
+                job->done = !job->cancel;
+                then.swap(job->then);
+            }
+            job->cv.notify_all();
+            if (then) then(*job);
+        });
+    }
+    return job;
+}
+
+void cancel_block_hash(BlockHashJob& job) {
+    job.cancel = true;
+    std::unique_lock<std::mutex> lk(job.mu);
+    job.cv.wait(lk, [&] { return job.pending == 0; });
+}
+
+shared_ptr<ReloadJob> start_reload(const string& path, const MappedFile& old, const LineIndex& old_idx,
+                                   shared_ptr<BlockHashJob> base) {
+    auto job = make_shared<ReloadJob>();
+    auto finish = [](ReloadJob& job) {
+        std::lock_guard<std::mutex> lk(job.mu);
+        job.done = true;
+        job.cv.notify_all();
+    };
+    DiskIdentity was;
+    job->file.reserve = old.reserve;
+    if (!job->file.open(path) || !job->disk.from_fd(job->file.fd) || !was.from_fd(old.fd)) {
+        job->err = strerror(errno);
+        finish(*job);
+        return job;
+    }
+    // 换了 inode：旧映射由 old.fd 撑着，内容还是打开时的
+    const char* old_data = was.dev != job->disk.dev || was.ino != job->disk.ino ? old.data : nullptr;
+    uint64_t old_size = old.size;
+    // 回调持有 job，最后一段哈希算完调用之后释放
+    job->hashes = start_block_hash(job->file.data, job->file.size,
+                                   [job, finish, old_data, old_size, &old_idx, base](const BlockHashJob& h) {
+        ReloadJob& self = *job;
+        if (self.cancel || !h.done) {
+            finish(self);
+            return;
+        }
+        const char* data = self.file.data;
+        uint64_t size = self.file.size;
+        self.changes = diff_blocks(base->hashes, old_size, h.hashes, old_data, data, size);
+        // 相同部分的换行直接从旧索引平移，只扫描不同之处
+        vector<uint64_t> nl;
+        uint64_t o = 0, n = 0;
+        auto copy_old = [&](uint64_t a, uint64_t b, uint64_t to) {
+            for (size_t k = old_idx.rank(a), e = old_idx.rank(b); k < e; ++k) self.idx.push(old_idx.select(k) - a + to);
+        };
+        for (const FileChange& c : self.changes) {
+            copy_old(o, c.old_start, n);
+            for (uint64_t p = c.new_start; p < c.new_end && !self.cancel; p += FIRST_INDEX_CHUNK) {
+                nl.clear();
+                scan_newlines(data + p, std::min(FIRST_INDEX_CHUNK, c.new_end - p), p, nl);
+                self.idx.append(nl);
+            }
+            self.rescanned += c.new_end - c.new_start;
+            o = c.old_end;
+            n = c.new_end;
+        }
+        copy_old(o, old_size, n);
+        self.idx.shrink();
+        finish(self);
+    });
+    return job;
+}
+
+void cancel_reload(ReloadJob& job) {
+    job.cancel = true;
+    if (job.hashes) job.hashes->cancel = true;
+    std::unique_lock<std::mutex> lk(job.mu);
+    job.cv.wait(lk, [&] { return job.done.load(); });
+}
+
+bool open_document(const string& fname, MappedFile& file, PieceTable& buf, uint64_t& indexed,
+                   bool use_sidecar) {
+    if (!file.open(fname)) {
+        buf.reset(nullptr, 0, LineIndex());
+        indexed = 0;
+        return false;
+    }
+    LineIndex idx;
+    if (!use_sidecar || !IndexSidecar::load(fname, file, idx, indexed)) {
+        // 先同步索引首屏所需的一小段，其余交给后台线程
+        indexed = std::min<uint64_t>(file.size, FIRST_INDEX_CHUNK);
+        vector<uint64_t> nl;
+        scan_newlines(file.data, indexed, 0, nl);
+        idx.append(nl);
+    }
+    buf.reset(file.data, indexed, std::move(idx));
+    if (indexed < file.size) madvise((void*)file.data, file.size, MADV_SEQUENTIAL);
+    return true;
+}
+
+// 把 in 的 [off, off+len) 追加到 out：优先 copy_file_range，其次 sendfile，最后 pread/write
+static bool copy_range(int in, uint64_t off, int out, uint64_t len) {
+    while (len > 0) {
+        loff_t o = off;
+        ssize_t n = copy_file_range(in, &o, out, nullptr, len, 0);
+        if (n <= 0) break;
+        off += n;
+        len -= n;
+    }
+    while (len > 0) {
+        off_t o = off;
+        ssize_t n = sendfile(out, in, &o, len);
+        if (n <= 0) break;
+        off += n;
+        len -= n;
+    }
+    // --batch 会在多个线程里同时保存，缓冲区不能共享
+    vector<char> tmp(len > 0 ? std::min<uint64_t>(len, 1 << 16) : 0);
+    while (len > 0) {
+        ssize_t n = pread(in, tmp.data(), std::min<uint64_t>(len, tmp.size()), off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || !write_all(out, tmp.data(), n)) return false;
+        off += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool fsync_parent_dir(const string &fname) {
+    size_t slash = fname.find_last_of('/');
+    string dir = slash == string::npos ? "." : fname.substr(0, slash + 1);
+    int dfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dfd < 0) return false;
+    bool ok = fsync(dfd) == 0;
+    ::close(dfd);
+    return ok;
+}
+
+const size_t SAVE_BUF_SIZE = 1 << 20;
+
+bool save_document(const PieceTable& buf, int orig_fd, const string& fname, string& err) {
+    // 原文件仍被映射着，且写到一半崩溃不能毁掉原文件，所以不原地覆盖
+    // 经过符号链接保存时替换的是它指向的文件，否则改名会把链接换成普通文件
+    string target = fname;
+    if (char* real = realpath(fname.c_str(), nullptr)) {
+        target = real;
+        free(real);
+    }
+    string tmp = target + ".XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0) {
+        err = strerror(errno);
+        SE_LOG(ERROR, "save_file: mkstemp failed for " + fname);
+        return false;
+    }
+    struct stat st;
+    if (stat(target.c_str(), &st) == 0) {
+        // 只有 root 能改属主，普通用户至少保留属组；chown 会清掉 setuid 位，所以先于 fchmod
+        if (fchown(fd, st.st_uid, st.st_gid) != 0 && fchown(fd, -1, st.st_gid) != 0)
+            SE_LOG(WARNING, "save_file: cannot keep the owner of " + fname);
+        fchmod(fd, st.st_mode & 07777);
+    } else {
+        // umask 只能先改再改回来才读得到，批处理时多个线程同时保存，只读一次
+        static const mode_t mask = [] {
+            mode_t m = umask(0);
+            umask(m);
+            return m;
+        }();
+        fchmod(fd, 0666 & ~mask);
+    }
+
+    // 原文件中未改动的片段在内核里直接复制，只有编辑过的内容从内存写出
+    bool ok = true;
+    string pending;
+    auto flush = [&] {
+        ok = ok && write_all(fd, pending.data(), pending.size());
+        pending.clear();
+    };
+    buf.for_each_piece([&](const PieceTable::Piece& p, const char* data) {
+        if (!ok) return;
+        if (p.buf == 0 && orig_fd >= 0) {
+            flush();
+            ok = ok && copy_range(orig_fd, p.start, fd, p.len);
+        } else if (p.len >= SAVE_BUF_SIZE) {
+            flush();
+            ok = ok && write_all(fd, data, p.len);
+        } else {
+            if (pending.size() + p.len > SAVE_BUF_SIZE) flush();
+            pending.append(data, p.len);
+        }
+    });
+    flush();
+    ok = ok && fsync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), target.c_str()) != 0) {
+        err = strerror(errno);
+        unlink(tmp.c_str());
+        SE_LOG(ERROR, "save_file: failed to write " + fname);
+        return false;
+    }
+    // 改名要等目录项落盘才持久，目录同步失败就不能报告保存成功
+    if (!fsync_parent_dir(target)) {
+        err = strerror(errno);
+        SE_LOG(ERROR, "save_file: cannot sync the directory of " + fname);
+        return false;
+    }
+    stats().io_write_bytes += buf.length();
+    return true;
+}
+
+// 编辑日志文件头；之后是一串帧：FRAME_MAGIC、0、载荷长度、载荷、载荷的哈希
+struct EditJournal::Header {
+    char magic[8];
+    uint64_t dev, ino, size, mtime;     // 作为起点的磁盘文件，不存在时全为 0
+    uint64_t head_hash, tail_hash;
+    uint64_t check;
+};
+
+static const char JOURNAL_MAGIC[8] = {'S', 'E', 'J', 'R', 'N', 'L', '1', 0};
+const uint32_t FRAME_MAGIC = 0x4d524653;
+const size_t FRAME_HEAD = 16, RECORD_HEAD = 17;
+
+// 磁盘上 fname 的身份，只读首尾两小段
+static void identify(const string& fname, EditJournal::Header& h) {
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, JOURNAL_MAGIC, 8);
+    int fd = ::open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        h.dev = st.st_dev;
+        h.ino = st.st_ino;
+        h.size = st.st_size;
+        h.mtime = mtime_ns(st);
+        uint64_t n = std::min(h.size, FINGERPRINT_SIZE);
+        string buf(n, '\0');
+        if (pread(fd, &buf[0], n, 0) == (ssize_t)n) h.head_hash = fnv64(buf.data(), n);
+        if (pread(fd, &buf[0], n, h.size - n) == (ssize_t)n) h.tail_hash = fnv64(buf.data(), n);
+    }
+    if (fd >= 0) ::close(fd);
+    h.check = fnv64(&h, offsetof(EditJournal::Header, check));
+}
+
+// 记录：类型、位置、长度，'O' 再跟原文件偏移，'I' 再跟文字；'Z' 清空文档
+static void put_record(string& out, char type, uint64_t pos, uint64_t n, uint64_t start, const char* data) {
+    char head[RECORD_HEAD + 8];
+    head[0] = type;
+    memcpy(head + 1, &pos, 8);
+    memcpy(head + 9, &n, 8);
+    memcpy(head + RECORD_HEAD, &start, 8);
+    out.append(head, RECORD_HEAD + (type == 'O' ? 8 : 0));
+    if (type == 'I') out.append(data, n);
+}
+
+static bool write_frame(int fd, const string& payload) {
+    char head[FRAME_HEAD] = {};
+    uint64_t len = payload.size(), hash = fnv64(payload.data(), len);
+    memcpy(head, &FRAME_MAGIC, 4);
+    memcpy(head + 8, &len, 8);
+    return write_all(fd, head, FRAME_HEAD) && write_all(fd, payload.data(), len) &&
+           write_all(fd, (const char*)&hash, 8);
+}
+
+string EditJournal::path_for(const string& fname) {
+    size_t slash = fname.find_last_of('/');
+    string dir = slash == string::npos ? "" : fname.substr(0, slash + 1);
+    string name = slash == string::npos ? fname : fname.substr(slash + 1);
+    return dir + "." + name + ".swp";
+}
+
+int EditJournal::probe(const string& fname) {
+    int fd = ::open(path_for(fname).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    Header h, cur;
+    bool ok = pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h);
+    ::close(fd);
+    identify(fname, cur);
+    return ok && memcmp(&h, &cur, sizeof(h)) == 0 ? 1 : -1;
+}
+
+EditJournal::~EditJournal() {
+    {
+        std::lock_guard<std::mutex> lk(mu);
+        stopping = true;
+    }
+    cv.notify_all();
+    worker.join();
+    if (fd >= 0) ::close(fd);
+}
+
+void EditJournal::start(const string& fname, bool orig) {
+    Header h;
+    identify(fname, h);
+    std::lock_guard<std::mutex> lk(mu);
+    pending.clear();
+    snapshot.clear();
+    has_snapshot = false;
+    path = path_for(fname);
+    base_dev = h.dev;
+    base_ino = h.ino;
+    base_size = h.size;
+    base_mtime = h.mtime;
+    base_head = h.head_hash;
+    base_tail = h.tail_hash;
+    orig_on_disk = orig;
+    on = true;
+    written = 0;
+    next_check = COMPACT_BYTES;
+    ++gen;
+}
+
+void EditJournal::discard() {
+    string old;
+    {
+        std::lock_guard<std::mutex> lk(mu);
+        pending.clear();
+        snapshot.clear();
+        has_snapshot = false;
+        on = false;
+        old.swap(path);
+        ++gen;
+    }
+    // 等正在进行的写入结束；之后写线程看到代数变了，不会再碰这个文件
+    std::lock_guard<std::mutex> io(io_mu);
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+    if (!old.empty()) unlink(old.c_str());
+}
+
+void EditJournal::append(char type, uint64_t pos, uint64_t n, uint64_t start, const char* data) {
+    std::lock_guard<std::mutex> lk(mu);
+    if (!on) return;
+    bool first = pending.empty();
+    put_record(pending, type, pos, n, start, data);
+    if (first || pending.size() >= FLUSH_BYTES) cv.notify_one();
+}
+
+void EditJournal::record_insert(uint64_t pos, const char* s, uint64_t n) { append('I', pos, n, 0, s); }
+void EditJournal::record_erase(uint64_t pos, uint64_t n) { append('E', pos, n, 0, nullptr); }
+void EditJournal::record_original(uint64_t pos, uint64_t start, uint64_t len, const char* data) {
+    if (orig_on_disk) append('O', pos, len, start, nullptr);
+    else append('I', pos, len, 0, data);
+}
+
+bool EditJournal::wants_compaction() {
+    if (written < next_check) return false;
+    next_check = written * 2;
+    return true;
+}
+
+void EditJournal::replace(string snap) {
+    std::lock_guard<std::mutex> lk(mu);
+    if (!on) return;
+    pending.clear();    // 快照已包含这些修改
+    snapshot = std::move(snap);
+    has_snapshot = true;
+    cv.notify_one();
+}
+
+void EditJournal::sync() {
+    std::unique_lock<std::mutex> lk(mu);
+    uint64_t t = ++requested;
+    cv.notify_one();
+    flushed.wait(lk, [&] { return committed >= t; });
+}
+
+void EditJournal::run() {
+    std::unique_lock<std::mutex> lk(mu);
+    while (1) {
+        cv.wait(lk, [this] { return stopping || !pending.empty() || has_snapshot || requested > committed; });
+        if (stopping && pending.empty() && !has_snapshot) break;
+        // 组提交：第一条记录到达后最多再等 FLUSH_MS，期间的修改一起写、一起 fdatasync
+        cv.wait_for(lk, chrono::milliseconds(FLUSH_MS), [this] {
+            return stopping || has_snapshot || requested > committed || pending.size() >= FLUSH_BYTES;
+        });
+        string batch, snap;
+        batch.swap(pending);
+        snap.swap(snapshot);
+        bool replace_all = has_snapshot;
+        has_snapshot = false;
+        uint64_t g = gen, ticket = requested;
+        string p = path;
+        Header h;
+        memcpy(h.magic, JOURNAL_MAGIC, 8);
+        h.dev = base_dev;
+        h.ino = base_ino;
+        h.size = base_size;
+        h.mtime = base_mtime;
+        h.head_hash = base_head;
+        h.tail_hash = base_tail;
+        h.check = fnv64(&h, offsetof(Header, check));
+        lk.unlock();
+        {
+            std::lock_guard<std::mutex> io(io_mu);
+            bool ok = true;
+            if (g != gen || p.empty()) {
+                // discard 或 start 之后提交的旧批次，丢掉
+            } else if (replace_all) {
+                string tmp = p + ".XXXXXX";
+                int nfd = mkstemp(&tmp[0]);
+                ok = nfd >= 0 && write_all(nfd, (const char*)&h, sizeof(h)) && write_frame(nfd, snap) &&
+                     (batch.empty() || write_frame(nfd, batch)) && fdatasync(nfd) == 0 &&
+                     rename(tmp.c_str(), p.c_str()) == 0;
+                if (ok) {
+                    if (fd >= 0) ::close(fd);
+                    fd = nfd;
+                    fd_gen = g;
+                    fsync_parent_dir(p);
+                    written = sizeof(h) + snap.size() + batch.size() + 2 * (FRAME_HEAD + 8);
+                } else if (nfd >= 0) {
+                    ::close(nfd);
+                    unlink(tmp.c_str());
+                }
+            } else if (!batch.empty()) {
+                if (fd < 0 || fd_gen != g) {
+                    if (fd >= 0) ::close(fd);
+                    fd = ::open(p.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+                    fd_gen = g;
+                    ok = fd >= 0 && write_all(fd, (const char*)&h, sizeof(h));
+                    if (ok) fsync_parent_dir(p);
+                    written = sizeof(h);
+                }
+                ok = ok && fd >= 0 && write_frame(fd, batch) && fdatasync(fd) == 0;
+                written += batch.size() + FRAME_HEAD + 8;
+            }
+            if (!ok) SE_LOG(WARNING, "edit journal write failed: " + p + ": " + strerror(errno));
+            stats().io_write_bytes += batch.size() + snap.size();
+        }
+        lk.lock();
+        committed = std::max(committed, ticket);
+        flushed.notify_all();
+    }
+}
+
+long replay_journal(const string& fname, PieceTable& buf, string& err) {
+    string path = EditJournal::path_for(fname);
+    MappedFile j;
+    if (!j.open(path)) {
+        err = strerror(errno);
+        return -1;
+    }
+    EditJournal::Header h, cur;
+    identify(fname, cur);
+    if (j.size < sizeof(h) || memcmp(j.data, &cur, sizeof(h)) != 0) {
+        err = "journal does not match " + fname;
+        return -1;
+    }
+    EditJournal* journal = buf.journal;
+    buf.journal = nullptr;
+    long ops = 0;
+    const char* p = j.data + sizeof(h);
+    const char* end = j.data + j.size;
+    // 写了一半的帧（长度不够或哈希不对）说明崩溃发生在写入途中，到此为止
+    while ((uint64_t)(end - p) >= FRAME_HEAD + 8 && err.empty()) {
+        uint32_t magic;
+        uint64_t len, hash;
+        memcpy(&magic, p, 4);
+        memcpy(&len, p + 8, 8);
+        if (magic != FRAME_MAGIC || len > (uint64_t)(end - p) - FRAME_HEAD - 8) break;
+        const char* q = p + FRAME_HEAD;
+        const char* qe = q + len;
+        memcpy(&hash, qe, 8);
+        if (fnv64(q, len) != hash) break;
+        while (q < qe) {
+            if ((uint64_t)(qe - q) < RECORD_HEAD) { err = "truncated record"; break; }
+            char type = q[0];
+            uint64_t pos, n, start = 0;
+            memcpy(&pos, q + 1, 8);
+            memcpy(&n, q + 9, 8);
+            q += RECORD_HEAD;
+            bool ok = type == 'Z' || pos <= buf.length();
+            if (type == 'I') {
+                ok = ok && n <= (uint64_t)(qe - q);
+                if (ok) buf.insert(pos, q, n);
+                q += ok ? n : 0;
+            } else if (type == 'E') {
+                ok = ok && n <= buf.length() - pos;
+                if (ok) buf.erase(pos, n);
+            } else if (type == 'O') {
+                ok = ok && (uint64_t)(qe - q) >= 8;
+                if (ok) memcpy(&start, q, 8);
+                q += 8;
+                ok = ok && start <= buf.original_size() && n <= buf.original_size() - start;
+                if (ok) buf.insert_original(pos, start, n);
+            } else if (type == 'Z') {
+                buf.erase(0, buf.length());
+            } else {
+                ok = false;
+            }
+            if (!ok) {
+                err = "bad record " + to_string(ops);
+                break;
+            }
+            ops++;
+        }
+        p = qe + 8;
+    }
+    buf.journal = journal;
+    SE_LOG(INFO, "replayed " + to_string(ops) + " journal records from " + path + (err.empty() ? "" : ": " + err));
+    return ops;
+}
+
+void compact_journal(EditJournal& journal, const PieceTable& buf, bool force) {
+    if (!journal.active() || !(journal.wants_compaction() || force)) return;
+    // 快照：清空后按片段重建；原文件的片段只记引用，追加块里的文字整段写出
+    bool refs = journal.orig_refs();
+    uint64_t bytes = RECORD_HEAD;
+    buf.for_each_piece([&](const PieceTable::Piece& p, const char*) {
+        bytes += RECORD_HEAD + 8 + (p.buf != 0 || !refs ? p.len : 0);
+    });
+    if (!force && bytes > journal.size() / 2) return;
+    string snap;
+    snap.reserve(bytes);
+    put_record(snap, 'Z', 0, 0, 0, nullptr);
+    uint64_t pos = 0;
+    buf.for_each_piece([&](const PieceTable::Piece& p, const char* data) {
+        if (p.buf == 0 && refs) put_record(snap, 'O', pos, p.len, p.start, nullptr);
+        else put_record(snap, 'I', pos, p.len, 0, data);
+        pos += p.len;
+    });
+    SE_LOG(INFO, "compacting edit journal: " + to_string(journal.size()) + " -> " + to_string(snap.size()) + " bytes");
+    journal.replace(std::move(snap));
+}
+
+// 以连续内存的形式访问文档 [a, e)：落在单个片段内时零拷贝，否则拼接
+template <class F>
+static void with_contiguous(const vector<PieceTable::Segment>& segs, uint64_t a, uint64_t e, F fn) {
+    auto it = upper_bound(segs.begin(), segs.end(), a,
+                          [](uint64_t off, const PieceTable::Segment& s) { return off < s.off; }) - 1;
+    if (it->off + it->len >= e) {
+        fn(it->data + (a - it->off), (size_t)(e - a));
+        return;
+    }
+    string tmp;
+    tmp.reserve(e - a);
+    for (; it != segs.end() && it->off < e; ++it) {
+        uint64_t s = std::max(a, it->off), t = std::min(e, it->off + it->len);
+        tmp.append(it->data + (s - it->off), t - s);
+    }
+    fn(tmp.data(), tmp.size());
+}
+
+// 在文档 [a, b) 中查找起点落在其中的命中；正则模式下块边界对齐到行首
+static void search_chunk(const SearchJob& job, uint64_t a, uint64_t b,
+                         vector<uint64_t>& out, vector<uint32_t>& lens) {
+    if (job.re) {
+        with_contiguous(job.segs, a, b, [&](const char* p, size_t n) {
+            regex_find_all(*job.re, p, n, a, out, lens);
+        });
+        return;
+    }
+    size_t m = job.word.size();
+    uint64_t e = std::min(job.total, b + m - 1);
+    if (e < a + m) return;
+    with_contiguous(job.segs, a, e, [&](const char* p, size_t n) {
+        find_all(p, n, job.word.data(), m, b - a, a, out);
+    });
+}
+
+shared_ptr<SearchJob> start_search(const PieceTable& buf, const string& word, bool regex, string& err) {
+    auto job = make_shared<SearchJob>();
+    job->word = word;
+    if (regex) {
+        job->re = make_shared<Regex>();
+        if (!job->re->compile(word, err)) return nullptr;
+    }
+    job->version = buf.version();
+    job->segs = buf.segments();
+    job->total = buf.length();
+    job->density->total = job->total;
+    for (uint64_t b = 0; b < job->total; b += SEARCH_CHUNK) {
+        // 正则匹配不跨行，块边界挪到下一行行首，块内总是完整的行
+        if (job->re && b > 0) b = buf.line_start(buf.line_of(b - 1) + 1);
+        if (job->bounds.empty() || b > job->bounds.back()) job->bounds.push_back(b);
+    }
+    if (job->bounds.empty() || job->bounds.back() < job->total) job->bounds.push_back(job->total);
+    size_t n = job->bounds.size() - 1;
+    job->hits.resize(n);
+    job->lens.resize(n);
+    job->done.assign(n, 0);
+    job->pending = n;
+    for (size_t i = 0; i < n; ++i) {
+        worker_pool().submit([job, i] {
+            vector<uint64_t> hits;
+            vector<uint32_t> lens;
+            uint64_t a = job->bounds[i], b = job->bounds[i + 1];
+            if (!job->cancel) search_chunk(*job, a, b, hits, lens);
+            // 命中升序，同一桶的连续命中合成一次原子加
+            HitDensity& d = *job->density;
+            for (size_t k = 0, e; k < hits.size(); k = e) {
+                size_t bk = d.bucket(hits[k]);
+                for (e = k + 1; e < hits.size() && d.bucket(hits[e]) == bk; ++e) {}
+                d.count[bk].fetch_add(e - k, std::memory_order_relaxed);
+            }
+            job->scanned += b - a;
+            std::lock_guard<std::mutex> lk(job->mu);
+            job->hits[i] = std::move(hits);
+            job->lens[i] = std::move(lens);
+            job->done[i] = 1;
+            if (--job->pending == 0) job->cv.notify_all();
+        });
+    }
+    return job;
+}
+
+bool collect_search(SearchJob& job, vector<uint64_t>& hits, vector<uint32_t>& lens) {
+    size_t m = job.word.size();
+    std::lock_guard<std::mutex> lk(job.mu);
+    while (job.next < job.done.size() && job.done[job.next]) {
+        if (job.re) {
+            auto& h = job.hits[job.next];
+            auto& l = job.lens[job.next];
+            hits.insert(hits.end(), h.begin(), h.end());
+            lens.insert(lens.end(), l.begin(), l.end());
+            vector<uint32_t>().swap(l);
+        } else {
+            for (uint64_t h : job.hits[job.next])
+                if (hits.empty() || h >= hits.back() + m)
+                    hits.push_back(h);
+        }
+        vector<uint64_t>().swap(job.hits[job.next]);
+        job.next++;
+    }
+    return job.next == job.done.size();
+}
+
+// ---- JSON 结构索引 ----
+
+static const uint64_t JSON_CHUNK = 8 << 20;
+
+namespace {
+
+// 跨 64 字节块传递的状态：in_string 为全 1 或全 0，escaped 的最低位表示下一块首字节被转义
+struct JsonScan {
+    uint64_t in_string = 0;
+    uint64_t escaped = 0;
+};
+
+// 一块 64 字节里反斜杠、引号和括号的位置，第 i 位对应第 i 字节
+struct JsonMasks {
+    uint64_t backslash = 0, quote = 0, bracket = 0;
+};
+
+void json_masks_scalar(const char* p, JsonMasks& m) {
+    m = JsonMasks();
+    for (int i = 0; i < 64; ++i) {
+        char c = p[i];
+        uint64_t bit = 1ull << i;
+        if (c == '\\') m.backslash |= bit;
+        else if (c == '"') m.quote |= bit;
+        else if ((c | 0x20) == '{' || (c | 0x20) == '}') m.bracket |= bit;
+    }
+}
+
+#ifdef SEDITOR_X86
+// '[' ']' 与 '{' '}' 只差 0x20 这一位，或上 0x20 后一起比较
+void json_masks_sse2(const char* p, JsonMasks& m) {
+    const __m128i bs = _mm_set1_epi8('\\'), qt = _mm_set1_epi8('"');
+    const __m128i lo = _mm_set1_epi8(0x20), open = _mm_set1_epi8('{'), close = _mm_set1_epi8('}');
+    m = JsonMasks();
+    for (int i = 0; i < 4; ++i) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + 16 * i)), f = _mm_or_si128(v, lo);
+        m.backslash |= (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, bs)) << (16 * i);
+        m.quote |= (uint64_t)(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, qt)) << (16 * i);
+        m.bracket |= (uint64_t)(uint32_t)_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(f, open), _mm_cmpeq_epi8(f, close))) << (16 * i);
+    }
+}
+
+__attribute__((target("avx2")))
+void json_masks_avx2(const char* p, JsonMasks& m) {
+    const __m256i bs = _mm256_set1_epi8('\\'), qt = _mm256_set1_epi8('"');
+    const __m256i lo = _mm256_set1_epi8(0x20), open = _mm256_set1_epi8('{'), close = _mm256_set1_epi8('}');
+    m = JsonMasks();
+    for (int i = 0; i < 2; ++i) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + 32 * i)), f = _mm256_or_si256(v, lo);
+        m.backslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, bs)) << (32 * i);
+        m.quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, qt)) << (32 * i);
+        m.bracket |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(f, open), _mm256_cmpeq_epi8(f, close))) << (32 * i);
+    }
+}
+#endif
+
+void (*const json_masks)(const char*, JsonMasks&) = [] {
+#ifdef SEDITOR_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return json_masks_avx2;
+    return json_masks_sse2;
+#else
+    return json_masks_scalar;
+#endif
+}();
+
+// 第 i 位为 x 的第 0..i 位的异或：引号之间的区域
+inline uint64_t prefix_xor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+// 被转义的字节：奇数长的反斜杠串后面那一个（simdjson 的进位加法技巧）
+inline uint64_t escaped_bits(uint64_t bs, uint64_t& carry) {
+    const uint64_t even = 0x5555555555555555ull;
+    bs &= ~carry;
+    uint64_t follows = bs << 1 | carry;
+    uint64_t odd_starts = bs & ~even & ~follows;
+    uint64_t seq_even;
+    carry = __builtin_add_overflow(odd_starts, bs, &seq_even);
+    return (even ^ (seq_even << 1)) & follows;
+}
+
+// 处理一块，返回字符串外的括号位置
+inline uint64_t json_block(const char* p, JsonScan& st, void (*masks)(const char*, JsonMasks&)) {
+    JsonMasks m;
+    masks(p, m);
+    uint64_t esc = escaped_bits(m.backslash, st.escaped);
+    uint64_t in = prefix_xor(m.quote & ~esc) ^ st.in_string;
+    st.in_string = (uint64_t)((int64_t)in >> 63);
+    return m.bracket & ~in;
+}
+
+// 按 64 字节块扫描 p[0, n)（base 为其文档偏移，64 对齐），
+// 每块开始前调用 at_block(off, st)，每个结构括号调用 fn(off, ch)
+template <class B, class F>
+void json_scan(const char* p, uint64_t n, uint64_t base, JsonScan& st, B at_block, F fn) {
+    char tail[64];
+    for (uint64_t i = 0; i < n; i += 64) {
+        const char* q = p + i;
+        if (n - i < 64) {
+            memset(tail, ' ', 64);
+            memcpy(tail, q, n - i);
+            q = tail;
+        }
+        at_block(base + i, st);
+        // 补齐的尾块逐字节处理，没有 SIMD 的平台用的就是这个版本
+        for (uint64_t m = json_block(q, st, q == tail ? json_masks_scalar : json_masks); m; m &= m - 1) {
+            int k = __builtin_ctzll(m);
+            fn(base + i + k, q[k]);
+        }
+    }
+}
+
+// 文档中 a 之前紧挨着的反斜杠个数，决定 a 处是否被转义
+uint64_t backslashes_before(const vector<PieceTable::Segment>& segs, uint64_t a) {
+    uint64_t k = 0;
+    auto it = upper_bound(segs.begin(), segs.end(), a,
+                          [](uint64_t off, const PieceTable::Segment& s) { return off < s.off; });
+    while (it != segs.begin()) {
+        --it;
+        uint64_t e = std::min(a, it->off + it->len);
+        for (uint64_t i = e; i > it->off; --i, ++k)
+            if (it->data[i - 1 - it->off] != '\\') return k;
+        a = it->off;
+    }
+    return k;
+}
+
+// 小范围的现场扫描：逐字节读文档，字符串整体作为一个 '"' 返回
+class JsonReader {
+public:
+    JsonReader(const PieceTable& buf, uint64_t pos, uint8_t state = 0)
+        : buf(buf), total(buf.length()), pos(pos), in_str(state & 1), esc(state & 2) {}
+
+    void seek(uint64_t p) {
+        pos = p;
+        in_str = esc = false;
+    }
+    // 下一个字符串外的字节；字符串时 len 为含引号的长度。到末尾返回 -1
+    int next(uint64_t& at, uint64_t& len) {
+        for (int c; (c = byte(pos)) >= 0; ) {
+            if (in_str || esc) {
+                pos++;
+                if (esc) esc = false;
+                else if (c == '\\') esc = true;
+                else if (c == '"') in_str = false;
+                continue;
+            }
+            at = pos++;
+            if (c == '\\') {
+                esc = true;
+                continue;
+            }
+            len = 1;
+            if (c == '"') {
+                for (bool e = false; (c = byte(pos)) >= 0; ) {
+                    pos++;
+                    if (e) e = false;
+                    else if (c == '\\') e = true;
+                    else if (c == '"') break;
+                }
+                len = pos - at;
+                return '"';
+            }
+            return c;
+        }
+        return -1;
+    }
+
+private:
+    static constexpr uint64_t WINDOW = 64 << 10;
+    const PieceTable& buf;
+    uint64_t total, pos;
+    bool in_str, esc;
+    string win;
+    uint64_t win_at = 0;
+
+    int byte(uint64_t p) {
+        if (p >= total) return -1;
+        if (p < win_at || p >= win_at + win.size()) {
+            win_at = p;
+            win = buf.read(p, std::min(WINDOW, total - p));
+        }
+        return (unsigned char)win[p - win_at];
+    }
+};
+
+inline bool json_space(int c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+inline bool json_open(int c) { return c == '{' || c == '['; }
+inline bool json_close(int c) { return c == '}' || c == ']'; }
+
+} // namespace
+
+bool JsonIndex::match(const PieceTable& buf, uint64_t pos, uint64_t& other) const {
+    if (pos >= total) return false;
+    // 从 MIN_SPAN 之前的检查点扫到 pos：确认它在字符串外，顺便找到窗口内的配对开括号
+    uint64_t cp = (pos > MIN_SPAN ? pos - MIN_SPAN : 0) / CHECKPOINT;
+    JsonReader rd(buf, cp * CHECKPOINT, state[cp]);
+    vector<uint64_t> stack;
+    uint64_t at, len;
+    int c;
+    while ((c = rd.next(at, len)) >= 0 && at < pos) {
+        if (json_open(c)) stack.push_back(at);
+        else if (json_close(c) && !stack.empty()) stack.pop_back();
+    }
+    if (c < 0 || at != pos || !(json_open(c) || json_close(c))) return false;
+    other = UINT64_MAX;
+    if (json_close(c)) {
+        if (!stack.empty()) {
+            other = stack.back();
+        } else {
+            auto it = lower_bound(by_close.begin(), by_close.end(), pos,
+                                  [&](uint32_t i, uint64_t p) { return close[i] < p; });
+            if (it != by_close.end() && close[*it] == pos) other = open[*it];
+        }
+        return true;
+    }
+    auto it = lower_bound(open.begin(), open.end(), pos);
+    if (it != open.end() && *it == pos) {
+        other = close[it - open.begin()];
+        return true;
+    }
+    // 不在索引里就是小容器，配对括号在 MIN_SPAN 之内
+    int depth = 1;
+    while ((c = rd.next(at, len)) >= 0 && at <= pos + MIN_SPAN) {
+        if (json_open(c)) depth++;
+        else if (json_close(c) && --depth == 0) {
+            other = at;
+            break;
+        }
+    }
+    return true;
+}
+
+bool JsonIndex::enclosing(const PieceTable& buf, uint64_t pos, uint64_t& o, uint64_t& c) const {
+    uint64_t other;
+    if (match(buf, pos, other)) {
+        if (other == UINT64_MAX) return false;
+        o = std::min(pos, other);
+        c = std::max(pos, other);
+        return true;
+    }
+    if (pos >= total) return false;
+    uint64_t cp = (pos > MIN_SPAN ? pos - MIN_SPAN : 0) / CHECKPOINT;
+    JsonReader rd(buf, cp * CHECKPOINT, state[cp]);
+    vector<uint64_t> stack;
+    uint64_t at, len;
+    for (int ch; (ch = rd.next(at, len)) >= 0 && at < pos; ) {
+        if (json_open(ch)) stack.push_back(at);
+        else if (json_close(ch) && !stack.empty()) stack.pop_back();
+    }
+    if (!stack.empty()) {
+        o = stack.back();
+        return match(buf, o, c) && c != UINT64_MAX;
+    }
+    // 窗口内没有未闭合的开括号：外层一定是大容器，沿 parent 向外找
+    size_t i = upper_bound(open.begin(), open.end(), pos) - open.begin();
+    if (i == 0) return false;
+    uint32_t k = i - 1;
+    while (k != NONE && close[k] < pos) k = parent[k];
+    if (k == NONE) return false;
+    o = open[k];
+    c = close[k];
+    return true;
+}
+
+bool JsonIndex::find_path(const PieceTable& buf, const string& path, uint64_t& pos, string& err) const {
+    struct Step {
+        bool index;
+        string key;
+        uint64_t n;
+    };
+    vector<Step> steps;
+    size_t i = path.size() && path[0] == '$' ? 1 : 0;
+    while (i < path.size()) {
+        if (path[i] == '[') {
+            size_t e;
+            if (i + 1 < path.size() && path[i + 1] == '"') {
+                e = path.find("\"]", i + 2);
+                if (e == string::npos) break;
+                steps.push_back(Step{false, path.substr(i + 2, e - i - 2), 0});
+                i = e + 2;
+            } else {
+                e = path.find(']', i);
+                if (e == string::npos || e == i + 1 ||
+                    path.find_first_not_of("0123456789", i + 1) != e) break;
+                steps.push_back(Step{true, "", std::stoull(path.substr(i + 1, e - i - 1))});
+                i = e + 1;
+            }
+            continue;
+        }
+        if (path[i] == '.') i++;
+        size_t e = path.find_first_of(".[", i);
+        if (e == string::npos) e = path.size();
+        if (e == i) break;
+        steps.push_back(Step{false, path.substr(i, e - i), 0});
+        i = e;
+    }
+    if (i < path.size()) {
+        err = "Bad path near: " + path.substr(i);
+        return false;
+    }
+
+    JsonReader rd(buf, 0);
+    uint64_t at, len, v = 0;
+    int c, vc;
+    while ((c = rd.next(at, len)) >= 0 && json_space(c)) {}
+    if (c < 0) {
+        err = "Empty document";
+        return false;
+    }
+    v = at;
+    vc = c;
+    string shown = "$";
+    for (const Step& st : steps) {
+        if (vc != (st.index ? '[' : '{')) {
+            err = shown + " is not an " + (st.index ? "array" : "object");
+            return false;
+        }
+        shown += st.index ? "[" + to_string(st.n) + "]" : "." + st.key;
+        rd.seek(v + 1);
+        uint64_t count = 0;
+        int depth = 0;
+        bool want = true, matched = false, take = false, found = false;
+        while ((c = rd.next(at, len)) >= 0) {
+            if (json_space(c)) continue;
+            if (take) {
+                found = true;
+                break;
+            }
+            if (depth == 0) {
+                if (json_close(c)) break;
+                if (c == ',') {
+                    count++;
+                    want = true;
+                    continue;
+                }
+                if (want) {
+                    want = false;
+                    if (st.index && count == st.n) {
+                        found = true;
+                        break;
+                    }
+                    if (!st.index && c == '"') {
+                        matched = len >= 2 && buf.read(at + 1, len - 2) == st.key;
+                        continue;
+                    }
+                }
+                if (c == ':') {
+                    take = matched;
+                    continue;
+                }
+            }
+            if (json_open(c)) {
+                // 大容器整个跳过
+                auto it = lower_bound(open.begin(), open.end(), at);
+                if (it != open.end() && *it == at) rd.seek(close[it - open.begin()] + 1);
+                else depth++;
+            } else if (json_close(c)) {
+                depth--;
+            }
+        }
+        if (!found) {
+            err = "Not found: " + shown;
+            return false;
+        }
+        v = at;
+        vc = c;
+    }
+    pos = v;
+    return true;
+}
+
+shared_ptr<JsonIndexJob> start_json_index(const PieceTable& buf) {
+    auto job = make_shared<JsonIndexJob>();
+    auto ix = make_shared<JsonIndex>();
+    ix->version = buf.version();
+    ix->total = buf.length();
+    ix->state.assign(ix->total / JsonIndex::CHECKPOINT + 1, 0);
+    job->index = ix;
+    job->segs = buf.segments();
+    for (uint64_t b = 0; b < ix->total; b += JSON_CHUNK) job->bounds.push_back(b);
+    job->bounds.push_back(ix->total);
+    size_t n = job->bounds.size() - 1;
+    if (n == 0) {
+        job->done = true;
+        return job;
+    }
+    job->carry.assign(n, 0);
+    job->pairs.resize(n);
+    job->lone_close.resize(n);
+    job->lone_open.resize(n);
+    job->pending = n;
+
+    // 最后一块配对完成后按顺序接起各块剩下的括号，生成最终的索引
+    auto stitch = [](JsonIndexJob& job) {
+        JsonIndex& ix = *job.index;
+        vector<std::pair<uint64_t, uint64_t>> all;
+        vector<uint64_t> stack;
+        for (size_t i = 0; i < job.pairs.size(); ++i) {
+            all.insert(all.end(), job.pairs[i].begin(), job.pairs[i].end());
+            for (uint64_t c : job.lone_close[i]) {
+                if (stack.empty()) continue;
+                if (c - stack.back() >= JsonIndex::MIN_SPAN) all.push_back({stack.back(), c});
+                stack.pop_back();
+            }
+            stack.insert(stack.end(), job.lone_open[i].begin(), job.lone_open[i].end());
+            vector<std::pair<uint64_t, uint64_t>>().swap(job.pairs[i]);
+        }
+        sort(all.begin(), all.end());
+        ix.open.reserve(all.size());
+        ix.close.reserve(all.size());
+        ix.parent.reserve(all.size());
+        vector<uint32_t> outer;
+        for (auto& p : all) {
+            while (!outer.empty() && ix.close[outer.back()] < p.first) outer.pop_back();
+            ix.parent.push_back(outer.empty() ? JsonIndex::NONE : outer.back());
+            outer.push_back(ix.open.size());
+            ix.open.push_back(p.first);
+            ix.close.push_back(p.second);
+        }
+        ix.by_close.resize(all.size());
+        for (uint32_t i = 0; i < all.size(); ++i) ix.by_close[i] = i;
+        sort(ix.by_close.begin(), ix.by_close.end(),
+             [&](uint32_t a, uint32_t b) { return ix.close[a] < ix.close[b]; });
+        SE_LOG(INFO, "json index: " + to_string(all.size()) + " large containers, " +
+                         to_string(ix.memory_bytes()) + " bytes");
+    };
+
+    auto pass2 = [stitch](shared_ptr<JsonIndexJob> job, size_t i, JsonScan st) {
+        uint64_t a = job->bounds[i], b = job->bounds[i + 1];
+        if (!job->cancel) {
+            JsonIndex& ix = *job->index;
+            auto& pairs = job->pairs[i];
+            auto& lone = job->lone_close[i];
+            auto& stack = job->lone_open[i];
+            with_contiguous(job->segs, a, b, [&](const char* p, size_t n) {
+                json_scan(p, n, a, st,
+                    [&](uint64_t off, const JsonScan& s) {
+                        if (off % JsonIndex::CHECKPOINT == 0)
+                            ix.state[off / JsonIndex::CHECKPOINT] = (s.in_string & 1) | (s.escaped & 1) << 1;
+                    },
+                    [&](uint64_t off, char c) {
+                        if (json_open(c)) {
+                            stack.push_back(off);
+                        } else if (stack.empty()) {
+                            lone.push_back(off);
+                        } else {
+                            if (off - stack.back() >= JsonIndex::MIN_SPAN) pairs.push_back({stack.back(), off});
+                            stack.pop_back();
+                        }
+                    });
+            });
+        }
+        job->scanned += b - a;
+        std::unique_lock<std::mutex> lk(job->mu);
+        if (--job->pending > 0) return;
+        if (!job->cancel) {
+            lk.unlock();
+            stitch(*job);
+            lk.lock();
+            job->done = true;
+        }
+        job->cv.notify_all();
+    };
+
+    for (size_t i = 0; i < n; ++i) {
+        worker_pool().submit([job, i, pass2] {
+            uint64_t a = job->bounds[i], b = job->bounds[i + 1];
+            uint64_t esc_in = a ? backslashes_before(job->segs, a) & 1 : 0;
+            if (!job->cancel) {
+                // 第一趟只要块末是否在字符串内：假设块首不在字符串内时的结果，
+                // 真正的状态再与前面各块的结果异或
+                JsonScan st{0, esc_in};
+                with_contiguous(job->segs, a, b, [&](const char* p, size_t n) {
+                    json_scan(p, n, a, st, [](uint64_t, const JsonScan&) {}, [](uint64_t, char) {});
+                });
+                job->carry[i] = st.in_string & 1;
+            }
+            job->scanned += b - a;
+            std::unique_lock<std::mutex> lk(job->mu);
+            if (--job->pending > 0) return;
+            if (job->cancel) {
+                job->cv.notify_all();
+                return;
+            }
+            size_t k = job->carry.size();
+            job->pending = k;
+            lk.unlock();
+            uint64_t in = 0;
+            for (size_t j = 0; j < k; ++j) {
+                uint64_t s = job->bounds[j];
+                uint64_t e = s ? backslashes_before(job->segs, s) & 1 : 0;
+                worker_pool().submit([job, j, in, e, pass2] { pass2(job, j, JsonScan{in ? ~0ull : 0, e}); });
+                in ^= job->carry[j];
+            }
+        });
+    }
+    return job;
+}
+
+// ---- 代码块索引 ----
+
+static inline bool open_bracket(char c) { return c == '{' || c == '(' || c == '['; }
+static inline bool close_bracket(char c) { return c == '}' || c == ')' || c == ']'; }
+
+// 对字符串和注释以外的每个括号调用 fn(col, ch)；spans 为 lex_line 的输出，按起点有序
+template <class F>
+static void code_brackets(const string& text, const vector<HlSpan>& spans, F fn) {
+    size_t k = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+        while (k < spans.size() && spans[k].start + spans[k].len <= i) ++k;
+        if (k < spans.size() && spans[k].start <= i &&
+            (spans[k].kind == HL_STRING || spans[k].kind == HL_COMMENT)) {
+            i = spans[k].start + spans[k].len - 1;
+            continue;
+        }
+        char c = text[i];
+        if (open_bracket(c) || close_bracket(c)) fn((uint32_t)i, c);
+    }
+}
+
+void BlockIndex::reset(const LangSpec* l, size_t lines) {
+    lang = lines <= MAX_LINES ? l : nullptr;
+    oversize = l && !lang;
+    chunks.clear();
+    firsts.clear();
+    nlines = nstale = 0;
+    if (lang) insert_lines(0, lines);
+}
+
+BlockIndex::Loc BlockIndex::locate(size_t line) const {
+    if (chunks.empty()) return Loc{0, 0, 0};
+    size_t c = std::upper_bound(firsts.begin(), firsts.end(), line) - firsts.begin() - 1;
+    return Loc{c, line - firsts[c], firsts[c]};
+}
+
+// 块 from 之后的块首行号随行数变化重算
+void BlockIndex::renumber(size_t from) {
+    firsts.resize(chunks.size());
+    for (size_t c = from; c < chunks.size(); ++c)
+        firsts[c] = c == 0 ? 0 : firsts[c - 1] + chunks[c - 1].lines.size();
+}
+
+void BlockIndex::mark_stale(Chunk& ch, LineInfo& e) {
+    ch.dirty = true;
+    if (e.stale) return;
+    e.stale = true;
+    ch.nstale++;
+    nstale++;
+}
+
+void BlockIndex::erase_lines(size_t line, size_t n) {
+    if (n == 0 || line >= nlines) return;
+    Loc at = locate(line);
+    size_t c = at.chunk, off = at.off;
+    while (n > 0 && c < chunks.size()) {
+        Chunk& ch = chunks[c];
+        size_t k = std::min(n, ch.lines.size() - off);
+        auto a = ch.lines.begin() + off;
+        for (auto it = a; it != a + k; ++it)
+            if (it->stale) {
+                ch.nstale--;
+                nstale--;
+            }
+        ch.lines.erase(a, a + k);
+        ch.dirty = true;
+        if (ch.lines.empty()) chunks.erase(chunks.begin() + c);
+        else ++c;
+        off = 0;
+        nlines -= k;
+        n -= k;
+    }
+    renumber(at.chunk);
+}
+
+void BlockIndex::insert_lines(size_t line, size_t n) {
+    if (n == 0) return;
+    if (chunks.empty()) {
+        chunks.emplace_back();
+        firsts.assign(1, 0);
+    }
+    Loc at = locate(std::min(line, nlines));
+    Chunk& ch = chunks[at.chunk];
+    ch.lines.insert(ch.lines.begin() + at.off, n, LineInfo());
+    ch.nstale += n;
+    ch.dirty = true;
+    nstale += n;
+    nlines += n;
+    if (ch.lines.size() <= 2 * CHUNK) {
+        renumber(at.chunk + 1);
+        return;
+    }
+    // 块太大就切成 CHUNK 行一块
+    vector<Chunk> parts;
+    for (size_t i = 0; i < ch.lines.size(); i += CHUNK) {
+        Chunk part;
+        part.lines.assign(ch.lines.begin() + i, ch.lines.begin() + std::min(i + CHUNK, ch.lines.size()));
+        for (auto& e : part.lines) part.nstale += e.stale;
+        parts.push_back(std::move(part));
+    }
+    chunks.erase(chunks.begin() + at.chunk);
+    chunks.insert(chunks.begin() + at.chunk, std::make_move_iterator(parts.begin()),
+                  std::make_move_iterator(parts.end()));
+    renumber(at.chunk + 1);
+}
+
+void BlockIndex::lines_changed(size_t first, size_t removed, size_t added) {
+    if (!lang) return;
+    if (nlines - removed + added > MAX_LINES) {
+        SE_LOG(INFO, "block index disabled: more than " + to_string(MAX_LINES) + " lines");
+        reset(lang, nlines - removed + added);
+        return;
+    }
+    erase_lines(first + 1, removed);
+    insert_lines(first + 1, added);
+    if (first < nlines) {
+        Loc at = locate(first);
+        mark_stale(chunks[at.chunk], chunks[at.chunk].lines[at.off]);
+    }
+}
+
+void BlockIndex::analyze(const PieceTable& buf, size_t line, uint8_t in, LineInfo& e, string& text,
+                         vector<HlSpan>& spans) const {
+    e.in = in;
+    e.open = e.close = 0;
+    e.indent = BLANK;
+    if (buf.line_length(line) > Highlighter::LONG_LINE) {
+        e.out = in;
+        return;
+    }
+    buf.read_line(line, text);
+    spans.clear();
+    e.out = lex_line(*lang, text.data(), text.size(), in, spans);
+    code_brackets(text, spans, [&](uint32_t, char c) {
+        if (open_bracket(c)) e.open++;
+        else if (e.open) e.open--;
+        else e.close++;
+    });
+    if (in != HL_NORMAL) return;
+    // 缩进按 8 列制表位算；只有注释的行不算块的一部分
+    uint16_t col = 0;
+    size_t i = 0;
+    for (; i < text.size() && (text[i] == ' ' || text[i] == '\t'); ++i)
+        col = text[i] == '\t' ? (col / 8 + 1) * 8 : col + 1;
+    if (i == text.size() || text[i] == '\r') return;
+    for (auto& sp : spans)
+        if (sp.start == i && sp.kind == HL_COMMENT) return;
+    e.indent = std::min<uint16_t>(col, BLANK - 1);
+}
+
+bool BlockIndex::refresh(const PieceTable& buf, chrono::milliseconds budget) {
+    if (!lang) return false;
+    auto deadline = chrono::steady_clock::now() + budget;
+    string text;
+    vector<HlSpan> spans;
+    size_t done = 0;
+    uint8_t prev = HL_NORMAL;
+    for (size_t c = 0, first = 0; c < chunks.size() && nstale; first += chunks[c++].lines.size()) {
+        Chunk& ch = chunks[c];
+        if (!ch.nstale) {
+            prev = ch.lines.back().out;
+            continue;
+        }
+        for (size_t i = 0; i < ch.lines.size(); prev = ch.lines[i++].out) {
+            LineInfo& e = ch.lines[i];
+            if (!e.stale) continue;
+            analyze(buf, first + i, prev, e, text, spans);
+            e.stale = false;
+            ch.nstale--;
+            nstale--;
+            // 行尾状态和下一行记下的入口状态不一致，下一行也要重新分析
+            if (i + 1 < ch.lines.size()) {
+                if (ch.lines[i + 1].in != e.out) mark_stale(ch, ch.lines[i + 1]);
+            } else if (c + 1 < chunks.size() && chunks[c + 1].lines[0].in != e.out) {
+                mark_stale(chunks[c + 1], chunks[c + 1].lines[0]);
+            }
+            if (++done % 64 == 0 && chrono::steady_clock::now() > deadline) return false;
+        }
+    }
+    if (nstale) return false;
+    for (auto& ch : chunks) {
+        if (!ch.dirty) continue;
+        ch.close = ch.open = 0;
+        ch.min_indent = BLANK;
+        for (auto& e : ch.lines) {
+            uint32_t m = std::min(ch.open, e.close);
+            ch.close += e.close - m;
+            ch.open = ch.open - m + e.open;
+            ch.min_indent = std::min(ch.min_indent, e.indent);
+        }
+        ch.dirty = false;
+    }
+    return true;
+}
+
+void BlockIndex::brackets(const PieceTable& buf, size_t line, vector<std::pair<uint32_t, char>>& out) const {
+    out.clear();
+    if (buf.line_length(line) > Highlighter::LONG_LINE) return;
+    string text;
+    vector<HlSpan> spans;
+    buf.read_line(line, text);
+    lex_line(*lang, text.data(), text.size(), info(line).in, spans);
+    code_brackets(text, spans, [&](uint32_t col, char c) { out.push_back({col, c}); });
+}
+
+// 从 from 行往后找第 d 个没有被配对掉的右括号所在的行
+bool BlockIndex::find_forward(size_t from, uint64_t& d, size_t& line) const {
+    if (from >= nlines) return false;
+    Loc at = locate(from);
+    for (size_t c = at.chunk, i = at.off, first = at.first; c < chunks.size(); first += chunks[c++].lines.size(), i = 0) {
+        const Chunk& ch = chunks[c];
+        if (i == 0 && ch.close < d) {
+            d = d - ch.close + ch.open;
+            continue;
+        }
+        for (; i < ch.lines.size(); ++i) {
+            const LineInfo& e = ch.lines[i];
+            if (e.close >= d) {
+                line = first + i;
+                return true;
+            }
+            d = d - e.close + e.open;
+        }
+    }
+    return false;
+}
+
+// 从 from 行往前找第 d 个没有被配对掉的左括号所在的行
+bool BlockIndex::find_backward(size_t from, uint64_t& d, size_t& line) const {
+    if (from >= nlines) return false;
+    Loc at = locate(from);
+    size_t c = at.chunk, first = at.first;
+    for (size_t i = at.off + 1; ; ) {
+        const Chunk& ch = chunks[c];
+        if (i == ch.lines.size() && ch.open < d) {
+            d = d - ch.open + ch.close;
+        } else {
+            for (; i-- > 0; ) {
+                const LineInfo& e = ch.lines[i];
+                if (e.open >= d) {
+                    line = first + i;
+                    return true;
+                }
+                d = d - e.open + e.close;
+            }
+        }
+        if (c == 0) return false;
+        first -= chunks[--c].lines.size();
+        i = chunks[c].lines.size();
+    }
+}
+
+bool BlockIndex::match(const PieceTable& buf, uint64_t pos, uint64_t& other) const {
+    if (!ready() || pos >= buf.length()) return false;
+    size_t L = buf.line_of(pos);
+    uint64_t ls = buf.line_start(L);
+    vector<std::pair<uint32_t, char>> br;
+    brackets(buf, L, br);
+    size_t k = 0;
+    while (k < br.size() && br[k].first != pos - ls) ++k;
+    if (k == br.size()) return false;
+    other = UINT64_MAX;
+    uint64_t d = 0;
+    size_t line;
+    if (open_bracket(br[k].second)) {
+        for (size_t j = k; j < br.size(); ++j) {
+            if (open_bracket(br[j].second)) d++;
+            else if (--d == 0) {
+                other = ls + br[j].first;
+                return true;
+            }
+        }
+        if (!find_forward(L + 1, d, line)) return true;
+        brackets(buf, line, br);
+        uint64_t run = 0;
+        for (auto& b : br) {
+            if (open_bracket(b.second)) run++;
+            else if (run) run--;
+            else if (--d == 0) {
+                other = buf.line_start(line) + b.first;
+                break;
+            }
+        }
+        return true;
+    }
+    for (size_t j = k + 1; j-- > 0; ) {
+        if (close_bracket(br[j].second)) d++;
+        else if (--d == 0) {
+            other = ls + br[j].first;
+            return true;
+        }
+    }
+    if (L == 0 || !find_backward(L - 1, d, line)) return true;
+    brackets(buf, line, br);
+    uint64_t run = 0;
+    for (size_t j = br.size(); j-- > 0; ) {
+        if (close_bracket(br[j].second)) run++;
+        else if (run) run--;
+        else if (--d == 0) {
+            other = buf.line_start(line) + br[j].first;
+            break;
+        }
+    }
+    return true;
+}
+
+bool BlockIndex::enclosing(const PieceTable& buf, uint64_t pos, uint64_t& o, uint64_t& c) const {
+    if (!ready() || pos > buf.length()) return false;
+    size_t L = buf.line_of(pos), line = L;
+    uint64_t ls = buf.line_start(L), d = 1, run = 0;
+    vector<std::pair<uint32_t, char>> br;
+    brackets(buf, L, br);
+    // 相当于在 pos 处放一个右括号，往前找和它配对的左括号
+    bool found = false;
+    for (size_t j = br.size(); j-- > 0 && !found; ) {
+        if (br[j].first >= pos - ls) continue;
+        if (close_bracket(br[j].second)) run++;
+        else if (run) run--;
+        else {
+            found = true;
+            o = ls + br[j].first;
+        }
+    }
+    if (!found) {
+        d += run;
+        if (L == 0 || !find_backward(L - 1, d, line)) return false;
+        brackets(buf, line, br);
+        run = 0;
+        for (size_t j = br.size(); j-- > 0 && !found; ) {
+            if (close_bracket(br[j].second)) run++;
+            else if (run) run--;
+            else if (--d == 0) {
+                found = true;
+                o = buf.line_start(line) + br[j].first;
+            }
+        }
+        if (!found) return false;
+    }
+    return match(buf, o, c) && c != UINT64_MAX;
+}
+
+bool BlockIndex::indent_block(size_t line, size_t& end) const {
+    if (!ready() || line >= nlines) return false;
+    uint16_t k = info(line).indent;
+    if (k == BLANK) return false;
+    // 第一个缩进不比块头深的非空行之前都属于这个块
+    size_t stop = nlines;
+    Loc at = locate(line + 1 < nlines ? line + 1 : line);
+    size_t i = line + 1 < nlines ? at.off : chunks[at.chunk].lines.size();
+    for (size_t c = at.chunk, first = at.first; c < chunks.size() && stop == nlines;
+         first += chunks[c++].lines.size(), i = 0) {
+        const Chunk& ch = chunks[c];
+        if (i == 0 && ch.min_indent > k) continue;
+        for (; i < ch.lines.size(); ++i)
+            if (ch.lines[i].indent <= k) {
+                stop = first + i;
+                break;
+            }
+    }
+    end = stop - 1;
+    while (end > line && info(end).indent == BLANK) end--;
+    return end > line;
+}
+
+bool BlockIndex::indent_parent(size_t line, size_t& head) const {
+    if (!ready() || line >= nlines) return false;
+    uint16_t k = info(line).indent;
+    if (k == BLANK || line == 0) return false;
+    Loc at = locate(line - 1);
+    size_t c = at.chunk, first = at.first;
+    for (size_t i = at.off + 1; ; ) {
+        const Chunk& ch = chunks[c];
+        if (i < ch.lines.size() || ch.min_indent < k) {
+            for (; i-- > 0; )
+                if (ch.lines[i].indent < k) {
+                    head = first + i;
+                    return true;
+                }
+        }
+        if (c == 0) return false;
+        first -= chunks[--c].lines.size();
+        i = chunks[c].lines.size();
+    }
+}
+
+size_t BlockIndex::memory_bytes() const {
+    size_t n = chunks.capacity() * sizeof(Chunk) + firsts.capacity() * sizeof(size_t);
+    for (auto& ch : chunks) n += ch.lines.capacity() * sizeof(LineInfo);
+    return n;
+}
+
+// ---- 批处理 ----
+
+namespace {
+
+// 切出一个参数：裸词到空白为止，双引号内处理转义
+bool next_arg(const string& s, size_t& i, string& out, string& err) {
+    while (i < s.size() && isspace((unsigned char)s[i])) ++i;
+    out.clear();
+    if (i >= s.size()) {
+        err = "missing argument";
+        return false;
+    }
+    if (s[i] != '"') {
+        while (i < s.size() && !isspace((unsigned char)s[i])) out += s[i++];
+        return true;
+    }
+    for (++i; i < s.size(); ++i) {
+        char c = s[i];
+        if (c == '"') {
+            ++i;
+            return true;
+        }
+        if (c == '\\' && i + 1 < s.size()) {
+            c = s[++i];
+            if (c == 'n') c = '\n';
+            else if (c == 't') c = '\t';
+        }
+        out += c;
+    }
+    err = "unterminated string";
+    return false;
+}
+
+double ms_since(chrono::steady_clock::time_point t0) {
+    return chrono::duration<double, std::milli>(chrono::steady_clock::now() - t0).count();
+}
+
+// 等搜索任务全部完成，按顺序取出命中
+void wait_search(SearchJob& job, vector<uint64_t>& hits, vector<uint32_t>& lens) {
+    {
+        std::unique_lock<std::mutex> lk(job.mu);
+        job.cv.wait(lk, [&] { return job.pending == 0; });
+    }
+    collect_search(job, hits, lens);
+}
+
+} // namespace
+
+bool parse_batch_script(const string& text, vector<BatchCommand>& out, string& err) {
+    static const struct { const char* name; BatchCommand::Op op; bool regex; int args; } ops[] = {
+        {"goto", BatchCommand::GOTO, false, 1},
+        {"find", BatchCommand::FIND, false, 1},
+        {"find-re", BatchCommand::FIND, true, 1},
+        {"replace", BatchCommand::REPLACE, false, 2},
+        {"replace-re", BatchCommand::REPLACE, true, 2},
+        {"delete", BatchCommand::DELETE, false, 1},
+        {"insert", BatchCommand::INSERT, false, 1},
+    };
+    out.clear();
+    size_t pos = 0;
+    for (int ln = 1; pos < text.size(); ++ln) {
+        size_t e = text.find('\n', pos);
+        if (e == string::npos) e = text.size();
+        string line = text.substr(pos, e - pos);
+        pos = e + 1;
+        size_t i = 0;
+        while (i < line.size() && isspace((unsigned char)line[i])) ++i;
+        if (i == line.size() || line[i] == '#') continue;
+        size_t w = i;
+        while (i < line.size() && !isspace((unsigned char)line[i])) ++i;
+        string name = line.substr(w, i - w);
+        auto fail = [&](const string& msg) {
+            err = "line " + to_string(ln) + ": " + msg;
+            return false;
+        };
+        auto op = std::find_if(std::begin(ops), std::end(ops), [&](const auto& o) { return name == o.name; });
+        if (op == std::end(ops)) return fail("unknown command '" + name + "'");
+        BatchCommand c;
+        c.op = op->op;
+        c.regex = op->regex;
+        c.line = ln;
+        string msg;
+        if (!next_arg(line, i, c.a, msg) || (op->args == 2 && !next_arg(line, i, c.b, msg)))
+            return fail(name + ": " + msg);
+        while (i < line.size() && isspace((unsigned char)line[i])) ++i;
+        if (i < line.size()) return fail(name + ": too many arguments");
+        if (c.op == BatchCommand::GOTO && c.a == "$") {
+            c.n = -1;
+        } else if (c.op == BatchCommand::GOTO || c.op == BatchCommand::DELETE) {
+            char* end;
+            c.n = strtoll(c.a.c_str(), &end, 10);
+            if (*end || c.n == 0 || (c.op == BatchCommand::DELETE && c.n < 0))
+                return fail(name + ": bad number '" + c.a + "'");
+        }
+        if ((c.op == BatchCommand::FIND || c.op == BatchCommand::REPLACE) && c.a.empty())
+            return fail(name + ": empty pattern");
+        if (c.regex) {
+            Regex re;
+            if (!re.compile(c.a, msg)) return fail(name + ": " + msg);
+        }
+        out.push_back(std::move(c));
+    }
+    return true;
+}
+
+BatchResult run_batch_file(const vector<BatchCommand>& cmds, const string& fname, size_t mem_limit) {
+    BatchResult r;
+    r.file = fname;
+    auto t0 = chrono::steady_clock::now();
+    MappedFile file;
+    PieceTable buf;
+    uint64_t indexed;
+    if (!open_document(fname, file, buf, indexed)) {
+        r.err = strerror(errno);
+        return r;
+    }
+    // 按行定位需要完整的行索引
+    if (indexed < file.size) publish_index(*start_index_job(file.data, indexed, file.size), buf, true);
+    r.bytes = file.size;
+    r.load_ms = ms_since(t0);
+
+    t0 = chrono::steady_clock::now();
+    uint64_t cur = 0, ver = buf.version();
+    vector<uint64_t> hits;
+    vector<uint32_t> lens;
+    auto fail = [&](const BatchCommand& c, const string& msg) {
+        r.err = "line " + to_string(c.line) + ": " + msg;
+        return r;
+    };
+    for (const BatchCommand& c : cmds) {
+        size_t lines = buf.line_count();
+        switch (c.op) {
+        case BatchCommand::GOTO: {
+            int64_t l = c.n > 0 ? c.n - 1 : (int64_t)lines + c.n;
+            if (l < 0 || l >= (int64_t)lines)
+                return fail(c, "goto " + c.a + ": file has " + to_string(lines) + " lines");
+            cur = buf.line_start(l);
+            break;
+        }
+        case BatchCommand::FIND:
+        case BatchCommand::REPLACE: {
+            string err;
+            auto job = start_search(buf, c.a, c.regex, err);
+            if (!job) return fail(c, err);
+            hits.clear();
+            lens.clear();
+            wait_search(*job, hits, lens);
+            if (c.op == BatchCommand::FIND) {
+                auto it = std::lower_bound(hits.begin(), hits.end(), cur);
+                if (it == hits.end()) return fail(c, "no match for '" + c.a + "' after the cursor");
+                cur = *it;
+                break;
+            }
+            r.peak_mem = std::max(r.peak_mem, buf.memory_bytes() + hits.capacity() * sizeof(uint64_t) +
+                                                  lens.capacity() * sizeof(uint32_t));
+            if (r.peak_mem > mem_limit) return fail(c, "memory limit exceeded");
+            vector<PieceTable::Piece> old, now;
+            r.edits += buf.replace_ranges(hits, lens, c.a.size(), c.b.data(), c.b.size(), old, now);
+            cur = std::min(cur, buf.length());
+            break;
+        }
+        case BatchCommand::DELETE: {
+            size_t l = buf.line_of(cur);
+            uint64_t a = buf.line_start(l), b = l + c.n < lines ? buf.line_start(l + c.n) : buf.length();
+            buf.erase(a, b - a);
+            cur = a;
+            r.edits++;
+            break;
+        }
+        case BatchCommand::INSERT:
+            buf.insert(cur, c.a.data(), c.a.size());
+            cur += c.a.size();
+            r.edits++;
+            break;
+        }
+        hits.clear();
+        hits.shrink_to_fit();
+        lens.clear();
+        lens.shrink_to_fit();
+        r.peak_mem = std::max(r.peak_mem, buf.memory_bytes());
+        if (r.peak_mem > mem_limit) return fail(c, "memory limit exceeded");
+    }
+    r.edit_ms = ms_since(t0);
+    r.lines = buf.line_count();
+    r.changed = buf.version() != ver;
+
+    if (r.changed) {
+        t0 = chrono::steady_clock::now();
+        string err;
+        if (!save_document(buf, file.fd, fname, err)) {
+            r.err = "save failed: " + err;
+            return r;
+        }
+        r.save_ms = ms_since(t0);
+    }
+    r.ok = true;
+    return r;
+}
+
+vector<BatchResult> run_batch(const vector<BatchCommand>& cmds, const vector<string>& files, unsigned threads,
+                              size_t mem_limit, std::function<void(const BatchResult&)> report) {
+    // 大文件先开始，最后剩下的都是小文件，各线程差不多同时做完
+    vector<pair<uint64_t, size_t>> order;
+    for (size_t i = 0; i < files.size(); ++i) {
+        struct stat st;
+        order.emplace_back(stat(files[i].c_str(), &st) == 0 ? st.st_size : 0, i);
+    }
+    std::stable_sort(order.begin(), order.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+    vector<BatchResult> results(files.size());
+    std::atomic<size_t> next{0};
+    std::mutex report_mu;
+    // 文件之间没有依赖、粒度又粗，线程做完一个就领下一个，不需要各自的队列
+    auto work = [&] {
+        for (size_t k; (k = next++) < order.size(); ) {
+            size_t i = order[k].second;
+            results[i] = run_batch_file(cmds, files[i], mem_limit);
+            if (report) {
+                std::lock_guard<std::mutex> lk(report_mu);
+                report(results[i]);
+            }
+        }
+    };
+    // 批处理线程自己等索引和搜索，这些任务在 worker_pool 里跑，所以不能占用 worker_pool 的线程
+    vector<std::thread> pool;
+    threads = std::max(1u, std::min<unsigned>(threads, files.size()));
+    for (unsigned t = 1; t < threads; ++t) pool.emplace_back(work);
+    work();
+    for (auto& t : pool) t.join();
+    return results;
+}
+
+// ---- 目录搜索 ----
+
+namespace {
+
+// .gitignore 的常用子集：# 注释、! 取反、结尾的 / 只匹配目录；含 / 的模式相对所在目录锚定，
+// 否则只和文件名比较。开头的 **/ 等同于不锚定，其余的 ** 让 * 可以跨目录。
+// 下层目录的规则优先，同一文件里后写的优先
+struct IgnoreRules {
+    struct Rule {
+        string pat;
+        bool negate = false, dir_only = false, anchored = false, deep = false;
+    };
+    shared_ptr<const IgnoreRules> parent;
+    string base;            // 所在目录相对根目录的路径，非空时以 / 结尾
+    vector<Rule> rules;
+
+    // rel 为相对根目录的路径，name 为最后一段
+    bool ignored(const string& rel, const string& name, bool is_dir) const {
+        for (const IgnoreRules* r = this; r; r = r->parent.get()) {
+            for (auto it = r->rules.rbegin(); it != r->rules.rend(); ++it) {
+                if (it->dir_only && !is_dir) continue;
+                bool hit = it->anchored
+                    ? fnmatch(it->pat.c_str(), rel.c_str() + r->base.size(), it->deep ? 0 : FNM_PATHNAME) == 0
+                    : fnmatch(it->pat.c_str(), name.c_str(), 0) == 0;
+                if (hit) return !it->negate;
+            }
+        }
+        return false;
+    }
+};
+
+// 读 dir 下的 .gitignore，接在 parent 之后；没有规则时返回 parent
+shared_ptr<const IgnoreRules> load_ignore(const string& dir, const string& rel,
+                                          shared_ptr<const IgnoreRules> parent) {
+    MappedFile f;
+    if (!f.open(dir + "/.gitignore") || f.size == 0) return parent;
+    auto r = make_shared<IgnoreRules>();
+    r->parent = parent;
+    r->base = rel.empty() ? "" : rel + "/";
+    for (const char *p = f.data, *e = f.data + f.size; p < e;) {
+        const char* nl = (const char*)memchr(p, '\n', e - p);
+        if (!nl) nl = e;
+        string line(p, nl);
+        p = nl + 1;
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        IgnoreRules::Rule rule;
+        if (line[0] == '!') {
+            rule.negate = true;
+            line.erase(0, 1);
+        }
+        if (!line.empty() && line.back() == '/') {
+            rule.dir_only = true;
+            line.pop_back();
+        }
+        if (line.compare(0, 3, "**/") == 0 && line.find('/', 3) == string::npos) line.erase(0, 3);
+        if (line.empty()) continue;
+        rule.anchored = line.find('/') != string::npos;
+        if (line[0] == '/') line.erase(0, 1);
+        rule.deep = line.find("**") != string::npos;
+        rule.pat = line;
+        r->rules.push_back(rule);
+    }
+    if (r->rules.empty()) return parent;
+    return r;
+}
+
+// 计入 pending 后交给线程池；最后一个任务结束时置 done
+void grep_submit(const shared_ptr<GrepJob>& job, std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lk(job->mu);
+        job->pending++;
+    }
+    worker_pool().submit([job, task] {
+        if (!job->cancel) task();
+        std::lock_guard<std::mutex> lk(job->mu);
+        if (--job->pending == 0) {
+            job->done = true;
+            job->cv.notify_all();
+        }
+    });
+}
+
+void grep_file(GrepJob& job, const string& path) {
+    MappedFile f;
+    if (!f.open(path) || f.size == 0) return;
+    if (memchr(f.data, 0, std::min<size_t>(f.size, 8192))) {
+        job.skipped++;
+        return;
+    }
+    vector<uint64_t> pos;
+    vector<uint32_t> lens;
+    size_t m = job.word.size();
+    if (job.re) regex_find_all(*job.re, f.data, f.size, 0, pos, lens);
+    else if (f.size >= m) find_all(f.data, f.size, job.word.data(), m, f.size - m + 1, 0, pos);
+    job.files++;
+    job.bytes += f.size;
+    if (pos.empty()) return;
+
+    // 命中升序，行号从上一个报出的行尾接着数
+    vector<GrepHit> out;
+    vector<uint64_t> nl;
+    uint64_t line = 0, ls = 0, counted = 0;
+    for (uint64_t h : pos) {
+        if (h < counted) continue;      // 同一行已报过
+        nl.clear();
+        scan_newlines(f.data + counted, h - counted, counted, nl);
+        line += nl.size();
+        if (!nl.empty()) ls = nl.back() + 1;
+        const char* le = (const char*)memchr(f.data + h, '\n', f.size - h);
+        uint64_t end = le ? le - f.data : f.size;
+        GrepHit hit;
+        hit.path = path;
+        hit.line = line;
+        hit.col = h - ls;
+        size_t n = std::min<uint64_t>(end - ls, GREP_TEXT_MAX);
+        // 不从多字节字符中间截断
+        if (n < end - ls)
+            while (n > 0 && (f.data[ls + n] & 0xC0) == 0x80) --n;
+        hit.text.assign(f.data + ls, n);
+        out.push_back(std::move(hit));
+        counted = end;
+    }
+    std::lock_guard<std::mutex> lk(job.mu);
+    size_t room = GREP_MAX_HITS - job.total_hits;
+    if (out.size() >= room) {
+        out.resize(room);
+        job.truncated = true;
+        job.cancel = true;
+    }
+    job.total_hits += out.size();
+    std::move(out.begin(), out.end(), std::back_inserter(job.hits));
+}
+
+// 读一个目录，子目录和文件各作为新任务交出去；rel 为相对根目录的路径
+void grep_dir(const shared_ptr<GrepJob>& job, const string& path, const string& rel,
+              shared_ptr<const IgnoreRules> ignore) {
+    ignore = load_ignore(path, rel, ignore);
+    DIR* d = opendir(path.c_str());
+    if (!d) return;
+    while (dirent* e = readdir(d)) {
+        if (job->cancel) break;
+        string name = e->d_name;
+        if (name[0] == '.') continue;   // 隐藏文件和目录，包括 . 和 ..
+        string p = path == "." ? name : path.back() == '/' ? path + name : path + "/" + name;
+        unsigned char type = e->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (lstat(p.c_str(), &st) != 0) continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        // 不跟符号链接，也就不会绕进环里
+        if (type != DT_DIR && type != DT_REG) continue;
+        string r = rel.empty() ? name : rel + "/" + name;
+        if (ignore && ignore->ignored(r, name, type == DT_DIR)) continue;
+        if (type == DT_DIR) grep_submit(job, [job, p, r, ignore] { grep_dir(job, p, r, ignore); });
+        else grep_submit(job, [job, p] { grep_file(*job, p); });
+    }
+    closedir(d);
+}
+
+} // namespace
+
+shared_ptr<GrepJob> start_grep(const string& root, const string& word, bool regex, string& err) {
+    struct stat st;
+    if (stat(root.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        err = root + ": not a directory";
+        return nullptr;
+    }
+    auto job = make_shared<GrepJob>();
+    job->root = root;
+    job->word = word;
+    if (regex) {
+        job->re = make_shared<Regex>();
+        if (!job->re->compile(word, err)) return nullptr;
+    }
+    grep_submit(job, [job] { grep_dir(job, job->root, "", nullptr); });
+    return job;
+}
+
+bool collect_grep(GrepJob& job, vector<GrepHit>& out) {
+    std::lock_guard<std::mutex> lk(job.mu);
+    std::move(job.hits.begin(), job.hits.end(), std::back_inserter(out));
+    job.hits.clear();
+    return job.pending == 0;
+}
+
+void cancel_grep(GrepJob& job) {
+    job.cancel = true;
+    std::unique_lock<std::mutex> lk(job.mu);
+    job.cv.wait(lk, [&] { return job.pending == 0; });
+}
@@ -0,0 +1,1857 @@
+#ifndef SEDITOR_CORE_H
+#define SEDITOR_CORE_H
+
+// 编辑器核心：文本缓冲区、行索引、搜索、保存和词法分析，不依赖 ncurses，
+// 界面（SEditor.cpp）和基准测试（SEditorBench.cpp）都基于它
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <chrono>
+#include <map>
+#include <set>
+#include <string_view>
+#include <unordered_map>
+#include <list>
+#include <cerrno>
+
+enum class LogLevel { DEBUG, INFO, WARNING, ERROR };
+
+// 编译期日志级别：低于它的 SE_LOG 连同消息的拼接一起被编译器去掉
+#ifndef SEDITOR_LOG_LEVEL
+#define SEDITOR_LOG_LEVEL 1
+#endif
+#define SE_LOG(level, msg) \
+    do { if ((int)LogLevel::level >= SEDITOR_LOG_LEVEL) WriteLog(LogLevel::level, msg); } while (0)
+
+// 写入无锁环形缓冲区后立即返回，后台线程定时写到 $SEDITOR_LOG（默认 /tmp/seditor-<uid>.log）；
+// 缓冲区满时丢弃并计数，调用方永远不会阻塞
+void WriteLog(LogLevel level, const std::string& msg);
+// 写完缓冲区中剩余的日志并停止后台线程，退出前调用
+void stop_log();
+uint64_t log_dropped();
+
+// 延迟直方图：按 2 的幂分桶（微秒），任意线程无锁记录
+class Histogram {
+public:
+    static constexpr int BUCKETS = 40;
+
+    void record(uint64_t us) {
+        int b = us ? std::min(BUCKETS - 1, 64 - __builtin_clzll(us)) : 0;
+        buckets[b].fetch_add(1, std::memory_order_relaxed);
+        n.fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(us, std::memory_order_relaxed);
+        uint64_t m = peak.load(std::memory_order_relaxed);
+        while (us > m && !peak.compare_exchange_weak(m, us, std::memory_order_relaxed)) {}
+    }
+    void record_since(std::chrono::steady_clock::time_point t0) {
+        record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count());
+    }
+    uint64_t count() const { return n.load(std::memory_order_relaxed); }
+    uint64_t max() const { return peak.load(std::memory_order_relaxed); }
+    // 分位数所在桶的上沿
+    uint64_t percentile(double p) const {
+        uint64_t want = (uint64_t)(count() * p), seen = 0;
+        for (int b = 0; b < BUCKETS; ++b) {
+            seen += buckets[b].load(std::memory_order_relaxed);
+            if (seen > want) return b ? 1ull << b : 0;
+        }
+        return max();
+    }
+    // "n=120 avg=310us p50<=256us p99<=4096us max=5230us"
+    std::string summary() const {
+        uint64_t c = count();
+        char s[128];
+        snprintf(s, sizeof(s), "n=%llu avg=%lluus p50<=%lluus p99<=%lluus max=%lluus", (unsigned long long)c,
+                 (unsigned long long)(c ? total.load() / c : 0), (unsigned long long)percentile(0.5),
+                 (unsigned long long)percentile(0.99), (unsigned long long)max());
+        return s;
+    }
+
+private:
+    std::atomic<uint64_t> buckets[BUCKETS] = {};
+    std::atomic<uint64_t> n{0}, total{0}, peak{0};
+};
+
+// 热路径计数：各处直接记录，统计浮层和退出报告读取
+struct Stats {
+    Histogram input_to_paint;   // 按键到画面刷新完成
+    Histogram draw;             // 每帧绘制和输出
+    Histogram cache_load;       // 块缓存加载一块
+    std::atomic<uint64_t> io_read_bytes{0};    // 块缓存从磁盘载入的字节
+    std::atomic<uint64_t> io_write_bytes{0};   // 保存写出的字节
+};
+Stats& stats();
+// 多行文字报告，退出时写入日志
+std::string stats_report();
+
+class KeywordSet;
+
+// 每种语言的词法规则，词法分析按表驱动
+struct LangSpec {
+    const char* ext;
+    const KeywordSet* keywords;
+    const char* line_comment;   // 行注释前缀，没有为 nullptr
+    bool block_comment;         // /* */
+    bool triple_quotes;         // Python 的 """ 和 '''
+    bool template_strings;      // JS 的 `...`，可跨行
+    bool single_quotes;         // '...' 是否为字符串
+};
+
+const LangSpec* find_lang(const std::string& ext);
+
+// 行首的词法状态：上一行留下的未闭合块注释或多行字符串
+enum HlState : uint8_t { HL_NORMAL, HL_BLOCK_COMMENT, HL_TRIPLE_DQ, HL_TRIPLE_SQ, HL_TEMPLATE };
+// 取值即颜色对编号
+enum HlKind : uint8_t { HL_KEYWORD = 1, HL_STRING = 2, HL_COMMENT = 3, HL_NUMBER = 4 };
+
+struct HlSpan {
+    uint32_t start, len;
+    uint8_t kind;
+};
+
+// 对一行做词法分析，输出着色区间，返回行尾状态
+uint8_t lex_line(const LangSpec& L, const char* s, size_t n, uint8_t state, std::vector<HlSpan>& out);
+
+// 行索引：按顺序记录缓冲区内每个 '\n' 的字节位置。
+// 每 BLOCK 个换行为一块，块首存绝对位置，其余存相对块首的偏移，按块内最大偏移的位宽紧凑排列，
+// 普通文本每行不到 2 字节；不满一块的尾部原样存放。前面的块可以直接映射旁路缓存文件
+struct LineIndex {
+    static const size_t BLOCK = 64;
+    struct Block {
+        uint64_t base;      // 块内第一个换行的位置
+        uint64_t packed;    // 偏移数组的起始位 << 7 | 位宽
+    };
+
+    const Block* mblocks = nullptr;          // 映射的前缀
+    const uint64_t* mbits = nullptr;
+    size_t nmblocks = 0, nmwords = 0;
+    std::shared_ptr<const void> mapping;     // 持有映射，最后一个引用释放时 munmap
+    std::vector<Block> blocks;
+    std::vector<uint64_t> bits;
+    uint64_t nbits = 0;                      // bits 中已用的位数
+    std::vector<uint64_t> tail;
+
+    size_t count() const { return (nmblocks + blocks.size()) * BLOCK + tail.size(); }
+    // 第 k 个换行（从 0 开始）的位置
+    uint64_t select(size_t k) const {
+        size_t b = k / BLOCK, i = k % BLOCK;
+        if (b >= nmblocks + blocks.size()) return tail[i];
+        return at(b, i);
+    }
+    // [0, pos) 内的换行数
+    size_t rank(uint64_t pos) const {
+        size_t nb = nmblocks + blocks.size();
+        if (!tail.empty() && pos > tail[0])
+            return nb * BLOCK + (std::lower_bound(tail.begin(), tail.end(), pos) - tail.begin());
+        // 先找最后一个块首 < pos 的块，再在块内二分
+        size_t lo = 0, hi = nb;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (block(mid).base < pos) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo == 0) return 0;
+        size_t b = lo - 1, l = 1, h = BLOCK;
+        while (l < h) {
+            size_t mid = (l + h) / 2;
+            if (at(b, mid) < pos) l = mid + 1;
+            else h = mid;
+        }
+        return b * BLOCK + l;
+    }
+    void push(uint64_t pos) {
+        tail.push_back(pos);
+        if (tail.size() == BLOCK) pack_tail();
+    }
+    void append(const std::vector<uint64_t>& more) {
+        for (uint64_t pos : more) push(pos);
+    }
+    void append(const LineIndex& more) {
+        for (size_t k = 0, n = more.count(); k < n; ++k) push(more.select(k));
+    }
+    void clear() { *this = LineIndex(); }
+    // 不再追加时释放数组的预留空间
+    void shrink() {
+        blocks.shrink_to_fit();
+        bits.shrink_to_fit();
+    }
+    size_t memory_bytes() const {
+        return blocks.capacity() * sizeof(Block) + (bits.capacity() + tail.capacity()) * sizeof(uint64_t);
+    }
+
+private:
+    const Block& block(size_t b) const { return b < nmblocks ? mblocks[b] : blocks[b - nmblocks]; }
+    uint64_t at(size_t b, size_t i) const {
+        const Block& blk = block(b);
+        unsigned w = blk.packed & 127;
+        if (i == 0 || w == 0) return blk.base;
+        const uint64_t* words = b < nmblocks ? mbits : bits.data();
+        uint64_t off = (blk.packed >> 7) + (i - 1) * w;
+        size_t q = off >> 6;
+        unsigned r = off & 63;
+        uint64_t v = words[q] >> r;
+        if (r + w > 64) v |= words[q + 1] << (64 - r);
+        return blk.base + (w == 64 ? v : v & ((1ull << w) - 1));
+    }
+    void pack_tail() {
+        uint64_t base = tail[0], span = tail[BLOCK - 1] - base;
+        unsigned w = span ? 64 - __builtin_clzll(span) : 0;
+        blocks.push_back(Block{base, nbits << 7 | w});
+        bits.resize((nbits + (BLOCK - 1) * w + 63) / 64, 0);
+        for (size_t i = 1; i < BLOCK; ++i, nbits += w) {
+            uint64_t v = tail[i] - base;
+            size_t q = nbits >> 6;
+            unsigned r = nbits & 63;
+            bits[q] |= v << r;
+            if (r + w > 64) bits[q + 1] |= v >> (64 - r);
+        }
+        tail.clear();
+    }
+};
+
+// 换行扫描：把 [p, p+n) 内每个 '\n' 的位置（加上 base）追加到 out，按 CPU 能力选 SIMD 实现
+void scan_newlines(const char* p, size_t n, uint64_t base, std::vector<uint64_t>& out);
+// 子串匹配：报告所有满足 i < limit 且 s[i, i+m) == needle 的 i（加上 base）
+void find_all(const char* s, size_t n, const char* needle, size_t m, size_t limit,
+              uint64_t base, std::vector<uint64_t>& out);
+
+// [p, p+n) 是否全是 ASCII，按 CPU 能力选 SIMD 实现；纯 ASCII 的文字字节偏移就是显示列
+bool is_ascii(const char* p, size_t n);
+// 解码 s[i] 起的一个字符并把 i 移到它之后；不合法的字节单独算一个 U+FFFD
+uint32_t utf8_next(const char* s, size_t n, size_t& i);
+// 终端上的显示宽度：组合字符和零宽字符为 0，东亚宽字符和全角字符为 2，其余为 1
+int char_width(uint32_t cp);
+
+// 一行里字节偏移与显示列的对应。组合字符并入前一个字符，同一字符簇的字节取相同的列，
+// 所以相邻字节列相同就属于同一个簇。纯 ASCII 的行不建表
+struct ColumnMap {
+    uint64_t len = 0;
+    std::vector<uint32_t> col;   // 非 ASCII 行：col[i] 为第 i 字节所在簇的起始列，col[len] 为行宽
+
+    void build(const char* s, size_t n);
+    uint64_t width() const { return col.empty() ? len : col.back(); }
+    uint64_t to_col(uint64_t byte) const { return col.empty() ? std::min(byte, len) : col[std::min(byte, len)]; }
+    // 覆盖第 c 列的簇的起始字节；超出行宽时为行尾
+    uint64_t to_byte(uint64_t c) const {
+        if (col.empty()) return std::min(c, len);
+        if (c >= col.back()) return len;
+        return start(std::upper_bound(col.begin(), col.begin() + len, (uint32_t)c) - col.begin() - 1);
+    }
+    // 后一个、前一个簇的起始字节
+    uint64_t next(uint64_t byte) const {
+        if (byte >= len) return len;
+        uint64_t j = byte + 1;
+        if (!col.empty()) while (j < len && col[j] == col[byte]) ++j;
+        return j;
+    }
+    uint64_t prev(uint64_t byte) const { return byte == 0 ? 0 : start(std::min(byte, len) - 1); }
+
+    // 自动换行：从第 from 列起的屏幕行之后，下一屏幕行的起始列。宽字符放不下时整个挪到下一行；
+    // 行尾总留出光标的位置，已是最后一个屏幕行时返回 UINT64_MAX
+    uint64_t wrap_next(uint64_t from, uint64_t cols) const {
+        if (from + cols > width()) return UINT64_MAX;
+        uint64_t c = to_col(to_byte(from + cols));
+        return c > from ? c : from + cols;
+    }
+    // 自动换行后占的屏幕行数
+    uint64_t wrap_rows(uint64_t cols) const {
+        if (col.empty()) return len / cols + 1;
+        uint64_t n = 1;
+        for (uint64_t s = 0; (s = wrap_next(s, cols)) != UINT64_MAX; ) ++n;
+        return n;
+    }
+    // 第 c 列在第几个屏幕行；start 返回那一屏幕行的起始列
+    uint64_t wrap_row(uint64_t c, uint64_t cols, uint64_t& start) const {
+        if (col.empty()) {
+            start = c / cols * cols;
+            return c / cols;
+        }
+        uint64_t sub = 0;
+        start = 0;
+        for (uint64_t n; (n = wrap_next(start, cols)) <= c; start = n) ++sub;
+        return sub;
+    }
+    // 第 sub 个屏幕行的起始列
+    uint64_t wrap_start(uint64_t sub, uint64_t cols) const {
+        if (col.empty()) return sub * cols;
+        uint64_t s = 0;
+        for (uint64_t n; sub > 0 && (n = wrap_next(s, cols)) != UINT64_MAX; --sub) s = n;
+        return s;
+    }
+
+private:
+    uint64_t start(uint64_t j) const {
+        if (!col.empty()) while (j > 0 && col[j - 1] == col[j]) --j;
+        return j;
+    }
+};
+
+// 正则表达式：解析成语法树，编译成 Thompson NFA，匹配时按需构造并缓存 DFA 状态。
+// 匹配按行进行（'\n' 不属于任何字符类），^ $ 为行首行尾，不回溯，单次匹配线性时间。
+struct Nfa;
+
+struct Regex {
+    std::shared_ptr<Nfa> fwd, rev;
+    std::string prefix;      // 所有匹配共有的字面前缀，用于预筛选
+
+    bool compile(const std::string& pat, std::string& err);
+};
+
+// 在 text[0, n)（由整行组成）中找出所有不重叠的非空最左最长匹配
+void regex_find_all(const Regex& re, const char* text, size_t n, uint64_t base,
+                    std::vector<uint64_t>& hits, std::vector<uint32_t>& lens);
+
+// 固定大小的后台线程池
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned n) {
+        for (unsigned i = 0; i < n; ++i)
+            workers.emplace_back([this] { run(); });
+    }
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& t : workers) t.join();
+    }
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            tasks.push_back(std::move(task));
+        }
+        cv.notify_one();
+    }
+    unsigned size() const { return workers.size(); }
+
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mu;
+    std::condition_variable cv;
+    bool stopping = false;
+
+    void run() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lk(mu);
+                cv.wait(lk, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+};
+
+ThreadPool& worker_pool();
+
+// 只读映射整个文件，作为 piece table 的原始缓冲区
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+    int fd = -1;
+    // 在文件之后多预留的地址空间（不占内存）；文件变长时 extend 原地映射新增部分，data 不变
+    uint64_t reserve = 0;
+    uint64_t span = 0;
+
+    bool open(const std::string& path) {
+        close();
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) { close(); return false; }
+        size = st.st_size;
+        span = size + reserve;
+        if (span > 0) {
+            void* p;
+            if (reserve) {
+                p = mmap(nullptr, span, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+                if (p != MAP_FAILED && size > 0 &&
+                    mmap(p, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+                    munmap(p, span);
+                    p = MAP_FAILED;
+                }
+            } else {
+                p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+            if (p == MAP_FAILED) { close(); return false; }
+            data = (const char*)p;
+        }
+        return true;
+    }
+    // 文件已长到 n：映射 [size, n)；超出预留时返回 false，只能重新打开
+    bool extend(uint64_t n) {
+        if (n <= size) return true;
+        if (n > span) return false;
+        // 原来的最后一页可能只映射了一部分，从页首重新映射
+        uint64_t page = sysconf(_SC_PAGESIZE), from = size / page * page;
+        if (mmap((char*)data + from, n - from, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, from) == MAP_FAILED)
+            return false;
+        size = n;
+        return true;
+    }
+    void swap(MappedFile& o) {
+        std::swap(data, o.data);
+        std::swap(size, o.size);
+        std::swap(fd, o.fd);
+        std::swap(reserve, o.reserve);
+        std::swap(span, o.span);
+    }
+    void close() {
+        if (data) munmap((void*)data, span);
+        if (fd >= 0) ::close(fd);
+        data = nullptr;
+        size = span = 0;
+        fd = -1;
+    }
+    ~MappedFile() { close(); }
+};
+
+// 原始文件的块缓存：把映射按固定大小分块，LRU 记录已在内存中的块。
+// 界面线程只查询不等待，缺的块交给常驻的 I/O 线程预读（madvise + 逐页触碰），
+// 淘汰的块用 MADV_DONTNEED 交还，进程常驻内存有上限
+class BlockCache {
+public:
+    static constexpr uint64_t BLOCK_SIZE = 256 << 10;
+    static constexpr size_t CAPACITY = 1024;          // 块数，约 256 MB
+    static constexpr int PREFETCH_AHEAD = 16;
+    static constexpr int PREFETCH_BEHIND = 4;
+
+    std::atomic<uint64_t> hits{0}, misses{0}, prefetched{0}, evicted{0};
+
+    BlockCache() : worker([this] { run(); }) {}
+    ~BlockCache() {
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            stopping = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    // 换了映射：清空队列和 LRU，并等正在触碰旧映射的预读结束
+    void attach(const char* d, uint64_t n) {
+        std::unique_lock<std::mutex> lk(mu);
+        idle.wait(lk, [this] { return !busy; });
+        data = d;
+        size = n;
+        queue.clear();
+        queued.clear();
+        lru.clear();
+        where.clear();
+    }
+
+    // 映射原地变长（跟随模式），已记录的块仍然有效
+    void grow(uint64_t n) {
+        std::lock_guard<std::mutex> lk(mu);
+        size = n;
+    }
+
+    // 原始文件 [a, b) 是否都在内存中；不在的块排到预读队列最前面
+    bool ready(uint64_t a, uint64_t b) {
+        if (b <= a) return true;
+        std::lock_guard<std::mutex> lk(mu);
+        bool ok = true;
+        for (uint64_t blk = a / BLOCK_SIZE; blk <= (b - 1) / BLOCK_SIZE; ++blk) {
+            auto it = where.find(blk);
+            if (it != where.end()) {
+                lru.splice(lru.begin(), lru, it->second);
+                ++hits;
+            } else if (resident(blk)) {
+                insert(blk);
+                ++hits;
+            } else {
+                ++misses;
+                ok = false;
+                enqueue(blk, true);
+            }
+        }
+        if (!ok) cv.notify_one();
+        return ok;
+    }
+
+    // 按滚动方向预读视口前后的块
+    void prefetch(uint64_t pos, int direction) {
+        std::lock_guard<std::mutex> lk(mu);
+        if (!data) return;
+        int64_t blk = pos / BLOCK_SIZE, last = (size - 1) / BLOCK_SIZE;
+        int ahead = direction >= 0 ? PREFETCH_AHEAD : PREFETCH_BEHIND;
+        int behind = direction >= 0 ? PREFETCH_BEHIND : PREFETCH_AHEAD;
+        for (int64_t b = std::max<int64_t>(0, blk - behind); b <= std::min(last, blk + ahead); ++b)
+            if (!where.count(b)) enqueue(b, false);
+        cv.notify_one();
+    }
+
+    // 还有块在排队或加载中，界面需要定时刷新
+    bool pending() {
+        std::lock_guard<std::mutex> lk(mu);
+        return busy || !queue.empty();
+    }
+
+private:
+    std::mutex mu;
+    std::condition_variable cv, idle;
+    const char* data = nullptr;
+    uint64_t size = 0;
+    std::deque<uint64_t> queue;
+    std::set<uint64_t> queued;
+    std::list<uint64_t> lru;
+    std::unordered_map<uint64_t, std::list<uint64_t>::iterator> where;
+    bool busy = false;
+    bool stopping = false;
+    std::thread worker;
+
+    uint64_t block_len(uint64_t blk) const { return std::min(BLOCK_SIZE, size - blk * BLOCK_SIZE); }
+
+    bool resident(uint64_t blk) {
+        if (!data) return true;
+        uint64_t len = block_len(blk);
+        long page = sysconf(_SC_PAGESIZE);
+        std::vector<unsigned char> vec((len + page - 1) / page);
+        if (mincore((void*)(data + blk * BLOCK_SIZE), len, vec.data()) != 0) return false;
+        return std::all_of(vec.begin(), vec.end(), [](unsigned char v) { return v & 1; });
+    }
+    void enqueue(uint64_t blk, bool urgent) {
+        if (!data || blk * BLOCK_SIZE >= size || !queued.insert(blk).second) return;
+        if (urgent) queue.push_front(blk);
+        else queue.push_back(blk);
+    }
+    void insert(uint64_t blk) {
+        if (where.count(blk)) return;
+        lru.push_front(blk);
+        where[blk] = lru.begin();
+        while (lru.size() > CAPACITY) {
+            uint64_t old = lru.back();
+            lru.pop_back();
+            where.erase(old);
+            madvise((void*)(data + old * BLOCK_SIZE), block_len(old), MADV_DONTNEED);
+            ++evicted;
+        }
+    }
+    void run() {
+        std::unique_lock<std::mutex> lk(mu);
+        while (true) {
+            cv.wait(lk, [this] { return stopping || !queue.empty(); });
+            if (stopping) return;
+            uint64_t blk = queue.front();
+            queue.pop_front();
+            queued.erase(blk);
+            if (where.count(blk)) continue;
+            const char* p = data + blk * BLOCK_SIZE;
+            uint64_t len = block_len(blk);
+            busy = true;
+            lk.unlock();
+            auto t0 = std::chrono::steady_clock::now();
+            madvise((void*)p, len, MADV_WILLNEED);
+            volatile char sink = 0;
+            for (uint64_t i = 0; i < len; i += 4096) sink = sink + p[i];
+            stats().cache_load.record_since(t0);
+            stats().io_read_bytes += len;
+            lk.lock();
+            busy = false;
+            idle.notify_all();
+            insert(blk);
+            ++prefetched;
+        }
+    }
+};
+
+// 编辑日志（swap 文件）：缓冲区的每次修改追加到文件旁的 .<name>.swp。
+// 界面线程只把记录拷进内存，后台线程攒一批再 write + fdatasync（组提交），输入从不等磁盘。
+// 每批是一个带长度和校验的帧，崩溃时写了一半的帧在重放时被丢弃。
+// 异常退出后再打开同一文件，可以把日志重放到原文件上恢复；日志过大时用文档快照替换
+class EditJournal {
+public:
+    static constexpr uint64_t FLUSH_BYTES = 1 << 20;     // 攒够这么多立即写
+    static constexpr int FLUSH_MS = 200;                 // 否则最多等这么久
+    static constexpr uint64_t COMPACT_BYTES = 64 << 20;  // 日志超过它才考虑压缩
+
+    EditJournal() : worker([this] { run(); }) {}
+    ~EditJournal();
+
+    static std::string path_for(const std::string& fname);
+    // fname 旁的日志：0 没有，1 有且与磁盘上的文件匹配，-1 有但文件已经变了
+    static int probe(const std::string& fname);
+
+    // 开始记录 fname 的修改，以磁盘上的文件为起点（日志在第一次修改时才创建）。
+    // orig_on_disk 为假表示缓冲区引用的原文件已不是磁盘上那份（刚保存过），插回原文件的片段改记文字
+    void start(const std::string& fname, bool orig_on_disk);
+    // 停止记录并删除日志：正常退出或放弃修改时调用
+    void discard();
+    bool active() const { return on; }
+
+    void record_insert(uint64_t pos, const char* s, uint64_t n);
+    void record_erase(uint64_t pos, uint64_t n);
+    // 把原文件 [start, start+len) 插回 pos，data 为这段文字
+    void record_original(uint64_t pos, uint64_t start, uint64_t len, const char* data);
+
+    // 已写到日志里的字节数超过上次检查的两倍时返回真，由调用者决定是否 compact
+    bool wants_compaction();
+    // 用 snapshot（从磁盘文件得到当前文档的一组记录）原子地替换整个日志
+    void replace(std::string snapshot);
+    bool orig_refs() const { return orig_on_disk; }
+    uint64_t size() const { return written; }
+    // 等已提交的记录落盘（测试和退出前用）
+    void sync();
+
+    struct Header;
+
+private:
+    std::mutex mu, io_mu;
+    std::condition_variable cv, flushed;
+    std::string pending, snapshot;
+    bool has_snapshot = false, stopping = false, on = false, orig_on_disk = true;
+    std::string path;
+    std::atomic<uint64_t> gen{0};
+    uint64_t base_dev = 0, base_ino = 0, base_size = 0, base_mtime = 0, base_head = 0, base_tail = 0;
+    uint64_t committed = 0, requested = 0;   // 已落盘 / 已提交的批次号
+    std::atomic<uint64_t> written{0};
+    uint64_t next_check = COMPACT_BYTES;
+    int fd = -1;
+    uint64_t fd_gen = 0;
+    std::thread worker;
+
+    void append(char type, uint64_t pos, uint64_t n, uint64_t start, const char* data);
+    void run();
+};
+
+// 原始文件在磁盘上被改了以后新旧内容的一处不同：旧文件 [old_start, old_end) 变成了新文件
+// [new_start, new_end)。各处按顺序排列，之间的部分新旧相同
+struct FileChange {
+    uint64_t old_start, old_end, new_start, new_end;
+};
+
+// piece table：原始文件（只读）+ 追加缓冲区，片段序列用 treap 维护，
+// 每个节点记录子树字节数和换行数，按偏移或行号定位都是 O(log n)
+class PieceTable {
+public:
+    struct Piece {
+        uint32_t buf;     // 0 为原始文件，其余为追加块
+        uint64_t start;   // 在所属缓冲区中的起始偏移
+        uint64_t len;
+        uint64_t lf;      // 片段内换行数
+    };
+
+    PieceTable() { reset(nullptr, 0, LineIndex()); }
+
+    EditJournal* journal = nullptr;     // 非空时每次修改都记到编辑日志里
+    // 非空时每次修改后报告行的变化：first 行被改动，其后 removed 行删去、added 行插入
+    std::function<void(size_t first, size_t removed, size_t added)> on_lines;
+
+    void reset(const char* orig, size_t orig_size, LineIndex idx) {
+        ++ver;
+        nodes.clear();
+        free_nodes.clear();
+        blocks.clear();
+        bufs.assign(1, TextBuf{orig, orig_size, std::move(idx)});
+        root = -1;
+        if (orig_size > 0)
+            root = new_node(Piece{0, 0, orig_size, bufs[0].idx.count()});
+    }
+
+    struct Segment {
+        uint64_t off;      // 在文档中的偏移
+        const char* data;
+        uint64_t len;
+    };
+
+    uint64_t length() const { return sum_len(root); }
+    // 每次插入、删除或重置都会变化
+    uint64_t version() const { return ver; }
+    size_t line_count() const { return sum_lf(root) + 1; }
+    size_t piece_count() const { return nodes.size() - free_nodes.size(); }
+    // 行索引、片段和追加缓冲区占用的内存，不含映射的原文件
+    size_t memory_bytes() const {
+        size_t n = nodes.capacity() * sizeof(Node) + free_nodes.capacity() * sizeof(int);
+        for (const TextBuf& b : bufs) n += b.idx.memory_bytes();
+        for (const AddBlock& b : blocks) n += b.cap;
+        return n;
+    }
+
+    // 第 line 行的起始偏移
+    uint64_t line_start(size_t line) const {
+        if (line == 0) return 0;
+        if (line > sum_lf(root)) return length();
+        uint64_t k = line, base = 0;
+        int t = root;
+        while (t >= 0) {
+            const Node& x = nodes[t];
+            uint64_t llf = sum_lf(x.l);
+            if (k <= llf) { t = x.l; continue; }
+            k -= llf;
+            if (k <= x.p.lf) {
+                const TextBuf& b = bufs[x.p.buf];
+                uint64_t nl = b.idx.select(b.idx.rank(x.p.start) + k - 1);
+                return base + sum_len(x.l) + (nl - x.p.start) + 1;
+            }
+            k -= x.p.lf;
+            base += sum_len(x.l) + x.p.len;
+            t = x.r;
+        }
+        return length();
+    }
+    // 第 line 行的结束偏移（不含 '\n'）
+    uint64_t line_end(size_t line) const {
+        if (line + 1 < line_count()) return line_start(line + 1) - 1;
+        return length();
+    }
+    size_t line_length(size_t line) const { return line_end(line) - line_start(line); }
+
+    // 偏移 pos 所在的行号
+    size_t line_of(uint64_t pos) const {
+        size_t line = 0;
+        int t = root;
+        while (t >= 0) {
+            const Node& x = nodes[t];
+            uint64_t llen = sum_len(x.l);
+            if (pos <= llen) { t = x.l; continue; }
+            line += sum_lf(x.l);
+            pos -= llen;
+            if (pos < x.p.len) return line + count_nl(x.p.buf, x.p.start, pos);
+            line += x.p.lf;
+            pos -= x.p.len;
+            t = x.r;
+        }
+        return line;
+    }
+
+    std::string get_line(size_t line) const {
+        uint64_t s = line_start(line);
+        return read(s, line_end(line) - s);
+    }
+    // 读到调用者的缓冲区里，复用其容量
+    void read_line(size_t line, std::string& out) const {
+        uint64_t s = line_start(line);
+        out.clear();
+        for_each_segment(s, line_end(line) - s, [&](const char* p, size_t len) { out.append(p, len); });
+    }
+
+    std::string read(uint64_t pos, uint64_t n) const {
+        std::string out;
+        out.reserve(n);
+        for_each_segment(pos, n, [&](const char* p, size_t len) { out.append(p, len); });
+        return out;
+    }
+
+    // 按顺序枚举 [pos, pos+n) 覆盖的连续内存片段
+    template <class F>
+    void for_each_segment(uint64_t pos, uint64_t n, F fn) const {
+        if (n == 0) return;
+        visit(root, 0, pos, pos + n, fn);
+    }
+
+    // 文档当前内容的快照：数据都在只追加的缓冲区中，可交给后台线程读
+    std::vector<Segment> segments() const {
+        std::vector<Segment> segs;
+        uint64_t off = 0;
+        for_each_piece([&](const Piece& p, const char* data) {
+            segs.push_back(Segment{off, data, p.len});
+            off += p.len;
+        });
+        return segs;
+    }
+
+    // 按顺序枚举全部片段及其数据起点
+    template <class F>
+    void for_each_piece(F fn) const { walk(root, fn); }
+
+    // 返回新文字在追加缓冲区里的片段，供撤销日志引用
+    Piece insert(uint64_t pos, const char* s, size_t n) {
+        if (n == 0) return Piece{0, 0, 0, 0};
+        ++ver;
+        if (journal) journal->record_insert(pos, s, n);
+        size_t first = on_lines ? line_of(pos) : 0;
+        Piece p = append_text(s, n);
+        // 连续输入时直接延长上一个片段，避免片段数随按键增长
+        if (!try_extend(root, pos, p.buf, p.start, n, p.lf)) {
+            int l, r;
+            split(root, pos, l, r);
+            root = merge(merge(l, new_node(p)), r);
+        }
+        if (on_lines) on_lines(first, 0, p.lf);
+        return p;
+    }
+
+    // 按原样插回一串片段（撤销删除、重做插入），不复制文字
+    void insert_pieces(uint64_t pos, const Piece* p, size_t k) {
+        if (k == 0) return;
+        ++ver;
+        if (journal) journal_pieces(pos, p, k);
+        size_t first = on_lines ? line_of(pos) : 0;
+        int mid = build(p, k);
+        uint64_t added = sum_lf(mid);
+        int l, r;
+        split(root, pos, l, r);
+        root = merge(merge(l, mid), r);
+        if (on_lines) on_lines(first, 0, added);
+    }
+
+    // 原始文件又有一段完成索引，接到文档末尾
+    void append_original(const LineIndex& nl, uint64_t upto) {
+        TextBuf& b = bufs[0];
+        uint64_t off = b.size, n = upto - off;
+        if (n == 0) return;
+        size_t first = line_count() - 1;
+        b.idx.append(nl);
+        b.size = upto;
+        if (!try_extend(root, length(), 0, off, n, nl.count()))
+            root = merge(root, new_node(Piece{0, off, n, nl.count()}));
+        if (on_lines) on_lines(first, 0, nl.count());
+    }
+    uint64_t original_size() const { return bufs[0].size; }
+    const LineIndex& original_index() const { return bufs[0].idx; }
+    void shrink_original_index() { bufs[0].idx.shrink(); }
+    // 把原文件 [start, start+len) 作为一个片段插入（重放编辑日志用）
+    void insert_original(uint64_t pos, uint64_t start, uint64_t len) {
+        Piece p{0, start, len, count_nl(0, start, len)};
+        insert_pieces(pos, &p, 1);
+    }
+
+    // removed 非空时按文档顺序收集被删掉的片段
+    void erase(uint64_t pos, uint64_t n, std::vector<Piece>* removed = nullptr) {
+        if (n == 0) return;
+        ++ver;
+        if (journal) journal->record_erase(pos, n);
+        size_t first = on_lines ? line_of(pos) : 0;
+        int l, m, r;
+        split(root, pos, l, m);
+        split(m, n, m, r);
+        uint64_t lf = sum_lf(m);
+        if (removed) collect(m, *removed);
+        release(m);
+        root = merge(l, r);
+        if (on_lines) on_lines(first, lf, 0);
+    }
+
+    // 把升序排列的区间 [hits[i], hits[i] + len) 全部换成 rep，len 取 lens[i]（lens 为空时取 fixed），
+    // 与前一个区间重叠的跳过。旧片段序列和命中一趟归并出新序列后整体建树，
+    // 所有替换共用追加缓冲区里的同一份 rep。old / now 返回替换前后的全部片段，供撤销；
+    // 返回实际替换的个数
+    size_t replace_ranges(const std::vector<uint64_t>& hits, const std::vector<uint32_t>& lens, uint64_t fixed,
+                          const char* rep, size_t n, std::vector<Piece>& old, std::vector<Piece>& now) {
+        old.clear();
+        now.clear();
+        collect(root, old);
+        uint64_t total = length();
+        Piece rp = append_text(rep, n);
+        size_t pi = 0, count = 0;
+        uint64_t doc = 0, cur = 0;   // old[pi] 在文档中的起点；已处理到的位置
+        auto keep = [&](uint64_t end) {
+            while (cur < end && pi < old.size()) {
+                const Piece& p = old[pi];
+                uint64_t a = cur - doc, b = std::min(end - doc, p.len);
+                Piece q{p.buf, p.start + a, b - a, p.lf};
+                if (q.len != p.len) q.lf = count_nl(q.buf, q.start, q.len);
+                now.push_back(q);
+                cur = doc + b;
+                if (b == p.len) doc += old[pi++].len;
+            }
+        };
+        for (size_t i = 0; i < hits.size(); ++i) {
+            uint64_t h = hits[i], len = lens.empty() ? fixed : lens[i];
+            if (h < cur || h + len > total) continue;
+            keep(h);
+            if (rp.len) now.push_back(rp);
+            cur = h + len;
+            while (pi < old.size() && doc + old[pi].len <= cur) doc += old[pi++].len;
+            count++;
+        }
+        keep(total);
+        if (count == 0) {
+            now = old;
+            return 0;
+        }
+        ++ver;
+        if (journal) {
+            journal->record_erase(0, total);
+            journal_pieces(0, now.data(), now.size());
+        }
+        uint64_t old_lf = sum_lf(root);
+        nodes.clear();
+        free_nodes.clear();
+        root = build(now.data(), now.size());
+        if (on_lines) on_lines(0, old_lf, sum_lf(root));
+        return count;
+    }
+
+    // 原始文件换成磁盘上的新版本 data（idx 为它的完整行索引），changes 为新旧之间的不同。
+    // 相同部分的原始片段平移到新位置；每处不同在文档中须仍是原样、连续的一段旧内容，整体换成新内容。
+    // 有编辑碰到不同之处时什么也不改，返回 false。不写编辑日志，调用者之后重写日志
+    bool rebase_original(const char* data, uint64_t size, LineIndex idx, const std::vector<FileChange>& changes) {
+        std::vector<Piece> old, now;
+        collect(root, old);
+        size_t nc = changes.size();
+        // shift[i]：前 i 处不同造成的长度差，相同部分的旧偏移加上它就是新偏移
+        std::vector<int64_t> shift(nc + 1, 0);
+        for (size_t i = 0; i < nc; ++i) {
+            const FileChange& c = changes[i];
+            shift[i + 1] = shift[i] + (int64_t)(c.new_end - c.new_start) - (int64_t)(c.old_end - c.old_start);
+        }
+        std::vector<bool> placed(nc, false);
+        std::vector<uint64_t> reached(nc, 0);    // 正在拼接的那处不同已连续保留到的旧偏移
+        long chain = -1;
+        auto put_new = [&](size_t i) {
+            const FileChange& c = changes[i];
+            if (c.new_end > c.new_start) now.push_back(Piece{0, c.new_start, c.new_end - c.new_start, 0});
+            placed[i] = true;
+        };
+        // 旧文件里长度为 0 的不同（纯插入）放在文档中第一次经过该旧偏移的地方
+        auto put_inserts_at = [&](uint64_t x) {
+            size_t i = std::lower_bound(changes.begin(), changes.end(), x,
+                [](const FileChange& c, uint64_t v) { return c.old_start < v; }) - changes.begin();
+            for (; i < nc && changes[i].old_start == x && changes[i].old_end == x; ++i)
+                if (!placed[i]) put_new(i);
+        };
+        // 旧文件是空的：新内容放在文档开头
+        if (bufs[0].size == 0)
+            for (size_t i = 0; i < nc; ++i) put_new(i);
+        for (const Piece& p : old) {
+            if (p.buf != 0) {
+                if (chain >= 0) return false;
+                now.push_back(p);
+                continue;
+            }
+            uint64_t x = p.start, e = p.start + p.len;
+            while (x < e) {
+                size_t i = std::upper_bound(changes.begin(), changes.end(), x,
+                    [](uint64_t v, const FileChange& c) { return v < c.old_end; }) - changes.begin();
+                if (i == nc || changes[i].old_start > x) {
+                    uint64_t y = i == nc ? e : std::min(e, changes[i].old_start);
+                    if (chain >= 0) return false;
+                    put_inserts_at(x);
+                    now.push_back(Piece{0, (uint64_t)(x + shift[i]), y - x, 0});
+                    x = y;
+                    put_inserts_at(x);
+                    continue;
+                }
+                const FileChange& c = changes[i];
+                uint64_t y = std::min(e, c.old_end);
+                if (x == c.old_start) {
+                    if (chain >= 0 || placed[i]) return false;
+                    chain = i;
+                } else if (chain != (long)i || reached[i] != x) {
+                    return false;
+                }
+                reached[i] = y;
+                if (y == c.old_end) {
+                    put_new(i);
+                    chain = -1;
+                }
+                x = y;
+            }
+        }
+        if (chain >= 0) return false;
+        for (size_t i = 0; i < nc; ++i)
+            if (!placed[i]) return false;
+
+        ++ver;
+        uint64_t old_lf = sum_lf(root);
+        bufs[0] = TextBuf{data, size, std::move(idx)};
+        for (auto& p : now)
+            if (p.buf == 0) p.lf = count_nl(0, p.start, p.len);
+        nodes.clear();
+        free_nodes.clear();
+        root = build(now.data(), now.size());
+        if (on_lines) on_lines(0, old_lf, sum_lf(root));
+        return true;
+    }
+
+private:
+    static constexpr size_t ADD_BLOCK_SIZE = 1 << 20;
+
+    struct TextBuf {
+        const char* data;
+        uint64_t size;
+        LineIndex idx;
+    };
+    struct AddBlock {
+        std::unique_ptr<char[]> mem;
+        size_t cap;
+    };
+    struct Node {
+        Piece p;
+        uint32_t prio;
+        int l, r;
+        uint64_t len, lf;   // 子树汇总
+    };
+
+    std::vector<Node> nodes;
+    std::vector<int> free_nodes;
+    std::vector<TextBuf> bufs;
+    std::vector<AddBlock> blocks;
+    int root = -1;
+    uint64_t ver = 0;
+    uint32_t seed = 2463534242u;
+
+    uint64_t sum_len(int t) const { return t < 0 ? 0 : nodes[t].len; }
+    uint64_t sum_lf(int t) const { return t < 0 ? 0 : nodes[t].lf; }
+    uint64_t count_nl(uint32_t buf, uint64_t start, uint64_t len) const {
+        const LineIndex& idx = bufs[buf].idx;
+        return idx.rank(start + len) - idx.rank(start);
+    }
+    void update(int t) {
+        Node& x = nodes[t];
+        x.len = sum_len(x.l) + x.p.len + sum_len(x.r);
+        x.lf = sum_lf(x.l) + x.p.lf + sum_lf(x.r);
+    }
+    int new_node(const Piece& p) {
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+        Node x{p, seed, -1, -1, p.len, p.lf};
+        if (!free_nodes.empty()) {
+            int t = free_nodes.back();
+            free_nodes.pop_back();
+            nodes[t] = x;
+            return t;
+        }
+        nodes.push_back(x);
+        return nodes.size() - 1;
+    }
+    // 文字追加到当前追加块（放不下就开新块），返回对应的片段
+    Piece append_text(const char* s, size_t n) {
+        if (n == 0) return Piece{0, 0, 0, 0};
+        if (blocks.empty() || bufs.back().size + n > blocks.back().cap) {
+            size_t cap = std::max(ADD_BLOCK_SIZE, n);
+            blocks.push_back(AddBlock{std::unique_ptr<char[]>(new char[cap]), cap});
+            bufs.push_back(TextBuf{blocks.back().mem.get(), 0, LineIndex()});
+        }
+        uint32_t id = bufs.size() - 1;
+        TextBuf& b = bufs[id];
+        uint64_t off = b.size;
+        memcpy(blocks.back().mem.get() + off, s, n);
+        uint64_t lf = 0;
+        for (const char* q = s; (q = (const char*)memchr(q, '\n', s + n - q)); ++q, ++lf)
+            b.idx.push(off + (q - s));
+        b.size += n;
+        return Piece{id, off, n, lf};
+    }
+    void journal_pieces(uint64_t pos, const Piece* p, size_t k) {
+        for (size_t i = 0; i < k; pos += p[i++].len) {
+            const char* data = bufs[p[i].buf].data + p[i].start;
+            if (p[i].buf == 0) journal->record_original(pos, p[i].start, p[i].len, data);
+            else journal->record_insert(pos, data, p[i].len);
+        }
+    }
+    // 按顺序把 k 个片段建成一棵树：单调栈 O(k)，比逐个 merge 少一个 log
+    int build(const Piece* p, size_t k) {
+        std::vector<int> st;
+        for (size_t i = 0; i < k; ++i) {
+            int t = new_node(p[i]), last = -1;
+            while (!st.empty() && nodes[st.back()].prio < nodes[t].prio) {
+                last = st.back();
+                st.pop_back();
+            }
+            nodes[t].l = last;
+            if (!st.empty()) nodes[st.back()].r = t;
+            st.push_back(t);
+        }
+        if (st.empty()) return -1;
+        // 汇总值要等结构定下来后自底向上算：按层序收集，倒序更新
+        std::vector<int> order{st[0]};
+        for (size_t i = 0; i < order.size(); ++i) {
+            const Node& x = nodes[order[i]];
+            if (x.l >= 0) order.push_back(x.l);
+            if (x.r >= 0) order.push_back(x.r);
+        }
+        for (size_t i = order.size(); i-- > 0;) update(order[i]);
+        return st[0];
+    }
+    void collect(int t, std::vector<Piece>& out) const {
+        if (t < 0) return;
+        collect(nodes[t].l, out);
+        out.push_back(nodes[t].p);
+        collect(nodes[t].r, out);
+    }
+    void release(int t) {
+        if (t < 0) return;
+        release(nodes[t].l);
+        release(nodes[t].r);
+        free_nodes.push_back(t);
+    }
+    int merge(int a, int b) {
+        if (a < 0) return b;
+        if (b < 0) return a;
+        if (nodes[a].prio > nodes[b].prio) {
+            nodes[a].r = merge(nodes[a].r, b);
+            update(a);
+            return a;
+        }
+        nodes[b].l = merge(a, nodes[b].l);
+        update(b);
+        return b;
+    }
+    // 按字节偏移切分，必要时把一个片段拆成两半
+    void split(int t, uint64_t pos, int& l, int& r) {
+        if (t < 0) { l = r = -1; return; }
+        Node& x = nodes[t];
+        uint64_t llen = sum_len(x.l);
+        if (pos <= llen) {
+            int a;
+            split(x.l, pos, l, a);
+            nodes[t].l = a;
+            update(t);
+            r = t;
+        } else if (pos >= llen + x.p.len) {
+            int b;
+            split(x.r, pos - llen - x.p.len, b, r);
+            nodes[t].r = b;
+            update(t);
+            l = t;
+        } else {
+            uint64_t off = pos - llen;
+            Piece right{x.p.buf, x.p.start + off, x.p.len - off, 0};
+            right.lf = count_nl(right.buf, right.start, right.len);
+            int rr = x.r;
+            nodes[t].p.len = off;
+            nodes[t].p.lf -= right.lf;
+            nodes[t].r = -1;
+            update(t);
+            l = t;
+            int n = new_node(right);   // 可能使 nodes 扩容，之后不能再用 x
+            r = merge(n, rr);
+        }
+    }
+    bool try_extend(int t, uint64_t pos, uint32_t buf, uint64_t off, uint64_t n, uint64_t lf) {
+        if (t < 0 || pos == 0) return false;
+        Node& x = nodes[t];
+        uint64_t llen = sum_len(x.l);
+        bool ok;
+        if (pos <= llen) {
+            ok = try_extend(x.l, pos, buf, off, n, lf);
+        } else if (pos == llen + x.p.len) {
+            ok = x.p.buf == buf && x.p.start + x.p.len == off;
+            if (ok) { x.p.len += n; x.p.lf += lf; }
+        } else if (pos > llen + x.p.len) {
+            ok = try_extend(x.r, pos - llen - x.p.len, buf, off, n, lf);
+        } else {
+            ok = false;
+        }
+        if (ok) { nodes[t].len += n; nodes[t].lf += lf; }
+        return ok;
+    }
+    template <class F>
+    void walk(int t, F& fn) const {
+        if (t < 0) return;
+        const Node& x = nodes[t];
+        walk(x.l, fn);
+        fn(x.p, bufs[x.p.buf].data + x.p.start);
+        walk(x.r, fn);
+    }
+    template <class F>
+    void visit(int t, uint64_t base, uint64_t a, uint64_t b, F& fn) const {
+        if (t < 0) return;
+        const Node& x = nodes[t];
+        uint64_t ps = base + sum_len(x.l), pe = ps + x.p.len;
+        if (a < ps) visit(x.l, base, a, b, fn);
+        if (a < pe && b > ps) {
+            uint64_t s = std::max(a, ps), e = std::min(b, pe);
+            fn(bufs[x.p.buf].data + x.p.start + (s - ps), (size_t)(e - s));
+        }
+        if (b > pe) visit(x.r, pe, a, b, fn);
+    }
+};
+
+// 撤销日志：只记位置和片段引用。piece table 的缓冲区只追加不回收，
+// 被删的文字仍在原处，所以撤销/重做一次编辑只是把片段插回或切掉，
+// 代价和编辑大小有关，与文件大小无关
+class UndoLog {
+public:
+    using Piece = PieceTable::Piece;
+
+    void set_limit(size_t bytes) { limit = std::max<size_t>(bytes, 4096); trim(); }
+    size_t memory() const { return (done.size() + undone.size()) * sizeof(Op) + arena.size() * sizeof(Piece); }
+    // 光标移动、保存等之后调用，下一次输入另起一组
+    void boundary() { open = false; }
+    void clear() { done.clear(); undone.clear(); arena.clear(); nlive = 0; open = false; }
+
+    void record_insert(uint64_t pos, const Piece& p, uint64_t cursor) {
+        if (p.len == 0) return;
+        begin();
+        if (!done.empty() && open && fresh()) {
+            Op& o = done.back();
+            Piece& q = arena[o.first + o.count - 1];
+            // 连续输入且在追加缓冲区里也连续，直接并入上一条
+            if (o.insert && p.lf == 0 && pos == o.pos + o.len &&
+                q.buf == p.buf && q.start + q.len == p.start) {
+                q.len += p.len;
+                o.len += p.len;
+                stamp();
+                return;
+            }
+        }
+        bool join = !done.empty() && open && fresh() && p.lf == 0 &&
+                    done.back().insert && pos == done.back().pos + done.back().len;
+        arena.push_back(p);
+        push(Op{pos, p.len, cursor, (uint32_t)arena.size() - 1, 1, join ? group : ++group, true});
+        open = p.lf == 0;   // 回车单独成组
+    }
+
+    void record_erase(uint64_t pos, uint64_t len, const std::vector<Piece>& removed, uint64_t cursor) {
+        if (len == 0) return;
+        begin();
+        bool lf = false;
+        for (auto& p : removed) lf |= p.lf > 0;
+        bool join = false;
+        if (!done.empty() && open && fresh() && !lf && !done.back().insert) {
+            const Op& o = done.back();
+            join = pos + len == o.pos || pos == o.pos;   // 连续退格或连续向后删
+        }
+        // 先放进 arena 再登记：push 里的整理会按 Op 读取 arena
+        arena.insert(arena.end(), removed.begin(), removed.end());
+        push(Op{pos, len, cursor, (uint32_t)(arena.size() - removed.size()), (uint32_t)removed.size(),
+                join ? group : ++group, false});
+        open = !lf;
+    }
+
+    // 整体替换文档（全部替换）：删掉旧的全部片段、插回新的全部片段，作为一组
+    void record_replace(const std::vector<Piece>& old, uint64_t old_len, const std::vector<Piece>& now, uint64_t new_len,
+                        uint64_t cursor) {
+        begin();
+        ++group;
+        uint32_t first = arena.size();
+        arena.insert(arena.end(), old.begin(), old.end());
+        arena.insert(arena.end(), now.begin(), now.end());
+        done.push_back(Op{0, old_len, cursor, first, (uint32_t)old.size(), group, false});
+        done.push_back(Op{0, new_len, cursor, first + (uint32_t)old.size(), (uint32_t)now.size(), group, true});
+        nlive += old.size() + now.size();
+        stamp();
+        trim();
+        open = false;
+    }
+
+    // 撤销最近一组，cursor 返回组开始前的光标位置
+    bool undo(PieceTable& buf, uint64_t& cursor) {
+        if (done.empty()) return false;
+        uint32_t g = done.back().group;
+        while (!done.empty() && done.back().group == g) {
+            const Op& o = done.back();
+            if (o.insert) buf.erase(o.pos, o.len);
+            else buf.insert_pieces(o.pos, &arena[o.first], o.count);
+            cursor = o.cursor;
+            undone.push_back(o);
+            done.pop_back();
+        }
+        open = false;
+        return true;
+    }
+
+    // 重做最近撤销的一组，cursor 返回组内最后一次编辑之后的位置
+    bool redo(PieceTable& buf, uint64_t& cursor) {
+        if (undone.empty()) return false;
+        uint32_t g = undone.back().group;
+        while (!undone.empty() && undone.back().group == g) {
+            const Op& o = undone.back();
+            if (o.insert) {
+                buf.insert_pieces(o.pos, &arena[o.first], o.count);
+                cursor = o.pos + o.len;
+            } else {
+                buf.erase(o.pos, o.len);
+                cursor = o.pos;
+            }
+            done.push_back(o);
+            undone.pop_back();
+        }
+        open = false;
+        return true;
+    }
+
+private:
+    struct Op {
+        uint64_t pos, len;
+        uint64_t cursor;        // 编辑前的光标偏移
+        uint32_t first, count;  // 在 arena 中的片段
+        uint32_t group;
+        bool insert;
+    };
+
+    static constexpr int COALESCE_MS = 1000;
+
+    std::vector<Op> done, undone;
+    std::vector<Piece> arena;
+    size_t limit = 64u << 20;
+    size_t nlive = 0;       // arena 中仍被引用的片段数
+    uint32_t group = 0;
+    bool open = false;
+    std::chrono::steady_clock::time_point last;
+
+    bool fresh() const {
+        return std::chrono::steady_clock::now() - last < std::chrono::milliseconds(COALESCE_MS);
+    }
+    void stamp() { last = std::chrono::steady_clock::now(); }
+    // 新编辑让重做分支失效
+    void begin() {
+        if (!undone.empty()) {
+            for (auto& o : undone) nlive -= o.count;
+            undone.clear();
+            open = false;
+        }
+    }
+    void push(const Op& o) {
+        done.push_back(o);
+        nlive += o.count;
+        stamp();
+        trim();
+    }
+    // 超出上限时整组丢掉最老的历史，降到上限的四分之三再整理 arena
+    void trim() {
+        if (memory() <= limit && arena.size() < 2 * nlive + 4096) return;
+        size_t target = limit / 4 * 3, drop = 0;
+        size_t mem = memory();
+        if (mem <= limit) target = mem;   // 只是整理 arena 里的垃圾
+        while (drop < done.size() && mem > target) {
+            uint32_t g = done[drop].group;
+            while (drop < done.size() && done[drop].group == g) {
+                mem -= sizeof(Op) + done[drop].count * sizeof(Piece);
+                nlive -= done[drop].count;
+                drop++;
+            }
+        }
+        done.erase(done.begin(), done.begin() + drop);
+        std::vector<Piece> compact;
+        compact.reserve(nlive);
+        for (auto* ops : {&done, &undone})
+            for (Op& o : *ops) {
+                uint32_t first = compact.size();
+                compact.insert(compact.end(), arena.begin() + o.first, arena.begin() + o.first + o.count);
+                o.first = first;
+            }
+        arena.swap(compact);
+    }
+};
+
+// 折叠：每段从 start 行起，隐藏 (start, end] 行。各段互不重叠，外层折叠吞掉其中的内层
+class FoldSet {
+public:
+    bool empty() const { return spans.empty(); }
+    size_t size() const { return spans.size(); }
+    void clear() { spans.clear(); }
+
+    void add(int start, int end) {
+        if (end <= start || visible(start) != start) return;
+        for (auto it = spans.lower_bound(start); it != spans.end() && it->first <= end; )
+            it = spans.erase(it);
+        spans[start] = end;
+    }
+    bool remove(int start) { return spans.erase(start) > 0; }
+    bool folded(int line) const { return spans.count(line) > 0; }
+
+    // 从 line 开始的这一屏行覆盖到的最后一行
+    int last(int line) const {
+        auto it = spans.find(line);
+        return it == spans.end() ? line : it->second;
+    }
+    // line 被隐藏时返回所在折叠的起始行，否则返回它自己
+    int visible(int line) const {
+        auto it = spans.upper_bound(line);
+        if (it == spans.begin()) return line;
+        --it;
+        return line <= it->second ? it->first : line;
+    }
+    int next(int line) const { return last(line) + 1; }
+    int prev(int line) const { return line > 0 ? visible(line - 1) : 0; }
+    // 跟着文档改动移动：first 行被改动，其后 removed 行删去、added 行插入。
+    // 改动在折叠之后的不动，在之前的整体平移，落在折叠起始行或隐藏部分里的伸缩，只切到一部分的丢掉
+    void lines_changed(int first, int removed, int added) {
+        if (spans.empty() || spans.rbegin()->second < first) return;
+        int delta = added - removed, last = first + removed;
+        std::map<int, int> out;
+        for (auto& sp : spans) {
+            if (sp.second < first) out.insert(sp);
+            else if (sp.first > last) out.emplace(sp.first + delta, sp.second + delta);
+            else if (sp.first <= first && sp.second >= last && sp.second + delta > sp.first)
+                out.emplace(sp.first, sp.second + delta);
+        }
+        spans.swap(out);
+    }
+    // [a, b) 中被隐藏的行数
+    int hidden(int a, int b) const {
+        int n = 0;
+        for (auto it = spans.lower_bound(a); it != spans.end() && it->first < b; ++it)
+            n += std::min(it->second, b - 1) - it->first;
+        return n;
+    }
+
+private:
+    std::map<int, int> spans;
+};
+
+// 增量高亮缓存：按行记录内容哈希、入口状态、出口状态和着色区间，
+// 只有内容或入口状态变了的行才重新分析
+struct HlLine {
+    uint64_t hash = 0;
+    uint64_t version = ~0ull;   // 上次确认时的文档版本，没变过就不用再算哈希
+    uint8_t in = 0, out = 0;
+    bool valid = false;
+    std::vector<HlSpan> spans;
+};
+
+class Highlighter {
+public:
+    // 可见区域之上最多回溯这么多行来推出入口状态
+    static constexpr int SYNC_LINES = 300;
+    // 超过这个长度的行不整行分析，只由绘制代码分析可见切片，跨行状态按不变处理
+    static constexpr uint64_t LONG_LINE = 64 << 10;
+
+    void set_lang(const LangSpec* l) {
+        if (l != lang) {
+            lang = l;
+            lines.clear();
+        }
+    }
+    const LangSpec* language() const { return lang; }
+
+    const HlLine& get(const PieceTable& buf, int row, uint8_t in) {
+        HlLine& e = lines[row];
+        if (e.valid && e.version == buf.version() && e.in == in) return e;
+        if (buf.line_length(row) > LONG_LINE) {
+            e.spans.clear();
+            e.out = e.in = in;
+            e.hash = 0;
+            e.valid = true;
+            e.version = buf.version();
+            return e;
+        }
+        buf.read_line(row, text);
+        uint64_t h = std::hash<std::string_view>()(text);
+        if (!e.valid || e.hash != h || e.in != in) {
+            e.spans.clear();
+            e.out = lex_line(*lang, text.data(), text.size(), in, e.spans);
+            e.hash = h;
+            e.in = in;
+            e.valid = true;
+            ++relexed;
+        }
+        e.version = buf.version();
+        return e;
+    }
+    // row 行开头的词法状态：从同步点开始沿缓存链推导
+    uint8_t state_before(const PieceTable& buf, int row) {
+        uint8_t st = HL_NORMAL;
+        for (int r = std::max(0, row - SYNC_LINES); r < row; ++r) st = get(buf, r, st).out;
+        return st;
+    }
+    // 丢掉远离可见区域的缓存行，内存有界
+    void trim(int top, int bottom) {
+        if (lines.size() < 8192) return;
+        for (auto it = lines.begin(); it != lines.end();) {
+            if (it->first < top - SYNC_LINES || it->first > bottom + SYNC_LINES) it = lines.erase(it);
+            else ++it;
+        }
+    }
+    size_t relexed = 0;   // 重新分析过的行数，用于观察增量效果
+
+private:
+    const LangSpec* lang = nullptr;
+    std::unordered_map<int, HlLine> lines;
+    std::string text;
+};
+
+// 可见行的列映射缓存：文档版本变了先用 SIMD 检查是否仍是纯 ASCII，内容没变不重建。
+// 超长行不建表，字节偏移直接当列用，和 Highlighter 一样只处理可见切片
+class ColumnCache {
+public:
+    const ColumnMap& get(const PieceTable& buf, int row);
+    // 丢掉远离可见区域的缓存行
+    void trim(int top, int bottom);
+
+private:
+    struct Entry {
+        uint64_t version = ~0ull;
+        uint64_t hash = 0;
+        ColumnMap map;
+    };
+    std::unordered_map<int, Entry> lines;
+    std::string text;
+};
+
+// 代码块索引：每行记下行首/行尾词法状态、去掉字符串和注释后行内未配对的右括号和左括号数，
+// 以及缩进，每 CHUNK 行汇总一次。改动只把受影响的行标为过期，之后按时间片重新分析，
+// 行尾状态变了才继续往下传。括号配对跨过整块时只看汇总
+class BlockIndex {
+public:
+    static constexpr uint16_t BLANK = UINT16_MAX;   // 空行、纯注释行和多行字符串内部，不参与缩进块
+    static constexpr size_t CHUNK = 1024;
+    static constexpr size_t MAX_LINES = 4 << 20;    // 更长的文件不建索引
+
+    void reset(const LangSpec* l, size_t lines);
+    const LangSpec* language() const { return lang; }
+    bool too_large() const { return oversize; }
+    void lines_changed(size_t first, size_t removed, size_t added);
+    // 重新分析过期的行，最多花 budget；全部最新时返回 true
+    bool refresh(const PieceTable& buf, std::chrono::milliseconds budget);
+    bool ready() const { return lang && nstale == 0; }
+    size_t pending() const { return nstale; }
+    size_t lines() const { return nlines; }
+
+    // pos 是代码中的括号（不在字符串和注释里）时返回 true，other 为配对括号，未配对为 UINT64_MAX
+    bool match(const PieceTable& buf, uint64_t pos, uint64_t& other) const;
+    // 包住 pos 的最内层括号对
+    bool enclosing(const PieceTable& buf, uint64_t pos, uint64_t& o, uint64_t& c) const;
+    // 缩进块：line 之后缩进更深的行都属于它，end 为最后一个非空行；不是块头返回 false
+    bool indent_block(size_t line, size_t& end) const;
+    // 包住 line 的缩进块的块头
+    bool indent_parent(size_t line, size_t& head) const;
+    size_t memory_bytes() const;
+
+private:
+    struct LineInfo {
+        uint32_t close = 0, open = 0;
+        uint16_t indent = BLANK;
+        uint8_t in = 0, out = 0;
+        bool stale = true;
+    };
+    struct Chunk {
+        std::vector<LineInfo> lines;
+        size_t nstale = 0;
+        uint32_t close = 0, open = 0;   // 整块化简后的括号
+        uint16_t min_indent = BLANK;
+        bool dirty = true;              // 汇总需要重算
+    };
+    struct Loc {
+        size_t chunk, off, first;       // 所在块、块内序号、块首行号
+    };
+
+    const LangSpec* lang = nullptr;
+    bool oversize = false;
+    std::vector<Chunk> chunks;
+    std::vector<size_t> firsts;         // 各块块首行号，locate 在上面二分
+    size_t nlines = 0, nstale = 0;
+
+    Loc locate(size_t line) const;
+    void renumber(size_t from);
+    const LineInfo& info(size_t line) const {
+        Loc at = locate(line);
+        return chunks[at.chunk].lines[at.off];
+    }
+    void mark_stale(Chunk& ch, LineInfo& e);
+    void erase_lines(size_t line, size_t n);
+    void insert_lines(size_t line, size_t n);
+    void analyze(const PieceTable& buf, size_t line, uint8_t in, LineInfo& e, std::string& text, std::vector<HlSpan>& spans) const;
+    void brackets(const PieceTable& buf, size_t line, std::vector<std::pair<uint32_t, char>>& out) const;
+    bool find_forward(size_t from, uint64_t& d, size_t& line) const;
+    bool find_backward(size_t from, uint64_t& d, size_t& line) const;
+};
+
+class IndexSidecar;
+
+// 后台换行索引任务：各块并行扫描，由界面线程按顺序发布到 buf
+struct IndexJob {
+    std::mutex mu;
+    std::condition_variable cv;
+    std::vector<uint64_t> bounds;       // 第 i 块为 [bounds[i], bounds[i+1])
+    std::vector<LineIndex> results;
+    std::vector<char> done;
+    size_t next = 0;                    // 下一个待发布的块
+    size_t pending = 0;                 // 尚未扫描完的块
+    std::atomic<bool> cancel{false};
+    std::shared_ptr<IndexSidecar> sidecar;
+};
+
+// 命中在全文的分布：文档按偏移均分成 BUCKETS 段，搜索线程每扫完一块就把计数加进去，
+// 内存与文档大小和命中数无关
+struct HitDensity {
+    static constexpr size_t BUCKETS = 1024;
+    uint64_t total = 0;                             // 搜索时的文档长度
+    std::atomic<uint32_t> count[BUCKETS] = {};
+
+    size_t bucket(uint64_t pos) const { return total ? std::min<uint64_t>(pos * BUCKETS / total, BUCKETS - 1) : 0; }
+    // 桶 [a, b) 的命中数
+    uint64_t sum(size_t a, size_t b) const {
+        uint64_t n = 0;
+        for (; a < b; ++a) n += count[a].load(std::memory_order_relaxed);
+        return n;
+    }
+};
+
+// 后台全文搜索任务：文档按块并行匹配，结果由界面线程按顺序合并
+struct SearchJob {
+    std::mutex mu;
+    std::string word;
+    std::shared_ptr<Regex> re;                    // 非空为正则搜索
+    uint64_t version;                             // 启动时的文档版本
+    std::vector<PieceTable::Segment> segs;
+    uint64_t total;
+    std::vector<uint64_t> bounds;
+    std::vector<std::vector<uint64_t>> hits;
+    std::vector<std::vector<uint32_t>> lens;      // 正则命中的长度
+    std::vector<char> done;
+    size_t next = 0;
+    size_t pending = 0;
+    std::condition_variable cv;
+    std::atomic<uint64_t> scanned{0};
+    std::atomic<bool> cancel{false};
+    std::shared_ptr<HitDensity> density = std::make_shared<HitDensity>();
+};
+
+const uint64_t SEARCH_CHUNK = 8 << 20;
+
+// JSON 结构索引：不建 DOM，只记跨度不小于 MIN_SPAN 的对象/数组的首尾括号偏移，
+// 以及每 CHECKPOINT 字节处的扫描状态。更小的容器从最近的检查点现场扫描，代价有上界
+struct JsonIndex {
+    static constexpr uint64_t MIN_SPAN = 4096;
+    static constexpr uint64_t CHECKPOINT = 4096;
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    uint64_t version = 0;                // 建索引时的文档版本
+    uint64_t total = 0;
+    std::vector<uint64_t> open, close;   // 大容器，按 open 升序
+    std::vector<uint32_t> parent;        // 外层大容器的下标
+    std::vector<uint32_t> by_close;      // 按 close 升序的下标
+    std::vector<uint8_t> state;          // 每个检查点：bit0 在字符串内，bit1 该字节被转义
+
+    // pos 是字符串外的括号时返回 true，other 为配对括号的偏移（未闭合时为 UINT64_MAX）
+    bool match(const PieceTable& buf, uint64_t pos, uint64_t& other) const;
+    // 包含 pos 的最内层容器；pos 在结构括号上时就是这对括号
+    bool enclosing(const PieceTable& buf, uint64_t pos, uint64_t& o, uint64_t& c) const;
+    // 路径形如 a.b[3]["c d"]，可带前导 $；找到时 pos 为值的第一个字节
+    bool find_path(const PieceTable& buf, const std::string& path, uint64_t& pos, std::string& err) const;
+    size_t memory_bytes() const {
+        return (open.size() + close.size()) * 8 + (parent.size() + by_close.size()) * 4 + state.size();
+    }
+};
+
+// 后台建立 JsonIndex：各块先并行算出引号奇偶，再带着正确的起始状态并行配对括号，
+// 最后按顺序把各块剩下的未配对括号接起来
+struct JsonIndexJob {
+    std::mutex mu;
+    std::vector<PieceTable::Segment> segs;
+    std::vector<uint64_t> bounds;
+    std::vector<uint8_t> carry;                 // 每块结束时的状态（假设块首不在字符串内）
+    std::vector<std::vector<std::pair<uint64_t, uint64_t>>> pairs;
+    std::vector<std::vector<uint64_t>> lone_close, lone_open;
+    std::shared_ptr<JsonIndex> index;
+    size_t pending = 0;
+    std::condition_variable cv;
+    std::atomic<uint64_t> scanned{0};           // 两趟合计，满值为 2 * total
+    std::atomic<bool> cancel{false};
+    std::atomic<bool> done{false};
+};
+
+const uint64_t FIRST_INDEX_CHUNK = 1 << 20;   // 首屏同步索引的大小
+const uint64_t INDEX_CHUNK = 16 << 20;
+
+// 行索引旁路缓存：大文件的压缩行索引存到 $XDG_CACHE_HOME/seditor/ 下，
+// 以路径、设备号、inode、大小、mtime 和首尾各 64 KB 的指纹为键。
+// 重开时 O(1) 校验后直接映射；文件只是变长了就从旧的末尾接着索引，完成后整份重写
+class IndexSidecar : public std::enable_shared_from_this<IndexSidecar> {
+public:
+    static constexpr uint64_t MIN_FILE_SIZE = 16 << 20;   // 更小的文件直接扫描更快
+
+    // 校验通过时 idx 映射缓存中的索引，indexed 为其覆盖的文件长度
+    static bool load(const std::string& fname, const MappedFile& file, LineIndex& idx, uint64_t& indexed);
+    // 记下文件当前的身份，索引完成后交给 finish；不需要缓存时返回空
+    static std::shared_ptr<IndexSidecar> open(const std::string& fname, const MappedFile& file);
+
+    // 索引已覆盖整个文件：复制一份，在线程池中写出
+    void finish(const LineIndex& idx);
+    // 等缓存写完（或放弃），返回是否已生效
+    bool wait();
+
+private:
+    struct Header;
+    static bool valid(int fd, const MappedFile& file, uint64_t path_hash, Header& h);
+    std::string path;
+    uint64_t dev = 0, ino = 0, size = 0, mtime = 0, path_hash = 0, head_hash = 0, tail_hash = 0;
+    std::mutex mu;
+    std::condition_variable cv;
+    bool done = false, committed = false;
+};
+
+// 跟随模式：inotify 监视文件本身和所在目录，区分追加、截断和轮转（改名或删除后同名新建）。
+// 只在有事件时读一次 fstat，不读文件内容
+class FileWatcher {
+public:
+    enum Change { NONE, GREW, TRUNCATED, ROTATED };
+
+    ~FileWatcher() { stop(); }
+    // file_fd 为已打开的文件，监视期间由调用者保持打开
+    bool start(const std::string& path, int file_fd);
+    void stop();
+    bool active() const { return ifd >= 0; }
+    // 可读表示有新事件，供 poll 使用
+    int fd() const { return ifd; }
+    // 读掉已到的事件，把文件当前长度和已知的 size 比较
+    Change check(uint64_t size, uint64_t& new_size);
+
+private:
+    int ifd = -1, file_wd = -1, dir_wd = -1, file_fd = -1;
+    std::string path, name;
+    uint64_t dev = 0, ino = 0;
+    bool moved = false;     // 原文件被改名或删除，等同名新文件出现
+};
+
+// 外部修改检测。先只比较文件身份（设备号、inode、大小、mtime），一次 stat；
+// 变了再按 CHANGE_BLOCK 切成固定块求哈希，和打开时记下的逐块比较，只重新扫描不同的块
+struct DiskIdentity {
+    uint64_t dev = 0, ino = 0, size = 0, mtime = 0;
+
+    bool from_path(const std::string& path);
+    bool from_fd(int fd);
+    bool operator==(const DiskIdentity& o) const {
+        return dev == o.dev && ino == o.ino && size == o.size && mtime == o.mtime;
+    }
+    bool operator!=(const DiskIdentity& o) const { return !(*this == o); }
+};
+
+const uint64_t CHANGE_BLOCK = 64 << 10;
+
+// 文件内容的块哈希，各段在线程池中并行计算
+struct BlockHashJob {
+    std::mutex mu;
+    std::condition_variable cv;
+    std::vector<uint64_t> hashes;       // 第 i 块 [i * CHANGE_BLOCK, (i + 1) * CHANGE_BLOCK) 的哈希
+    size_t pending = 0;
+    std::function<void(const BlockHashJob&)> then;  // 最后一段算完后在该线程上调用（取消时也调用）
+    std::atomic<bool> cancel{false};
+    std::atomic<bool> done{false};
+};
+
+// data 在任务完成前须保持映射
+std::shared_ptr<BlockHashJob> start_block_hash(const char* data, uint64_t size,
+                                          std::function<void(const BlockHashJob&)> then = nullptr);
+// 通知各段停止并等它们退出
+void cancel_block_hash(BlockHashJob& job);
+
+// 重新加载：映射磁盘上的新文件，求块哈希后和旧的比较得出不同之处，
+// 只扫描不同之处的换行，其余的行索引从旧索引平移过来
+struct ReloadJob {
+    std::mutex mu;
+    std::condition_variable cv;
+    MappedFile file;
+    DiskIdentity disk;
+    std::shared_ptr<BlockHashJob> hashes;    // 新文件的块哈希，作为下一次比较的基准
+    LineIndex idx;
+    std::vector<FileChange> changes;
+    uint64_t rescanned = 0;                  // 重新扫描的字节数
+    std::string err;
+    std::atomic<bool> cancel{false};
+    std::atomic<bool> done{false};
+};
+
+// old 为当前映射的旧文件，old_idx 为它完整的行索引，base 为它打开时的块哈希（须已算完）；
+// 三者在任务完成前都不能变。文件被原地改写时旧映射已经是新内容，只能和 base 比；
+// 换了 inode 时旧映射仍是旧内容，可以逐字节收窄不同之处，长度变了也能从尾部比出相同的部分
+std::shared_ptr<ReloadJob> start_reload(const std::string& path, const MappedFile& old, const LineIndex& old_idx,
+                                   std::shared_ptr<BlockHashJob> base);
+// 通知任务停止并等它结束
+void cancel_reload(ReloadJob& job);
+
+// 把 [from, size) 切块交给线程池扫描换行；sidecar 非空时扫描结果同时写入缓存
+std::shared_ptr<IndexJob> start_index_job(const char* data, uint64_t from, uint64_t size,
+                                     std::shared_ptr<IndexSidecar> sidecar = nullptr);
+// 按顺序把已扫描完的块接到 buf 末尾；wait 为真时等待全部完成。全部发布后返回 true
+bool publish_index(IndexJob& job, PieceTable& buf, bool wait);
+// 通知后台线程停止并等它们退出
+void cancel_index(IndexJob& job);
+
+// 映射文件并索引首屏所需的一小段（有有效的旁路缓存时直接用缓存），
+// indexed 返回已索引的字节数；文件打不开时 buf 置空并返回 false
+bool open_document(const std::string& fname, MappedFile& file, PieceTable& buf, uint64_t& indexed,
+                   bool use_sidecar = true);
+// 写到同目录的临时文件后原子改名；orig_fd 为原始文件，其中未改动的片段在内核里复制
+bool save_document(const PieceTable& buf, int orig_fd, const std::string& fname, std::string& err);
+// 把 fname 旁的编辑日志重放到 buf 上（buf 须已完整索引原文件）。
+// 返回重放的记录数；日志与文件不匹配或无法读取时返回 -1 并设置 err
+long replay_journal(const std::string& fname, PieceTable& buf, std::string& err);
+// 日志明显大于文档快照（或 force）时，用快照替换它
+void compact_journal(EditJournal& journal, const PieceTable& buf, bool force = false);
+
+// 在整个文档中搜索 word，各块在线程池中并行匹配；正则编译失败返回空并填写 err
+std::shared_ptr<SearchJob> start_search(const PieceTable& buf, const std::string& word, bool regex, std::string& err);
+// 把已完成的块按顺序追加到 hits / lens（lens 只在正则搜索时填写），
+// 字面搜索去掉重叠的命中；全部块都已取走时返回 true
+bool collect_search(SearchJob& job, std::vector<uint64_t>& hits, std::vector<uint32_t>& lens);
+
+// 为当前文档建立 JSON 结构索引，完成后 job->done 置位、job->index 可用
+std::shared_ptr<JsonIndexJob> start_json_index(const PieceTable& buf);
+
+// ---- 批处理 ----
+
+// 批处理脚本中的一条命令，格式见 parse_batch_script
+struct BatchCommand {
+    enum Op { GOTO, FIND, REPLACE, DELETE, INSERT } op = GOTO;
+    bool regex = false;
+    int64_t n = 0;          // goto 的行号（1 起，负数从末尾数）；delete 的行数
+    std::string a, b;       // find 的模式；replace 的模式和替换文字；insert 的文字
+    int line = 0;           // 在脚本中的行号，报错用
+};
+
+// 一个文件的处理结果和各阶段耗时
+struct BatchResult {
+    std::string file;
+    bool ok = false, changed = false;
+    std::string err;
+    uint64_t bytes = 0;
+    size_t lines = 0, edits = 0;
+    double load_ms = 0, edit_ms = 0, save_ms = 0;
+    size_t peak_mem = 0;    // 索引、片段、追加缓冲区和搜索命中的峰值
+};
+
+// 每行一条命令，# 开头的行和空行忽略：
+//   goto LINE | find TEXT | find-re RE | replace OLD NEW | replace-re RE NEW | delete N | insert TEXT
+// 参数可以加双引号，引号内支持 \n \t \" \\。出错返回 false 并设置 err
+bool parse_batch_script(const std::string& text, std::vector<BatchCommand>& out, std::string& err);
+// 对一个文件执行脚本，有改动时保存。占用的内存超过 mem_limit 时放弃这个文件，不保存
+BatchResult run_batch_file(const std::vector<BatchCommand>& cmds, const std::string& fname, size_t mem_limit);
+// 用 threads 个线程处理 files，每个线程同时只持有一个文件，大文件先处理。
+// 每完成一个文件调用一次 report，调用之间互斥
+std::vector<BatchResult> run_batch(const std::vector<BatchCommand>& cmds, const std::vector<std::string>& files, unsigned threads,
+                              size_t mem_limit, std::function<void(const BatchResult&)> report = nullptr);
+
+// ---- 目录搜索 ----
+
+// 目录搜索的一条命中，同一行只报第一处
+struct GrepHit {
+    std::string path;       // 根目录下的路径，可直接打开
+    uint64_t line = 0;      // 0 起
+    uint64_t col = 0;       // 命中在行内的字节偏移
+    std::string text;       // 命中所在的行，最多 GREP_TEXT_MAX 字节
+};
+
+const size_t GREP_MAX_HITS = 100000;
+const size_t GREP_TEXT_MAX = 256;
+
+// 后台目录搜索：每个目录、每个文件各是线程池里的一个任务，目录任务读到子目录和文件就交出去，
+// 空闲的线程随时领走，遍历和匹配同时进行。文件整个映射后用和全文搜索相同的匹配函数。
+// 跳过隐藏文件和目录、.gitignore 忽略的路径、符号链接，以及前 8 KB 含 NUL 的二进制文件
+struct GrepJob {
+    std::string root, word;
+    std::shared_ptr<Regex> re;          // 非空为正则搜索
+    std::mutex mu;
+    std::condition_variable cv;
+    std::vector<GrepHit> hits;          // 还没被 collect_grep 取走的命中
+    size_t total_hits = 0;
+    bool truncated = false;             // 命中超过 GREP_MAX_HITS，提前停了
+    size_t pending = 0;
+    std::atomic<uint64_t> files{0};     // 已搜索的文件数和字节数
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> skipped{0};   // 跳过的二进制文件
+    std::atomic<bool> cancel{false};
+    std::atomic<bool> done{false};
+};
+
+// 在 root 下搜索 word；正则编译失败或 root 不是目录时返回空并填写 err
+std::shared_ptr<GrepJob> start_grep(const std::string& root, const std::string& word, bool regex, std::string& err);
+// 把新到的命中追加到 out；搜索结束且全部取走时返回 true
+bool collect_grep(GrepJob& job, std::vector<GrepHit>& out);
+// 通知各任务停止并等它们退出
+void cancel_grep(GrepJob& job);
+
+#endif
@@ -0,0 +1,1249 @@
+// 核心库测试：随机操作的结果和简单模型逐项对照，失败时打印位置，退出码非零
+#include "SEditorCore.h"
+#include <cstdlib>
+#include <dirent.h>
+#include <ftw.h>
+#include <random>
+#include <regex>
+#include <set>
+#include <thread>
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                                   \
+    do {                                                                              \
+        if (!(cond)) {                                                                \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++failures;                                                               \
+        }                                                                             \
+    } while (0)
+
+// 把 text 整体作为原始文件装进 buf，text 须比 buf 活得久
+static void load(PieceTable& buf, const string& text) {
+    buf.reset(text.data(), 0, LineIndex());
+    auto job = start_index_job(text.data(), 0, text.size());
+    publish_index(*job, buf, true);
+}
+
+static string random_text(mt19937& rng, size_t n, const char* alphabet) {
+    size_t k = strlen(alphabet);
+    string s(n, ' ');
+    for (auto& c : s) c = alphabet[rng() % k];
+    return s;
+}
+
+// 行号与偏移的换算和模型一致
+static void check_lines(const PieceTable& buf, const string& model, mt19937& rng) {
+    size_t lines = count(model.begin(), model.end(), '\n') + 1;
+    CHECK(buf.line_count() == lines);
+    for (int i = 0; i < 8; ++i) {
+        size_t line = rng() % lines;
+        size_t start = 0;
+        for (size_t k = 0; k < line; ++k) start = model.find('\n', start) + 1;
+        CHECK(buf.line_start(line) == start);
+        uint64_t pos = model.empty() ? 0 : rng() % model.size();
+        CHECK(buf.line_of(pos) == (size_t)count(model.begin(), model.begin() + pos, '\n'));
+    }
+}
+
+// 测试用的临时目录，用完连同内容一起删掉
+static string make_temp_dir() {
+    char dir[] = "/tmp/seditor-test-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        ++failures;
+        return "";
+    }
+    return dir;
+}
+
+static void remove_tree(const string& dir) {
+    if (dir.empty()) return;
+    nftw(dir.c_str(), [](const char* p, const struct stat*, int, struct FTW*) { return remove(p); }, 16,
+         FTW_DEPTH | FTW_PHYS);
+}
+
+static void write_file(const string& path, const string& text) {
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+        perror(path.c_str());
+        ++failures;
+        return;
+    }
+    fwrite(text.data(), 1, text.size(), f);
+    fclose(f);
+}
+
+static string read_file(const string& path) {
+    MappedFile file;
+    PieceTable buf;
+    uint64_t indexed;
+    if (!open_document(path, file, buf, indexed)) return "";
+    return buf.read(0, buf.length());
+}
+
+// 随机插入、删除、撤销、重做，每步都单独成组，模型记下每步之前的全文
+static void test_piece_table() {
+    mt19937 rng(1);
+    string orig = random_text(rng, 1 << 16, "abc \n");
+    string model = orig;
+    PieceTable buf;
+    load(buf, orig);
+    UndoLog undo;
+    vector<string> done, undone;
+    for (int step = 0; step < 3000; ++step) {
+        int op = rng() % 10;
+        uint64_t cursor = 0;
+        if (op < 4) {
+            uint64_t pos = rng() % (model.size() + 1);
+            string s = random_text(rng, 1 + rng() % 20, "xyz\n");
+            done.push_back(model);
+            undone.clear();
+            model.insert(pos, s);
+            undo.record_insert(pos, buf.insert(pos, s.data(), s.size()), pos);
+        } else if (op < 7) {
+            if (model.empty()) continue;
+            uint64_t pos = rng() % model.size();
+            uint64_t n = std::min<uint64_t>(1 + rng() % 200, model.size() - pos);
+            done.push_back(model);
+            undone.clear();
+            model.erase(pos, n);
+            vector<PieceTable::Piece> removed;
+            buf.erase(pos, n, &removed);
+            undo.record_erase(pos, n, removed, pos);
+        } else if (op < 9) {
+            bool ok = undo.undo(buf, cursor);
+            CHECK(ok == !done.empty());
+            if (!ok) continue;
+            undone.push_back(model);
+            model = done.back();
+            done.pop_back();
+        } else {
+            bool ok = undo.redo(buf, cursor);
+            CHECK(ok == !undone.empty());
+            if (!ok) continue;
+            done.push_back(model);
+            model = undone.back();
+            undone.pop_back();
+        }
+        undo.boundary();
+        CHECK(buf.length() == model.size());
+        if (step % 50 == 0) {
+            CHECK(buf.read(0, buf.length()) == model);
+            check_lines(buf, model, rng);
+        }
+    }
+    CHECK(buf.read(0, buf.length()) == model);
+}
+
+// 随机正则：两种语法里含义相同的子集（POSIX ERE 没有 \d 之类的转义）
+static string random_regex(mt19937& rng, int depth) {
+    static const char* atoms[] = {"a", "b", "c", ".", "[ab]", "[^a]", "[a-c]"};
+    string s;
+    int n = 1 + rng() % 3;
+    for (int i = 0; i < n; ++i) {
+        string a = depth > 0 && rng() % 4 == 0 ? "(" + random_regex(rng, depth - 1) + ")" : atoms[rng() % 7];
+        switch (rng() % 8) {
+            case 0: a += "*"; break;
+            case 1: a += "+"; break;
+            case 2: a += "?"; break;
+            case 3: {
+                int lo = rng() % 3, hi = lo + rng() % 3;
+                a += "{" + to_string(lo) + "," + to_string(hi) + "}";
+                break;
+            }
+            default: break;
+        }
+        s += a;
+    }
+    if (depth > 0 && rng() % 4 == 0) s += "|" + random_regex(rng, depth - 1);
+    return s;
+}
+
+// 逐行找出所有不重叠的非空最左最长匹配。libstdc++ 的 regex_search 回溯实现在 POSIX 模式下
+// 不保证最长，这里对每个起点从长到短试 regex_match；__polynomial 让它走不回溯的实现
+static void std_find_all(const string& pat, const string& text, vector<uint64_t>& hits, vector<uint32_t>& lens) {
+    std::regex re(pat, std::regex::extended | std::regex_constants::__polynomial);
+    size_t ls = 0;
+    while (ls < text.size()) {
+        size_t le = text.find('\n', ls);
+        if (le == string::npos) le = text.size();
+        for (size_t s = ls; s < le; ++s) {
+            for (size_t e = le; e > s; --e) {
+                auto flags = std::regex_constants::match_default;
+                if (s > ls) flags |= std::regex_constants::match_not_bol;
+                if (e < le) flags |= std::regex_constants::match_not_eol;
+                if (std::regex_match(text.begin() + s, text.begin() + e, re, flags)) {
+                    hits.push_back(s);
+                    lens.push_back(e - s);
+                    s = e - 1;
+                    break;
+                }
+            }
+        }
+        ls = le + 1;
+    }
+}
+
+static void test_regex() {
+    mt19937 rng(3);
+    for (int t = 0; t < 300; ++t) {
+        string pat = random_regex(rng, 2);
+        if (rng() % 8 == 0) pat = "^" + pat;
+        if (rng() % 8 == 0) pat += "$";
+        string text;
+        for (int i = 0; i < 20; ++i) text += random_text(rng, rng() % 30, "abcd") + "\n";
+
+        Regex re;
+        string err;
+        CHECK(re.compile(pat, err));
+        vector<uint64_t> hits, want;
+        vector<uint32_t> lens, want_lens;
+        regex_find_all(re, text.data(), text.size(), 0, hits, lens);
+        std_find_all(pat, text, want, want_lens);
+        if (hits != want || lens != want_lens) {
+            fprintf(stderr, "regex /%s/: %zu hits, std::regex %zu\n", pat.c_str(), hits.size(), want.size());
+            ++failures;
+        }
+    }
+    // 嵌套的计数重复展开后状态数相乘，要在编译时拒绝，而不是建出上百万个 NFA 状态
+    for (const char* pat : {"(a{1000}){1000}", "(a{1,100}){1,100}", "(a{100}){101}"}) {
+        Regex re;
+        string err;
+        CHECK(!re.compile(pat, err) && err == "pattern too large");
+    }
+    Regex re;
+    string err;
+    CHECK(re.compile("(a{10}){10}", err));
+    CHECK(!re.compile("a(b", err));
+}
+
+// 跨过多个搜索块的字面搜索，命中恰好落在块边界上
+static void test_search_chunks() {
+    mt19937 rng(4);
+    string text = random_text(rng, 3 * SEARCH_CHUNK, "ab \n");
+    for (uint64_t b = SEARCH_CHUNK; b < text.size(); b += SEARCH_CHUNK) text.replace(b - 2, 5, "needl");
+    PieceTable buf;
+    load(buf, text);
+    string err;
+    for (bool regex : {false, true}) {
+        auto job = start_search(buf, regex ? "ne+dl" : "needl", regex, err);
+        CHECK(job != nullptr);
+        if (!job) continue;
+        {
+            std::unique_lock<std::mutex> lk(job->mu);
+            job->cv.wait(lk, [&] { return job->pending == 0; });
+        }
+        vector<uint64_t> hits;
+        for (auto& h : job->hits) hits.insert(hits.end(), h.begin(), h.end());
+        vector<uint64_t> want;
+        for (size_t p = text.find("needl"); p != string::npos; p = text.find("needl", p + 5)) want.push_back(p);
+        CHECK(hits == want);
+    }
+}
+
+// 逐行分析，上一行的结束状态作为下一行的开始状态，返回各行的着色区间
+static vector<vector<HlSpan>> lex_lines(const char* ext, const vector<string>& lines, vector<uint8_t>& states) {
+    const LangSpec* L = find_lang(ext);
+    vector<vector<HlSpan>> out(lines.size());
+    states.clear();
+    uint8_t st = HL_NORMAL;
+    for (size_t i = 0; i < lines.size(); ++i) {
+        st = lex_line(*L, lines[i].data(), lines[i].size(), st, out[i]);
+        states.push_back(st);
+    }
+    return out;
+}
+
+static bool has_span(const vector<HlSpan>& spans, uint32_t start, uint32_t len, uint8_t kind) {
+    for (const HlSpan& sp : spans)
+        if (sp.start == start && sp.len == len && sp.kind == kind) return true;
+    return false;
+}
+
+// 块注释和多行字符串跨行时，状态带到下一行，闭合之后恢复正常分析
+static void test_lex_state() {
+    vector<uint8_t> st;
+    auto cpp = lex_lines("cpp", {"int a; /* open {", "still ( comment", "done */ int b; // x", "s = \"/* no\";",
+                                 "t = \"a\\\"/*\";"}, st);
+    CHECK((st == vector<uint8_t>{HL_BLOCK_COMMENT, HL_BLOCK_COMMENT, HL_NORMAL, HL_NORMAL, HL_NORMAL}));
+    CHECK(has_span(cpp[0], 0, 3, HL_KEYWORD));
+    CHECK(has_span(cpp[0], 7, 9, HL_COMMENT));
+    CHECK(cpp[1].size() == 1 && has_span(cpp[1], 0, 15, HL_COMMENT));
+    CHECK(has_span(cpp[2], 0, 7, HL_COMMENT));
+    CHECK(has_span(cpp[2], 8, 3, HL_KEYWORD));
+    CHECK(has_span(cpp[2], 15, 4, HL_COMMENT));
+    CHECK(has_span(cpp[3], 4, 7, HL_STRING));
+    CHECK(has_span(cpp[4], 4, 7, HL_STRING));
+
+    auto py = lex_lines("py", {"x = \"\"\"doc", "'''still'''", "end\"\"\" + 'y'", "y = '''a", "b''' # \"\"\""}, st);
+    CHECK((st == vector<uint8_t>{HL_TRIPLE_DQ, HL_TRIPLE_DQ, HL_NORMAL, HL_TRIPLE_SQ, HL_NORMAL}));
+    CHECK(has_span(py[0], 4, 6, HL_STRING));
+    CHECK(py[1].size() == 1 && has_span(py[1], 0, 11, HL_STRING));
+    CHECK(has_span(py[2], 0, 6, HL_STRING));
+    CHECK(has_span(py[2], 9, 3, HL_STRING));
+    CHECK(has_span(py[4], 0, 4, HL_STRING));
+    CHECK(has_span(py[4], 5, 5, HL_COMMENT));
+
+    auto js = lex_lines("js", {"let t = `a ${x}", "b\\` still", "` + 1; /* c", "*/"}, st);
+    CHECK((st == vector<uint8_t>{HL_TEMPLATE, HL_TEMPLATE, HL_BLOCK_COMMENT, HL_NORMAL}));
+    CHECK(js[1].size() == 1 && has_span(js[1], 0, 9, HL_STRING));
+    CHECK(has_span(js[2], 0, 1, HL_STRING));
+    CHECK(has_span(js[3], 0, 2, HL_COMMENT));
+}
+
+// 保存经过符号链接时替换的是链接指向的文件：链接保留，权限不变，目录里不留临时文件
+static void test_save_symlink() {
+    string dir = make_temp_dir();
+    if (dir.empty()) return;
+    string real = dir + "/real.txt", link = dir + "/link.txt";
+    mt19937 rng(7);
+    string orig = random_text(rng, 1 << 16, "abc \n");
+    write_file(real, orig);
+    chmod(real.c_str(), 0640);
+    CHECK(symlink("real.txt", link.c_str()) == 0);
+    {
+        MappedFile file;
+        PieceTable buf;
+        uint64_t indexed;
+        CHECK(open_document(link, file, buf, indexed));
+        buf.insert(10, "edited\n", 7);
+        buf.erase(1000, 500);
+        string want = buf.read(0, buf.length());
+        string err;
+        CHECK(save_document(buf, file.fd, link, err));
+        CHECK(err.empty());
+        struct stat st;
+        CHECK(lstat(link.c_str(), &st) == 0 && S_ISLNK(st.st_mode));
+        CHECK(stat(real.c_str(), &st) == 0 && (st.st_mode & 07777) == 0640);
+        CHECK(read_file(real) == want);
+    }
+    size_t entries = 0;
+    if (DIR* d = opendir(dir.c_str())) {
+        while (dirent* e = readdir(d)) entries += e->d_name[0] != '.';
+        closedir(d);
+    }
+    CHECK(entries == 2);
+    remove_tree(dir);
+}
+
+// 打开大文件并补完索引，sidecar 为真时顺带写旁路缓存；返回打开时直接可用的长度
+static uint64_t open_indexed(const string& path, MappedFile& file, PieceTable& buf, bool sidecar) {
+    uint64_t indexed = 0;
+    CHECK(open_document(path, file, buf, indexed));
+    if (indexed < file.size) {
+        auto sc = sidecar ? IndexSidecar::open(path, file) : nullptr;
+        auto job = start_index_job(file.data, indexed, file.size, sc);
+        publish_index(*job, buf, true);
+        if (sidecar) CHECK(sc && sc->wait());
+    }
+    return indexed;
+}
+
+// 缓存目录下唯一的 .idx 文件
+static string sidecar_file(const string& cache) {
+    string found;
+    if (DIR* d = opendir((cache + "/seditor").c_str())) {
+        while (dirent* e = readdir(d)) {
+            string name = e->d_name;
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".idx") == 0) found = cache + "/seditor/" + name;
+        }
+        closedir(d);
+    }
+    return found;
+}
+
+// 行首偏移逐行和模型对照
+static void check_all_lines(const PieceTable& buf, const string& text) {
+    size_t line = 0, bad = 0;
+    for (size_t p = 0; p != string::npos && p <= text.size(); ++line) {
+        bad += buf.line_start(line) != p;
+        size_t nl = text.find('\n', p);
+        p = nl == string::npos ? nl : nl + 1;
+    }
+    CHECK(bad == 0);
+    CHECK(buf.line_count() == line);
+}
+
+// 旁路缓存写出后重开直接映射；文件变长时沿用旧的部分，内容或缓存本身不对时不用
+static void test_sidecar() {
+    string dir = make_temp_dir();
+    if (dir.empty()) return;
+    string cache = dir + "/cache", path = dir + "/big.txt", other = dir + "/other.txt";
+    mkdir(cache.c_str(), 0755);
+    setenv("XDG_CACHE_HOME", cache.c_str(), 1);
+    mt19937 rng(8);
+    string text;
+    while (text.size() < IndexSidecar::MIN_FILE_SIZE + 12345) {
+        // 偶尔来一段很长的行，块内偏移的位宽随之变化
+        text += random_text(rng, rng() % 64 == 0 ? 1 + rng() % 100000 : rng() % 80, "abcdefgh ");
+        text += '\n';
+    }
+    write_file(path, text);
+    auto reopen = [&](const string& p, uint64_t& size) {
+        MappedFile file;
+        PieceTable buf;
+        uint64_t indexed = open_indexed(p, file, buf, false);
+        size = file.size;
+        check_all_lines(buf, text);
+        return indexed;
+    };
+    uint64_t size;
+    {
+        MappedFile file;
+        PieceTable buf;
+        CHECK(open_indexed(path, file, buf, true) < file.size);
+        check_all_lines(buf, text);
+    }
+    string idx = sidecar_file(cache);
+    CHECK(!idx.empty());
+    CHECK(reopen(path, size) == size);
+
+    // 文件头坏了一个字节
+    {
+        int fd = open(idx.c_str(), O_RDWR);
+        char c;
+        CHECK(pread(fd, &c, 1, 9) == 1);
+        c ^= 1;
+        CHECK(pwrite(fd, &c, 1, 9) == 1);
+        close(fd);
+    }
+    CHECK(reopen(path, size) < size);
+
+    // 截断的缓存
+    {
+        MappedFile file;
+        PieceTable buf;
+        open_indexed(path, file, buf, true);
+    }
+    CHECK(reopen(path, size) == size);
+    CHECK(truncate(idx.c_str(), 4096 + 100) == 0);
+    CHECK(reopen(path, size) < size);
+
+    // 别的文件的缓存：内容一样，但路径和 inode 不同
+    write_file(other, text);
+    {
+        MappedFile file;
+        PieceTable buf;
+        open_indexed(other, file, buf, true);
+    }
+    string other_idx;
+    if (DIR* d = opendir((cache + "/seditor").c_str())) {
+        while (dirent* e = readdir(d)) {
+            string f = cache + "/seditor/" + e->d_name;
+            if (f != idx && f.size() > 4 && f.compare(f.size() - 4, 4, ".idx") == 0) other_idx = f;
+        }
+        closedir(d);
+    }
+    CHECK(!other_idx.empty() && rename(other_idx.c_str(), idx.c_str()) == 0);
+    CHECK(reopen(path, size) < size);
+
+    // 追加之后沿用旧缓存，只扫描新的部分
+    {
+        MappedFile file;
+        PieceTable buf;
+        open_indexed(path, file, buf, true);
+    }
+    uint64_t old_size = text.size();
+    string more = random_text(rng, 100000, "xyz\n");
+    {
+        FILE* f = fopen(path.c_str(), "a");
+        fwrite(more.data(), 1, more.size(), f);
+        fclose(f);
+    }
+    text += more;
+    CHECK(reopen(path, size) == old_size);
+
+    // 原地改了一个字节，大小不变
+    {
+        int fd = open(path.c_str(), O_RDWR);
+        CHECK(pwrite(fd, "\n", 1, 100) == 1);
+        close(fd);
+        text[100] = '\n';
+    }
+    {
+        MappedFile file;
+        PieceTable buf;
+        open_indexed(path, file, buf, true);
+    }
+    CHECK(reopen(path, size) == size);
+    {
+        int fd = open(path.c_str(), O_RDWR);
+        CHECK(pwrite(fd, "q", 1, 200) == 1);
+        close(fd);
+        text[200] = 'q';
+    }
+    CHECK(reopen(path, size) < size);
+    unsetenv("XDG_CACHE_HOME");
+    remove_tree(dir);
+}
+
+// 行距有大有小，块内偏移的位宽从 0 到几十位都有，跨字边界存放；select/rank 和数组模型逐项对照
+static void test_line_index() {
+    mt19937_64 rng(9);
+    vector<uint64_t> nl;
+    uint64_t pos = 0;
+    for (int i = 0; i < 20000; ++i) {
+        int k = rng() % 16;
+        uint64_t gap = k < 8 ? 1 + rng() % 4 : k < 14 ? 1 + rng() % 5000 : 1 + (rng() >> (rng() % 40 + 20));
+        pos += gap;
+        nl.push_back(pos);
+    }
+    LineIndex a, b, whole;
+    size_t half = 64 * 150 + 17;   // 拼接点不在块边界上
+    a.append(vector<uint64_t>(nl.begin(), nl.begin() + half));
+    for (size_t i = half; i < nl.size(); ++i) b.push(nl[i]);
+    whole.append(a);
+    whole.append(b);
+    whole.shrink();
+    CHECK(whole.count() == nl.size());
+    size_t bad = 0;
+    for (size_t k = 0; k < nl.size(); ++k) bad += whole.select(k) != nl[k];
+    CHECK(bad == 0);
+    for (int t = 0; t < 20000; ++t) {
+        uint64_t p = rng() % (pos + 2);
+        if (t % 4 == 0) p = nl[rng() % nl.size()] + (int)(rng() % 3) - 1;
+        size_t want = lower_bound(nl.begin(), nl.end(), p) - nl.begin();
+        bad += whole.rank(p) != want;
+    }
+    CHECK(bad == 0);
+    CHECK(a.count() == half && a.select(half - 1) == nl[half - 1]);
+
+    // 换行恰好落在 BLOCK 的整数倍附近时 line_start/line_of 的换算
+    string text;
+    for (size_t i = 0; i < 64 * 40 + 3; ++i) text += string(i % 7 == 0 ? 200 : i % 3, 'x') + "\n";
+    PieceTable buf;
+    load(buf, text);
+    vector<uint64_t> starts = {0};
+    for (size_t i = 0; i < text.size(); ++i)
+        if (text[i] == '\n') starts.push_back(i + 1);
+    CHECK(buf.line_count() == starts.size());
+    for (size_t l : {(size_t)63, (size_t)64, (size_t)65, (size_t)127, (size_t)128, (size_t)64 * 40, starts.size() - 1}) {
+        CHECK(buf.line_start(l) == starts[l]);
+        CHECK(buf.line_of(starts[l]) == l);
+        if (l > 0) CHECK(buf.line_of(starts[l] - 1) == l - 1);
+    }
+}
+
+// 把原文件完整装进 buf 后重放 path 旁的日志
+static long replay(const string& path, MappedFile& file, PieceTable& buf, string& err) {
+    uint64_t indexed;
+    if (!open_document(path, file, buf, indexed, false)) return -1;
+    if (indexed < file.size) {
+        auto job = start_index_job(file.data, indexed, file.size);
+        publish_index(*job, buf, true);
+    }
+    return replay_journal(path, buf, err);
+}
+
+// 编辑记进日志，另开一份原文件重放后应得到同样的内容；压缩成快照后再重放一次
+static void test_journal() {
+    string dir = make_temp_dir();
+    if (dir.empty()) return;
+    string path = dir + "/doc.txt";
+    mt19937 rng(5);
+    string orig = random_text(rng, 1 << 18, "abc \n");
+    write_file(path, orig);
+    {
+        MappedFile file;
+        PieceTable buf;
+        uint64_t indexed;
+        CHECK(open_document(path, file, buf, indexed, false));
+        if (indexed < file.size) {
+            auto job = start_index_job(file.data, indexed, file.size);
+            publish_index(*job, buf, true);
+        }
+        EditJournal journal;
+        journal.start(path, true);
+        buf.journal = &journal;
+        UndoLog undo;
+        for (int step = 0; step < 2000; ++step) {
+            uint64_t cursor = 0;
+            int op = rng() % 10;
+            if (op < 5) {
+                uint64_t pos = rng() % (buf.length() + 1);
+                string s = random_text(rng, 1 + rng() % 10, "xy\n");
+                undo.record_insert(pos, buf.insert(pos, s.data(), s.size()), pos);
+            } else if (op < 8 && buf.length() > 0) {
+                uint64_t pos = rng() % buf.length();
+                uint64_t n = std::min<uint64_t>(1 + rng() % 300, buf.length() - pos);
+                vector<PieceTable::Piece> removed;
+                buf.erase(pos, n, &removed);
+                undo.record_erase(pos, n, removed, pos);
+            } else {
+                // 撤销删除会把原文件的片段插回去，日志里记成 original 记录
+                undo.undo(buf, cursor);
+            }
+            undo.boundary();
+        }
+        string want = buf.read(0, buf.length());
+        journal.sync();
+        CHECK(EditJournal::probe(path) == 1);
+        {
+            MappedFile file2;
+            PieceTable buf2;
+            string err;
+            CHECK(replay(path, file2, buf2, err) > 0);
+            CHECK(err.empty());
+            CHECK(buf2.read(0, buf2.length()) == want);
+        }
+        compact_journal(journal, buf, true);
+        journal.sync();
+        {
+            MappedFile file3;
+            PieceTable buf3;
+            string err;
+            CHECK(replay(path, file3, buf3, err) > 0);
+            CHECK(buf3.read(0, buf3.length()) == want);
+        }
+        buf.journal = nullptr;
+        journal.discard();
+    }
+    CHECK(EditJournal::probe(path) == 0);
+    CHECK(read_file(path) == orig);
+    remove_tree(dir);
+}
+
+// 整体替换对照逐个替换的结果，再撤销、重做
+static void test_replace_ranges() {
+    mt19937 rng(2);
+    string orig = random_text(rng, 1 << 16, "ab\n");
+    PieceTable buf;
+    load(buf, orig);
+    buf.insert(100, "abab", 4);
+    string before = buf.read(0, buf.length());
+
+    vector<uint64_t> hits;
+    for (size_t p = before.find("ab"); p != string::npos; p = before.find("ab", p + 2)) hits.push_back(p);
+    string want;
+    size_t last = 0;
+    for (uint64_t h : hits) {
+        want.append(before, last, h - last);
+        want += "<X>";
+        last = h + 2;
+    }
+    want.append(before, last, string::npos);
+
+    vector<PieceTable::Piece> old, now;
+    size_t n = buf.replace_ranges(hits, {}, 2, "<X>", 3, old, now);
+    CHECK(n == hits.size());
+    CHECK(buf.read(0, buf.length()) == want);
+    check_lines(buf, want, rng);
+
+    UndoLog undo;
+    undo.record_replace(old, before.size(), now, want.size(), 0);
+    uint64_t cursor;
+    CHECK(undo.undo(buf, cursor));
+    CHECK(buf.read(0, buf.length()) == before);
+    CHECK(undo.redo(buf, cursor));
+    CHECK(buf.read(0, buf.length()) == want);
+}
+
+// 随机 JSON：字符串里混入括号、转义引号和连续反斜杠，容器有大有小
+static void random_json(mt19937& rng, string& out, int depth) {
+    int k = rng() % 6;
+    if (depth == 0 || k < 2) {
+        out += '"';
+        int n = rng() % 12;
+        for (int i = 0; i < n; ++i) {
+            static const char* parts[] = {"a", "{", "]", "\\\"", "\\\\", " ", "[", "}"};
+            out += parts[rng() % 8];
+        }
+        out += '"';
+        return;
+    }
+    bool obj = k & 1;
+    out += obj ? '{' : '[';
+    int n = rng() % (depth > 3 ? 4 : 40);
+    for (int i = 0; i < n; ++i) {
+        if (i) out += rng() % 3 ? "," : ",\n";
+        if (obj) out += "\"k\":";
+        random_json(rng, out, depth - 1);
+    }
+    out += obj ? '}' : ']';
+}
+
+static void test_json() {
+    mt19937 rng(6);
+    string text = "[";
+    while (text.size() < (1 << 19)) {
+        if (text.size() > 1) text += ",\n";
+        random_json(rng, text, 5);
+    }
+    text += "]\n";
+    PieceTable buf;
+    load(buf, text);
+    auto job = start_json_index(buf);
+    while (!job->done) std::this_thread::sleep_for(chrono::milliseconds(1));
+    const JsonIndex& idx = *job->index;
+    CHECK(!idx.open.empty());
+
+    // 逐字节扫描得到的配对
+    vector<uint64_t> other(text.size(), UINT64_MAX), stack;
+    vector<char> structural(text.size(), 0);
+    bool in = false;
+    for (size_t i = 0; i < text.size(); ++i) {
+        char c = text[i];
+        if (in) {
+            if (c == '\\') ++i;
+            else if (c == '"') in = false;
+        } else if (c == '"') {
+            in = true;
+        } else if (c == '{' || c == '[') {
+            structural[i] = 1;
+            stack.push_back(i);
+        } else if (c == '}' || c == ']') {
+            structural[i] = 1;
+            other[i] = stack.back();
+            other[stack.back()] = i;
+            stack.pop_back();
+        }
+    }
+    size_t checked = 0;
+    for (size_t i = 0; i < text.size(); i += 1 + rng() % 16) {
+        char c = text[i];
+        if (c != '{' && c != '}' && c != '[' && c != ']') continue;
+        uint64_t o;
+        bool ok = idx.match(buf, i, o);
+        CHECK(ok == (bool)structural[i]);
+        if (ok && structural[i]) CHECK(o == other[i]);
+        ++checked;
+    }
+    CHECK(checked > 1000);
+}
+
+// 随机的代码行：括号、注释和字符串里的括号、跨行的块注释，Python 风格的缩进
+static string random_code(mt19937& rng, size_t lines) {
+    static const char* parts[] = {"{", "}", "(", ")", "[", "]", "x", " ", "\"}(\"", "'['", "// )", "/* { */",
+                                  "/*", "*/", "if:", "def f():"};
+    string s;
+    for (size_t i = 0; i < lines; ++i) {
+        s += string(rng() % 4 * 4, ' ');
+        int n = rng() % 6;
+        for (int k = 0; k < n; ++k) s += parts[rng() % 16];
+        s += '\n';
+    }
+    return s;
+}
+
+static void refresh_all(BlockIndex& blocks, const PieceTable& buf) {
+    while (!blocks.refresh(buf, chrono::milliseconds(1000))) {}
+}
+
+// 随机编辑时由 on_lines 增量维护的块索引，和在同一份文本上从头建的索引逐项比较
+static void test_block_index() {
+    mt19937 rng(10);
+    for (const char* ext : {"cpp", "py"}) {
+        string text = random_code(rng, 5000);
+        PieceTable buf;
+        load(buf, text);
+        BlockIndex blocks;
+        blocks.reset(find_lang(ext), buf.line_count());
+        buf.on_lines = [&](size_t first, size_t removed, size_t added) { blocks.lines_changed(first, removed, added); };
+        refresh_all(blocks, buf);
+        for (int round = 0; round < 12; ++round) {
+            for (int e = 0; e < 30; ++e) {
+                uint64_t pos = rng() % (buf.length() + 1);
+                if (rng() % 2) {
+                    string s = random_code(rng, rng() % 4 == 0 ? 1500 : 1 + rng() % 3);
+                    if (rng() % 2) s.pop_back();
+                    buf.insert(pos, s.data(), s.size());
+                } else if (buf.length() > pos) {
+                    uint64_t n = std::min<uint64_t>(rng() % 4 == 0 ? 20000 + rng() % 40000 : 1 + rng() % 50,
+                                                    buf.length() - pos);
+                    buf.erase(pos, n);
+                }
+                // 有时只分析一部分，下一次改动落在还没分析的行上
+                if (rng() % 4 == 0) blocks.refresh(buf, chrono::milliseconds(0));
+            }
+            refresh_all(blocks, buf);
+            BlockIndex fresh;
+            fresh.reset(find_lang(ext), buf.line_count());
+            refresh_all(fresh, buf);
+            CHECK(blocks.lines() == buf.line_count());
+
+            string now = buf.read(0, buf.length());
+            size_t bad = 0, paired = 0;
+            for (size_t i = 0; i < now.size(); ++i) {
+                char c = now[i];
+                if (c != '{' && c != '}' && c != '(' && c != ')' && c != '[' && c != ']') continue;
+                uint64_t o1 = 0, o2 = 0;
+                bool m1 = blocks.match(buf, i, o1), m2 = fresh.match(buf, i, o2);
+                bad += m1 != m2 || (m1 && o1 != o2);
+                // 配对是相互的
+                if (m1 && o1 != UINT64_MAX) {
+                    uint64_t back;
+                    bad += !blocks.match(buf, o1, back) || back != i;
+                    ++paired;
+                }
+            }
+            for (int t = 0; t < 200; ++t) {
+                uint64_t pos = rng() % (buf.length() + 1);
+                uint64_t a1 = 0, b1 = 0, a2 = 0, b2 = 0;
+                bool e1 = blocks.enclosing(buf, pos, a1, b1), e2 = fresh.enclosing(buf, pos, a2, b2);
+                bad += e1 != e2 || (e1 && (a1 != a2 || b1 != b2));
+            }
+            for (size_t l = 0; l < buf.line_count(); ++l) {
+                size_t x1 = 0, x2 = 0;
+                bool i1 = blocks.indent_block(l, x1), i2 = fresh.indent_block(l, x2);
+                bad += i1 != i2 || (i1 && x1 != x2);
+                bool p1 = blocks.indent_parent(l, x1), p2 = fresh.indent_parent(l, x2);
+                bad += p1 != p2 || (p1 && x1 != x2);
+            }
+            if (bad) fprintf(stderr, "block index (%s) round %d: %zu mismatches\n", ext, round, bad);
+            CHECK(bad == 0);
+            CHECK(paired > 0);
+        }
+        buf.on_lines = nullptr;
+    }
+}
+
+// 折叠跟着真实的编辑移动：之前的平移，之后的不动，隐藏部分里的伸缩，切到一半的丢掉
+static void test_folds() {
+    string text;
+    for (int i = 0; i < 100; ++i) text += "line " + to_string(i) + "\n";
+    PieceTable buf;
+    load(buf, text);
+    FoldSet folds;
+    buf.on_lines = [&](size_t first, size_t removed, size_t added) {
+        folds.lines_changed((int)first, (int)removed, (int)added);
+    };
+    folds.add(10, 20);
+    folds.add(40, 45);
+    CHECK(folds.hidden(0, 100) == 15);
+    CHECK(folds.visible(15) == 10 && folds.next(10) == 21 && folds.prev(21) == 10);
+
+    buf.insert(buf.line_start(5), "a\nb\n", 4);             // 之前插两行
+    CHECK(folds.folded(12) && folds.last(12) == 22 && folds.folded(42) && folds.last(42) == 47);
+    buf.erase(buf.line_start(60), buf.line_start(70) - buf.line_start(60));   // 之后删十行
+    CHECK(folds.last(12) == 22 && folds.last(42) == 47);
+    uint64_t p = buf.line_start(15) + 2;                    // 隐藏部分里插三行
+    buf.insert(p, "x\ny\nz\n", 6);
+    CHECK(folds.folded(12) && folds.last(12) == 25 && folds.last(45) == 50);
+    p = buf.line_start(13) + 1;                             // 隐藏部分里跨行删掉四行
+    buf.erase(p, buf.line_start(17) - p);
+    CHECK(folds.folded(12) && folds.last(12) == 21 && folds.last(41) == 46);
+    buf.insert(buf.line_start(12) + 3, "\n", 1);            // 在折叠起始行中间断行
+    CHECK(folds.folded(12) && folds.last(12) == 22);
+    p = buf.line_start(40);                                 // 从折叠前面删到它中间
+    buf.erase(p, buf.line_start(44) - p);
+    CHECK(!folds.folded(38) && !folds.folded(42) && folds.size() == 1);
+    p = buf.line_start(5);                                  // 把整个折叠删掉
+    buf.erase(p, buf.line_start(30) - p);
+    CHECK(folds.empty());
+    CHECK(folds.hidden(0, (int)buf.line_count()) == 0);
+    buf.on_lines = nullptr;
+}
+
+// 磁盘上的一处修改：旧文件 [pos, pos + del) 换成 ins
+struct DiskEdit {
+    uint64_t pos, del;
+    string ins;
+};
+
+// 按偏移从后往前改，前面的偏移不受影响
+static string apply_edits(string text, vector<DiskEdit> edits) {
+    sort(edits.begin(), edits.end(), [](const DiskEdit& a, const DiskEdit& b) { return a.pos > b.pos; });
+    for (const DiskEdit& e : edits) text.replace(e.pos, e.del, e.ins);
+    return text;
+}
+
+// [lo, hi) 里互不相交的 n 处修改；same_size 时只原样替换字节，第一处一定和原来不同
+static vector<DiskEdit> random_edits(mt19937& rng, const string& text, uint64_t lo, uint64_t hi, int n,
+                                     bool same_size) {
+    set<uint64_t> picked;
+    while (picked.size() < 2 * (size_t)n) picked.insert(lo + rng() % (hi - lo));
+    vector<uint64_t> cuts(picked.begin(), picked.end());
+    vector<DiskEdit> out;
+    for (int i = 0; i < n; ++i) {
+        uint64_t a = cuts[2 * i], b = std::min(cuts[2 * i + 1], a + 1 + rng() % 300);
+        if (same_size) {
+            string s = random_text(rng, b - a, "pqrs\n");
+            if (i == 0) s[0] = text[a] == 'Z' ? 'Y' : 'Z';
+            out.push_back(DiskEdit{a, b - a, s});
+        } else {
+            string s = random_text(rng, rng() % 3 == 0 ? 0 : rng() % 400, "pqrs\n");
+            if (i == 0) s = (text[a] == 'Z' ? "Y" : "Z") + s;
+            out.push_back(DiskEdit{a, b - a, s});
+        }
+    }
+    return out;
+}
+
+// 比较结果：不同之处以外新旧逐字节相同，且按顺序排列
+static void check_changes(const string& old, const string& now, const vector<FileChange>& changes) {
+    uint64_t o = 0, n = 0;
+    for (const FileChange& c : changes) {
+        CHECK(c.old_start >= o && c.old_start <= c.old_end && c.new_start <= c.new_end);
+        CHECK(c.old_start - o == c.new_start - n);
+        CHECK(old.compare(o, c.old_start - o, now, n, c.new_start - n) == 0);
+        o = c.old_end;
+        n = c.new_end;
+    }
+    CHECK(old.size() - o == now.size() - n);
+    CHECK(old.compare(o, string::npos, now, n, string::npos) == 0);
+}
+
+static void wait_reload(ReloadJob& job) {
+    unique_lock<mutex> lk(job.mu);
+    job.cv.wait(lk, [&] { return job.done.load(); });
+}
+
+// 磁盘上的文件随机改一块（改名替换或原地改写），后台比出不同之处再换到文档下面。
+// 未保存的编辑离不同之处足够远时保留下来；碰到了就整个不换，文档保持原样
+static void test_reload() {
+    string dir = make_temp_dir();
+    if (dir.empty()) return;
+    string path = dir + "/f.txt";
+    mt19937 rng(11);
+    const uint64_t blocks = 24;
+    for (int round = 0; round < 18; ++round) {
+        bool in_place = round % 2;
+        int mode = round / 2 % 3;          // 0 没有编辑，1 编辑和磁盘修改不相交，2 编辑碰到了磁盘修改
+        string text = random_text(rng, blocks * CHANGE_BLOCK - rng() % 5000, "abcdefgh  \n");
+        write_file(path, text);
+        MappedFile file;
+        PieceTable buf;
+        open_indexed(path, file, buf, false);
+        auto base = start_block_hash(file.data, file.size);
+        {
+            unique_lock<mutex> lk(base->mu);
+            base->cv.wait(lk, [&] { return base->pending == 0; });
+        }
+        CHECK(base->done);
+
+        // 磁盘上的修改落在 [b0, b1) 这几块里，编辑在它前后至少隔一整块的地方
+        uint64_t b0 = 3 + rng() % (blocks - 12), b1 = b0 + 1 + rng() % 4;
+        auto disk = random_edits(rng, text, b0 * CHANGE_BLOCK, b1 * CHANGE_BLOCK, 1 + rng() % 4, in_place);
+        string now = apply_edits(text, disk);
+        vector<DiskEdit> local;
+        if (mode == 1) {
+            auto before = random_edits(rng, text, 0, (b0 - 1) * CHANGE_BLOCK, 3, false);
+            auto after = random_edits(rng, text, (b1 + 1) * CHANGE_BLOCK, text.size(), 3, false);
+            local = before;
+            local.insert(local.end(), after.begin(), after.end());
+        } else if (mode == 2) {
+            local.push_back(DiskEdit{disk[0].pos, 1, "E"});
+        }
+        for (auto it = local.rbegin(); it != local.rend(); ++it) {
+            buf.erase(it->pos, it->del);
+            buf.insert(it->pos, it->ins.data(), it->ins.size());
+        }
+        string doc = buf.read(0, buf.length());
+        CHECK(doc == apply_edits(text, local));
+
+        if (in_place) {
+            int fd = open(path.c_str(), O_WRONLY);
+            for (const DiskEdit& e : disk)
+                CHECK(pwrite(fd, e.ins.data(), e.ins.size(), e.pos) == (ssize_t)e.ins.size());
+            close(fd);
+        } else {
+            write_file(path + ".new", now);
+            CHECK(rename((path + ".new").c_str(), path.c_str()) == 0);
+        }
+        auto job = start_reload(path, file, buf.original_index(), base);
+        wait_reload(*job);
+        CHECK(job->err.empty());
+        CHECK(job->file.size == now.size());
+        check_changes(text, now, job->changes);
+        // 原地改写只能按块比较，不同之处不超出改过的块；换了 inode 时逐字节收窄
+        for (const FileChange& c : job->changes) {
+            CHECK(c.old_start >= b0 * CHANGE_BLOCK && c.old_end <= b1 * CHANGE_BLOCK);
+            if (!in_place && c.old_start < c.old_end && c.new_start < c.new_end)
+                CHECK(text[c.old_start] != now[c.new_start]);
+        }
+
+        bool ok = buf.rebase_original(job->file.data, job->file.size, std::move(job->idx), job->changes);
+        if (mode == 2) {
+            CHECK(!ok);
+            CHECK(buf.length() == doc.size());
+            // 原地改写时旧映射已经是新内容，只有改名替换的旧文件还能逐字节对照
+            if (!in_place) CHECK(buf.read(0, buf.length()) == doc);
+            continue;
+        }
+        CHECK(ok);
+        file.swap(job->file);
+        // 编辑的位置按前面磁盘修改的长度差平移
+        int64_t shift = (int64_t)now.size() - (int64_t)text.size();
+        for (DiskEdit& e : local)
+            if (e.pos > b0 * CHANGE_BLOCK) e.pos += shift;
+        string want = apply_edits(now, local);
+        if (buf.read(0, buf.length()) != want)
+            fprintf(stderr, "reload round %d (%s, mode %d): document differs\n", round,
+                    in_place ? "in place" : "renamed", mode);
+        CHECK(buf.read(0, buf.length()) == want);
+        check_all_lines(buf, want);
+    }
+    remove_tree(dir);
+}
+
+// 脚本解析：引号和转义、注释和空行、goto $；出错时报出脚本里的行号
+static void test_batch_parse() {
+    vector<BatchCommand> cmds;
+    string err;
+    CHECK(parse_batch_script("# 注释\n\n  goto 3\nfind \"a b\"\nreplace-re \"x+\" \"q\\\"\\n\\\\\"\n"
+                             "insert \"\\tend\\n\"\ngoto $\ngoto -2\ndelete 4\n",
+                             cmds, err));
+    CHECK(cmds.size() == 7);
+    if (cmds.size() == 7) {
+        CHECK(cmds[0].op == BatchCommand::GOTO && cmds[0].n == 3 && cmds[0].line == 3);
+        CHECK(cmds[1].op == BatchCommand::FIND && !cmds[1].regex && cmds[1].a == "a b");
+        CHECK(cmds[2].op == BatchCommand::REPLACE && cmds[2].regex && cmds[2].a == "x+" && cmds[2].b == "q\"\n\\");
+        CHECK(cmds[3].op == BatchCommand::INSERT && cmds[3].a == "\tend\n");
+        CHECK(cmds[4].op == BatchCommand::GOTO && cmds[4].n == -1);
+        CHECK(cmds[5].n == -2);
+        CHECK(cmds[6].op == BatchCommand::DELETE && cmds[6].n == 4 && cmds[6].line == 9);
+    }
+    CHECK(parse_batch_script("", cmds, err) && cmds.empty());
+
+    struct {
+        const char* script;
+        const char* err;
+    } bad[] = {
+        {"frob x\n", "line 1: unknown command 'frob'"},
+        {"goto 1\n\ngoto\n", "line 3: goto: missing argument"},
+        {"replace a\n", "line 1: replace: missing argument"},
+        {"# x\ninsert \"abc\n", "line 2: insert: unterminated string"},
+        {"goto 0\n", "line 1: goto: bad number '0'"},
+        {"goto 12x\n", "line 1: goto: bad number '12x'"},
+        {"delete -1\n", "line 1: delete: bad number '-1'"},
+        {"find a b\n", "line 1: find: too many arguments"},
+        {"find \"\"\n", "line 1: find: empty pattern"},
+    };
+    for (auto& b : bad) {
+        err.clear();
+        bool ok = parse_batch_script(b.script, cmds, err);
+        if (ok || err != b.err) fprintf(stderr, "batch script %s: got '%s'\n", b.script, err.c_str());
+        CHECK(!ok && err == b.err);
+    }
+    CHECK(!parse_batch_script("goto 1\nfind-re \"a(b\"\n", cmds, err) && err.compare(0, 16, "line 2: find-re:") == 0);
+}
+
+// 同一个脚本在模型上的结果：replace foo，goto 2，insert，goto $，delete 1
+static bool batch_model(string& s) {
+    for (size_t p = 0; (p = s.find("foo", p)) != string::npos; p += 4) s.replace(p, 3, "ba r");
+    size_t nl = s.find('\n');
+    if (nl == string::npos) return false;
+    s.insert(nl + 1, "# x\n");
+    size_t last = s.rfind('\n');
+    s.erase(last + 1);
+    return true;
+}
+
+// 多线程处理一批临时文件，结果和模型对照；失败的文件保持原样
+static void test_batch_run() {
+    string dir = make_temp_dir();
+    if (dir.empty()) return;
+    vector<BatchCommand> cmds;
+    string err;
+    CHECK(parse_batch_script("replace foo \"ba r\"\ngoto 2\ninsert \"# x\\n\"\ngoto $\ndelete 1\n", cmds, err));
+    mt19937 rng(12);
+    vector<string> files, texts;
+    for (int i = 0; i < 24; ++i) {
+        string name = dir + "/f" + to_string(i) + ".txt";
+        // 第 0 个只有一行，goto 2 失败
+        string text = i == 0 ? "foo foo" : random_text(rng, rng() % 8 == 0 ? 300000 : rng() % 3000, "fo o\n");
+        write_file(name, text);
+        files.push_back(name);
+        texts.push_back(text);
+    }
+    files.push_back(dir + "/missing.txt");
+    size_t reported = 0;
+    auto results = run_batch(cmds, files, 4, SIZE_MAX, [&](const BatchResult&) { ++reported; });
+    CHECK(results.size() == files.size() && reported == files.size());
+    for (size_t i = 0; i < texts.size(); ++i) {
+        string want = texts[i];
+        bool ok = batch_model(want);
+        CHECK(results[i].file == files[i]);
+        CHECK(results[i].ok == ok);
+        if (ok) {
+            CHECK(results[i].changed);
+            CHECK(read_file(files[i]) == want);
+        } else {
+            CHECK(results[i].err == "line 2: goto 2: file has 1 lines");
+            CHECK(read_file(files[i]) == texts[i]);
+        }
+    }
+    CHECK(!results.back().ok && !results.back().err.empty());
+
+    // 没有命中时不改文件；超出内存上限时放弃，不保存
+    CHECK(parse_batch_script("replace zzz y\n", cmds, err));
+    BatchResult r = run_batch_file(cmds, files[1], SIZE_MAX);
+    CHECK(r.ok && !r.changed && r.edits == 0);
+    CHECK(parse_batch_script("insert abc\n", cmds, err));
+    string before = read_file(files[2]);
+    r = run_batch_file(cmds, files[2], 1);
+    CHECK(!r.ok && r.err == "line 1: memory limit exceeded");
+    CHECK(read_file(files[2]) == before);
+    remove_tree(dir);
+}
+
+// 解码：合法的一到四字节序列，以及单独的续字节、过长编码、代理项、
+// 超出范围和被截断的序列
+static void test_utf8() {
+    struct {
+        const char* s;
+        size_t n;
+        uint32_t cp;
+        size_t step;
+    } cases[] = {
+        {"a", 1, 'a', 1},
+        {"\xC3\xA9", 2, 0xE9, 2},
+        {"\xE4\xB8\xAD", 3, 0x4E2D, 3},
+        {"\xF0\x9F\x98\x80", 4, 0x1F600, 4},
+        {"\x80z", 2, 0xFFFD, 1},
+        {"\xC0\x80", 2, 0xFFFD, 1},
+        {"\xE0\x80\x80", 3, 0xFFFD, 1},
+        {"\xED\xA0\x80", 3, 0xFFFD, 1},
+        {"\xF4\x90\x80\x80", 4, 0xFFFD, 1},
+        {"\xE4\xB8", 2, 0xFFFD, 1},
+        {"\xC3z", 2, 0xFFFD, 1},
+        {"\xFF", 1, 0xFFFD, 1},
+    };
+    for (auto& c : cases) {
+        size_t i = 0;
+        uint32_t cp = utf8_next(c.s, c.n, i);
+        if (cp != c.cp || i != c.step) fprintf(stderr, "utf8_next: U+%04X after %zu bytes\n", cp, i);
+        CHECK(cp == c.cp && i == c.step);
+    }
+    CHECK(char_width('a') == 1 && char_width(0xE9) == 1);
+    CHECK(char_width(0x301) == 0 && char_width(0x200B) == 0);
+    CHECK(char_width(0x4E2D) == 2 && char_width(0xFF21) == 2 && char_width(0x1F600) == 2);
+    CHECK(char_width(0xFFFD) == 1);
+}
+
+// 宽字符、组合字符和非法字节在一行里的列，以及自动换行
+static void test_columns() {
+    ColumnMap m;
+    m.build("hello", 5);
+    CHECK(m.col.empty() && m.width() == 5 && m.to_byte(3) == 3 && m.wrap_rows(2) == 3);
+
+    string s = "ab\xE4\xB8\xAD";                    // ab中
+    m.build(s.data(), s.size());
+    CHECK(m.width() == 4);
+    CHECK(m.to_col(2) == 2 && m.to_col(3) == 2 && m.to_col(5) == 4);
+    CHECK(m.to_byte(3) == 2 && m.to_byte(4) == 5 && m.to_byte(9) == 5);
+    CHECK(m.next(2) == 5 && m.prev(5) == 2 && m.prev(4) == 2);
+    // 宽字符在第 3 列放不下，整个挪到下一屏幕行
+    CHECK(m.wrap_rows(3) == 2 && m.wrap_next(0, 3) == 2 && m.wrap_next(2, 3) == UINT64_MAX);
+
+    s = "e\xCC\x81x";                                 // e + 组合重音 + x
+    m.build(s.data(), s.size());
+    CHECK(m.width() == 2 && m.to_col(1) == 0 && m.to_col(2) == 0 && m.to_col(3) == 1);
+    CHECK(m.next(0) == 3 && m.prev(3) == 0 && m.to_byte(1) == 3);
+
+    s = "a\xFF\xE4\xB8z";                           // 非法字节各占一列
+    m.build(s.data(), s.size());
+    CHECK(m.width() == 5 && m.next(1) == 2 && m.next(2) == 3 && m.to_col(4) == 4);
+
+    // 随机的行：每个字节都落在某个簇里，簇的起始列随字节单调，
+    // 换行后的各屏幕行不超过 cols
+    mt19937 rng(13);
+    const char* parts[] = {"a", " ", "\xC3\xA9", "\xE4\xB8\xAD", "\xCC\x81", "\xF0\x9F\x98\x80", "\xFF", "\xE4"};
+    for (int t = 0; t < 300; ++t) {
+        s.clear();
+        for (int k = rng() % 40; k > 0; --k) s += parts[rng() % 8];
+        m.build(s.data(), s.size());
+        size_t bad = 0;
+        for (uint64_t b = 0; b < s.size(); ++b) {
+            // 只有零宽字符的行首簇不占列，按列找回去是行尾
+            uint64_t a = m.to_col(b) < m.width() ? m.to_byte(m.to_col(b)) : m.prev(m.next(b));
+            bad += a > b || m.next(a) <= b || m.prev(m.next(b)) > b;
+            bad += b > 0 && m.to_col(b) < m.to_col(b - 1);
+        }
+        uint64_t cols = 2 + rng() % 6, rows = 1;
+        for (uint64_t c = 0, n; (n = m.wrap_next(c, cols)) != UINT64_MAX; c = n, ++rows) bad += n <= c || n - c > cols;
+        bad += rows != m.wrap_rows(cols);
+        CHECK(bad == 0);
+    }
+}
+
+// 目录搜索：.gitignore 的注释、取反、只匹配目录、锚定和 **，下层目录的规则优先；
+// 隐藏文件、符号链接和二进制文件不搜
+static void test_grep() {
+    string dir = make_temp_dir();
+    if (dir.empty()) return;
+    for (const char* d : {"sub", "build", "docs", "docs/a", "docs/a/b", ".hidden"})
+        mkdir((dir + "/" + d).c_str(), 0755);
+    write_file(dir + "/.gitignore", "# 注释\n*.log\nbuild/\n/top.txt\n!keep.log\ndocs/**/gen.txt\n*.md \n");
+    write_file(dir + "/sub/.gitignore", "!x.log\n");
+    const char* searched[] = {"a.txt", "sub/top.txt", "keep.log", "sub/build", "sub/x.log", "docs/a/other.txt"};
+    const char* ignored[] = {"top.txt", "x.log", "build/b.txt", "docs/a/b/gen.txt", "r.md", "sub/r.md",
+                             ".h.txt", ".hidden/h.txt"};
+    for (const char* f : searched) write_file(dir + "/" + f, "needle\n");
+    for (const char* f : ignored) write_file(dir + "/" + f, "needle\n");
+    write_file(dir + "/multi.txt", "x\nfoo needle needle\nneedle");
+    write_file(dir + "/bin.dat", string("needle\0\1\2", 9));
+    CHECK(symlink((dir + "/a.txt").c_str(), (dir + "/link.txt").c_str()) == 0);
+
+    string err;
+    auto job = start_grep(dir, "needle", false, err);
+    CHECK(job);
+    if (!job) return;
+    {
+        unique_lock<mutex> lk(job->mu);
+        job->cv.wait(lk, [&] { return job->pending == 0; });
+    }
+    vector<GrepHit> hits;
+    CHECK(collect_grep(*job, hits));
+    set<string> got;
+    for (const GrepHit& h : hits) {
+        string rel = h.path.compare(0, dir.size() + 1, dir + "/") == 0 ? h.path.substr(dir.size() + 1) : h.path;
+        if (rel != "multi.txt") CHECK(h.line == 0 && h.col == 0 && h.text == "needle");
+        got.insert(rel + ":" + to_string(h.line) + ":" + to_string(h.col));
+    }
+    set<string> want = {"multi.txt:1:4", "multi.txt:2:0"};
+    for (const char* f : searched) want.insert(string(f) + ":0:0");
+    if (got != want)
+        for (const string& s : got) fprintf(stderr, "grep hit %s%s\n", s.c_str(), want.count(s) ? "" : " (unexpected)");
+    CHECK(got == want);
+    CHECK(hits.size() == want.size());
+    CHECK(job->skipped == 1 && !job->truncated);
+
+    // 正则搜索，以及不是目录、正则写错时直接报错
+    job = start_grep(dir + "/sub", "ne+dle$", true, err);
+    CHECK(job);
+    if (job) {
+        hits.clear();
+        while (!collect_grep(*job, hits)) this_thread::sleep_for(chrono::milliseconds(1));
+        CHECK(hits.size() == 4);     // 从 sub 开始时上层的 .gitignore 不算，r.md 也要搜
+    }
+    CHECK(!start_grep(dir + "/a.txt", "x", false, err) && err == dir + "/a.txt: not a directory");
+    CHECK(!start_grep(dir, "a(b", true, err) && !err.empty());
+    remove_tree(dir);
+}
+
+int main() {
+    struct {
+        const char* name;
+        void (*fn)();
+    } tests[] = {
+        {"piece_table", test_piece_table},
+        {"regex", test_regex},
+        {"search_chunks", test_search_chunks},
+        {"lex_state", test_lex_state},
+        {"save_symlink", test_save_symlink},
+        {"sidecar", test_sidecar},
+        {"line_index", test_line_index},
+        {"journal", test_journal},
+        {"replace_ranges", test_replace_ranges},
+        {"json", test_json},
+        {"block_index", test_block_index},
+        {"folds", test_folds},
+        {"reload", test_reload},
+        {"batch_parse", test_batch_parse},
+        {"batch_run", test_batch_run},
+        {"utf8", test_utf8},
+        {"columns", test_columns},
+        {"grep", test_grep},
+    };
+    for (auto& t : tests) {
+        int before = failures;
+        t.fn();
+        printf("%-16s %s\n", t.name, failures == before ? "ok" : "FAILED");
+    }
+    stop_log();
+    return failures ? 1 : 0;
+}